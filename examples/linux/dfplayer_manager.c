@@ -0,0 +1,516 @@
+/* \file dfplayer_manager.c
+ * \brief Drives many dfplayer devices on Linux serial ports from epoll event loops
+ *
+ * Each event loop owns an epoll instance, a single timerfd that advances the loop's timer wheel,
+ * an eventfd used to stop it and one that wakes it to send commands submitted by other threads.
+ * Devices are in their loop's wheel and are only ticked when one of their retransmissions,
+ * timeouts or scheduled commands is due. Serial ports are non-blocking and edge-triggered; all
+ * available input is read in bulk and output that can't be written immediately is kept per
+ * device until the port becomes writable again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "dfplayer_manager.h"
+
+#define MANAGER_READ_LENGTH     512  /* bytes per read() */
+#define MANAGER_OUTPUT_LENGTH   1024 /* bytes of unsent output per device */
+#define MANAGER_MAX_EVENTS      64
+
+typedef struct manager_loop_s manager_loop_t;
+
+typedef struct manager_device_s
+{
+	manager_loop_t *loop;
+	int fd;
+	void *dfplayer;
+	void *token;
+	bool closed;
+	uint32_t output_length;
+	uint8_t output[MANAGER_OUTPUT_LENGTH];
+	void *storage[]; /* the dfplayer context, allocated with the device */
+} manager_device_t;
+
+struct manager_loop_s
+{
+	dfplayer_manager_t *manager;
+	pthread_t thread;
+	int epoll_fd;
+	int timer_fd;
+	int wake_fd;
+	int submit_fd;
+	int submit_pending; /* submit_fd has been signalled and the loop hasn't drained yet */
+	void *wheel;
+	bool stop;
+	manager_device_t **devices;
+	unsigned int device_count;
+	unsigned int open_count;
+};
+
+struct dfplayer_manager_s
+{
+	manager_loop_t *loops;
+	unsigned int loop_count;
+	unsigned int next_loop; /* devices are placed round-robin */
+};
+
+static int OpenSerial(const char *port, unsigned int speed);
+static uint32_t GetTimeMs(void);
+static int Manager_LoopInitialize(manager_loop_t *loop, dfplayer_manager_t *manager, unsigned int tick_interval);
+static void *Manager_LoopThread(void *arg);
+static void Manager_LoopRun(manager_loop_t *loop);
+static void Manager_HandleTimer(manager_loop_t *loop);
+static void Manager_HandleSubmit(manager_loop_t *loop);
+static void Manager_HandleInput(manager_device_t *device);
+static void Manager_HandleOutput(manager_device_t *device);
+static void Manager_CloseDevice(manager_device_t *device);
+static int Manager_SendBatch(void *context, void *token, uint8_t *frames, uint32_t count);
+
+/* -------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+dfplayer_manager_t *dfplayer_ManagerCreate(const dfplayer_manager_config_t *config)
+{
+	dfplayer_manager_t *manager;
+	unsigned int idx;
+
+	manager = (dfplayer_manager_t *) calloc(1, sizeof(*manager));
+	if(NULL == manager)
+		return NULL;
+
+	manager->loop_count = (config->threads > 0) ? config->threads : 1;
+	manager->loops = (manager_loop_t *) calloc(manager->loop_count, sizeof(*manager->loops));
+	if(NULL == manager->loops)
+	{
+		free(manager);
+		return NULL;
+	}
+
+	for(idx = 0; idx < manager->loop_count; ++idx)
+	{
+		if(Manager_LoopInitialize(&manager->loops[idx], manager, config->tick_interval) != 0)
+		{
+			manager->loop_count = idx + 1;
+			dfplayer_ManagerDestroy(manager);
+			return NULL;
+		}
+	}
+
+	return manager;
+}
+
+void dfplayer_ManagerDestroy(dfplayer_manager_t *manager)
+{
+	unsigned int idx;
+	unsigned int device;
+
+	for(idx = 0; idx < manager->loop_count; ++idx)
+	{
+		manager_loop_t *loop = &manager->loops[idx];
+
+		for(device = 0; device < loop->device_count; ++device)
+		{
+			Manager_CloseDevice(loop->devices[device]);
+			dfplayer_Deinitialize(loop->devices[device]->dfplayer);
+			free(loop->devices[device]);
+		}
+		free(loop->devices);
+
+		if(loop->epoll_fd >= 0) close(loop->epoll_fd);
+		if(loop->timer_fd >= 0) close(loop->timer_fd);
+		if(loop->wake_fd >= 0) close(loop->wake_fd);
+		if(loop->submit_fd >= 0) close(loop->submit_fd);
+		free(loop->wheel);
+	}
+
+	free(manager->loops);
+	free(manager);
+}
+
+void *dfplayer_ManagerAddDevice(dfplayer_manager_t *manager, const char *port, unsigned int speed,
+	dfplayer_init_info_t *init_info, void *token)
+{
+	manager_loop_t *loop = &manager->loops[manager->next_loop];
+	manager_device_t **devices;
+	manager_device_t *device;
+	dfplayer_init_info_t info;
+	struct epoll_event event;
+
+	devices = (manager_device_t **) realloc(loop->devices, (loop->device_count + 1) * sizeof(*devices));
+	if(NULL == devices)
+		return NULL;
+	loop->devices = devices;
+
+	device = (manager_device_t *) calloc(1, sizeof(*device) + dfplayer_ContextSize());
+	if(NULL == device)
+		return NULL;
+	device->loop = loop;
+	device->token = token;
+
+	device->fd = OpenSerial(port, speed);
+	if(device->fd < 0)
+	{
+		free(device);
+		return NULL;
+	}
+
+	info = *init_info;
+	info.pfnSendSerial = NULL;
+	info.pfnSendSerialBatch = Manager_SendBatch;
+	info.wheel = loop->wheel;
+	device->dfplayer = dfplayer_InitializeInPlace(device->storage, dfplayer_ContextSize(), device, &info);
+	if(NULL == device->dfplayer)
+	{
+		close(device->fd);
+		free(device);
+		return NULL;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.ptr = device;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, device->fd, &event) != 0)
+	{
+		fprintf(stderr, "%s: Failed to add '%s' to epoll: %d (%s)\n", __func__, port, errno, strerror(errno));
+		close(device->fd);
+		dfplayer_Deinitialize(device->dfplayer);
+		free(device);
+		return NULL;
+	}
+
+	loop->devices[loop->device_count++] = device;
+	++(loop->open_count);
+	manager->next_loop = (manager->next_loop + 1) % manager->loop_count;
+
+	return device->dfplayer;
+}
+
+void *dfplayer_ManagerDeviceToken(void *device)
+{
+	return ((manager_device_t *) device)->token;
+}
+
+int dfplayer_ManagerRun(dfplayer_manager_t *manager)
+{
+	unsigned int idx;
+	int result = 0;
+
+	for(idx = 1; idx < manager->loop_count; ++idx)
+	{
+		if(pthread_create(&manager->loops[idx].thread, NULL, Manager_LoopThread, &manager->loops[idx]) != 0)
+		{
+			fprintf(stderr, "%s: Failed to start event loop %u\n", __func__, idx);
+			manager->loop_count = idx; /* run what was started */
+			result = -1;
+			break;
+		}
+	}
+
+	Manager_LoopRun(&manager->loops[0]);
+
+	for(idx = 1; idx < manager->loop_count; ++idx)
+		pthread_join(manager->loops[idx].thread, NULL);
+
+	return result;
+}
+
+int dfplayer_ManagerSubmit(void *dfplayer, uint8_t command, uint16_t parameter)
+{
+	manager_device_t *device = (manager_device_t *) ((char *) dfplayer - offsetof(manager_device_t, storage));
+	manager_loop_t *loop = device->loop;
+	uint64_t value = 1;
+
+	if(dfplayer_SubmitCommand(dfplayer, command, parameter) != 0)
+		return -1;
+
+	/* Only the first submission since the loop last drained needs to wake it */
+	if(__atomic_exchange_n(&loop->submit_pending, 1, __ATOMIC_ACQ_REL) == 0
+	&& write(loop->submit_fd, &value, sizeof(value)) != sizeof(value))
+	{
+		fprintf(stderr, "%s: Failed to wake event loop\n", __func__);
+	}
+
+	return 0;
+}
+
+void dfplayer_ManagerStop(dfplayer_manager_t *manager)
+{
+	uint64_t value = 1;
+	unsigned int idx;
+
+	for(idx = 0; idx < manager->loop_count; ++idx)
+	{
+		if(write(manager->loops[idx].wake_fd, &value, sizeof(value)) != sizeof(value))
+			fprintf(stderr, "%s: Failed to wake event loop %u\n", __func__, idx);
+	}
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Event Loop
+ */
+
+static int Manager_LoopInitialize(manager_loop_t *loop, dfplayer_manager_t *manager, unsigned int tick_interval)
+{
+	struct itimerspec interval;
+	struct epoll_event event;
+
+	loop->manager = manager;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop->submit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(loop->epoll_fd < 0 || loop->timer_fd < 0 || loop->wake_fd < 0 || loop->submit_fd < 0)
+	{
+		fprintf(stderr, "%s: Failed to create event loop: %d (%s)\n", __func__, errno, strerror(errno));
+		return -1;
+	}
+
+	loop->wheel = malloc(dfplayer_WheelSize());
+	if(dfplayer_WheelInitialize(loop->wheel, dfplayer_WheelSize(), GetTimeMs()) == NULL)
+	{
+		fprintf(stderr, "%s: Failed to create timer wheel\n", __func__);
+		return -1;
+	}
+
+	memset(&interval, 0, sizeof(interval));
+	interval.it_interval.tv_sec = tick_interval / 1000;
+	interval.it_interval.tv_nsec = (tick_interval % 1000) * 1000000L;
+	interval.it_value = interval.it_interval;
+	if(tick_interval > 0 && timerfd_settime(loop->timer_fd, 0, &interval, NULL) != 0)
+		return -1;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = &loop->timer_fd;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) != 0)
+		return -1;
+	event.data.ptr = &loop->wake_fd;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) != 0)
+		return -1;
+	event.data.ptr = &loop->submit_fd;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->submit_fd, &event) != 0)
+		return -1;
+
+	return 0;
+}
+
+static void *Manager_LoopThread(void *arg)
+{
+	Manager_LoopRun((manager_loop_t *) arg);
+	return NULL;
+}
+
+static void Manager_LoopRun(manager_loop_t *loop)
+{
+	struct epoll_event events[MANAGER_MAX_EVENTS];
+	int count;
+	int idx;
+
+	while(!loop->stop && loop->open_count > 0)
+	{
+		count = epoll_wait(loop->epoll_fd, events, MANAGER_MAX_EVENTS, -1);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: epoll_wait failed: %d (%s)\n", __func__, errno, strerror(errno));
+			break;
+		}
+
+		for(idx = 0; idx < count; ++idx)
+		{
+			void *source = events[idx].data.ptr;
+
+			if(source == &loop->timer_fd)
+				Manager_HandleTimer(loop);
+			else if(source == &loop->wake_fd)
+				loop->stop = true;
+			else if(source == &loop->submit_fd)
+				Manager_HandleSubmit(loop);
+			else
+			{
+				manager_device_t *device = (manager_device_t *) source;
+
+				if(events[idx].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+					Manager_HandleInput(device);
+				if(!device->closed && (events[idx].events & EPOLLOUT))
+					Manager_HandleOutput(device);
+			}
+		}
+	}
+}
+
+static void Manager_HandleTimer(manager_loop_t *loop)
+{
+	uint64_t expirations;
+
+	if(read(loop->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	(void) dfplayer_WheelTick(loop->wheel, GetTimeMs());
+}
+
+static void Manager_HandleSubmit(manager_loop_t *loop)
+{
+	uint64_t count;
+	unsigned int idx;
+
+	if(read(loop->submit_fd, &count, sizeof(count)) != sizeof(count))
+		return;
+
+	/* Clear the flag first, so a command submitted during the drain signals again */
+	(void) __atomic_exchange_n(&loop->submit_pending, 0, __ATOMIC_ACQ_REL);
+	for(idx = 0; idx < loop->device_count; ++idx)
+	{
+		manager_device_t *device = loop->devices[idx];
+
+		if(!device->closed && dfplayer_DrainCommands(device->dfplayer) > 0)
+			(void) dfplayer_Flush(device->dfplayer);
+	}
+}
+
+static void Manager_HandleInput(manager_device_t *device)
+{
+	uint8_t data[MANAGER_READ_LENGTH];
+	ssize_t result;
+
+	/* Edge-triggered; read until the port is drained. With VMIN and VTIME of 0, a drained
+	 * terminal may return 0 rather than EAGAIN; a hang-up shows up as an error. */
+	for(;;)
+	{
+		result = read(device->fd, data, sizeof(data));
+		if(result > 0)
+		{
+			dfplayer_HandleSerialBuffer(device->dfplayer, data, result);
+			(void) dfplayer_DispatchEvents(device->dfplayer); /* for builds with DFPLAYER_DEFERRED_EVENTS */
+		}
+		else if(result < 0 && errno == EINTR)
+			continue;
+		else if(result == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		else
+		{
+			Manager_CloseDevice(device);
+			return;
+		}
+	}
+
+	/* Send whatever the received messages caused to be queued */
+	(void) dfplayer_Flush(device->dfplayer);
+}
+
+static void Manager_HandleOutput(manager_device_t *device)
+{
+	ssize_t result;
+
+	while(device->output_length > 0)
+	{
+		result = write(device->fd, device->output, device->output_length);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			break;
+		memmove(device->output, device->output + result, device->output_length - result);
+		device->output_length -= result;
+	}
+}
+
+static void Manager_CloseDevice(manager_device_t *device)
+{
+	if(device->closed)
+		return;
+
+	device->closed = true;
+	epoll_ctl(device->loop->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+	close(device->fd);
+	--(device->loop->open_count);
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Serial Port
+ */
+
+static int Manager_SendBatch(void *context, void *token, uint8_t *frames, uint32_t count)
+{
+	manager_device_t *device = (manager_device_t *) token;
+	uint32_t bytes = count * DFPLAYER_FRAME_LENGTH;
+	ssize_t written = 0;
+
+	if(device->closed)
+		return -1;
+
+	/* The batch is sent whole or not at all: whatever a write leaves must fit in the output
+	 * buffer, or the device would get a frame cut short */
+	if(bytes > MANAGER_OUTPUT_LENGTH - device->output_length)
+		return -1; /* lost; the transmit queue retransmits if it's enabled */
+
+	/* Write directly unless earlier output is still waiting, which must go first */
+	if(device->output_length == 0)
+	{
+		written = write(device->fd, frames, bytes);
+		if(written < 0)
+			written = 0;
+	}
+
+	memcpy(device->output + device->output_length, frames + written, bytes - written);
+	device->output_length += bytes - written;
+
+	return 0;
+}
+
+static int OpenSerial(const char *port, unsigned int speed)
+{
+	struct termios tty;
+	int fd;
+
+	fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0)
+	{
+		fprintf(stderr, "%s: Error opening '%s': %d (%s)\n", __func__, port, errno, strerror(errno));
+		return -1;
+	}
+
+	memset(&tty, 0, sizeof(tty));
+	if(tcgetattr(fd, &tty) != 0)
+	{
+		fprintf(stderr, "%s: Error from tcgetattr %d (%s)\n", __func__, errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	cfsetospeed(&tty, speed);
+	cfsetispeed(&tty, speed);
+
+	cfmakeraw(&tty);
+	tty.c_cc[VMIN]  = 0;
+	tty.c_cc[VTIME] = 0;
+	tty.c_cflag |= (CLOCAL | CREAD);
+	tty.c_cflag &= ~(PARENB | PARODD | CSTOPB | CRTSCTS);
+
+	if(tcsetattr(fd, TCSANOW, &tty) != 0)
+	{
+		fprintf(stderr, "%s: Error from tcsetattr %d (%s)\n", __func__, errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static uint32_t GetTimeMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
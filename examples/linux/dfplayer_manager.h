@@ -0,0 +1,49 @@
+/* \file dfplayer_manager.h
+ * \brief Drives many dfplayer devices on Linux serial ports from epoll event loops
+ */
+#ifndef _DFPLAYER_MANAGER_H
+#define _DFPLAYER_MANAGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dfplayer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dfplayer_manager_s dfplayer_manager_t;
+
+typedef struct dfplayer_manager_config_s
+{
+	unsigned int threads;        /* event loops, each on its own thread; devices are spread across them */
+	unsigned int tick_interval;  /* milliseconds between timer wheel advances */
+} dfplayer_manager_config_t;
+
+dfplayer_manager_t *dfplayer_ManagerCreate(const dfplayer_manager_config_t *config);
+void dfplayer_ManagerDestroy(dfplayer_manager_t *manager);
+
+/* Opens a serial port and initializes a dfplayer context for it. The manager supplies the send
+ * callback, so init_info->pfnSendSerial and pfnSendSerialBatch are ignored. Handlers receive the
+ * manager's device as their token; dfplayer_ManagerDeviceToken() returns the token given here.
+ * Devices must be added before dfplayer_ManagerRun(). Returns the device's dfplayer context. */
+void *dfplayer_ManagerAddDevice(dfplayer_manager_t *manager, const char *port, unsigned int speed,
+	dfplayer_init_info_t *init_info, void *token);
+void *dfplayer_ManagerDeviceToken(void *device);
+
+/* Runs the event loops until every device is closed or dfplayer_ManagerStop() is called. The
+ * calling thread runs the first loop. dfplayer commands for a device should be issued from its
+ * loop's thread, e.g. from the device's handlers, or submitted with dfplayer_ManagerSubmit(). */
+int dfplayer_ManagerRun(dfplayer_manager_t *manager);
+void dfplayer_ManagerStop(dfplayer_manager_t *manager);
+
+/* Queues a command for a device from any thread and wakes the device's loop, which sends it; see
+ * dfplayer_SubmitCommand(). Needs a library built with DFPLAYER_SUBMIT_QUEUE. Returns -1 if the
+ * command is invalid or the device's submission queue is full. */
+int dfplayer_ManagerSubmit(void *dfplayer, uint8_t command, uint16_t parameter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DFPLAYER_MANAGER_H */
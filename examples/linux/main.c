@@ -3,155 +3,113 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdbool.h>
-#include <errno.h>
 #include <termios.h>
-#include <malloc.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/time.h>
+#include <signal.h>
+#include <time.h>
 #include "dfplayer.h"
-
-static int OpenSerial(const char *port, unsigned int speed, unsigned int parity);
-static bool SerialReceive(void *dfplayer, int fd);
+#include "dfplayer_manager.h"
 
 static void dfplayer_HandleInitialize(void *context, void *token, uint16_t devices_online);
 static void dfplayer_HandleTrackFinished(void *context, void *token, uint16_t track_number, uint16_t device);
 static void dfplayer_HandleDeviceState(void *context, void *token, uint16_t device, bool inserted);
 static void dfplayer_HandleError(void *context, void *token, dfplayerError_e error);
 static void dfplayer_HandleReply(void *context, void *token);
-static int dfplayer_SerialSend(void *context, void *token, uint8_t *data, uint32_t bytes);
+static void dfplayer_HandleCommandComplete(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result);
+static uint32_t GetTraceTimestamp(void *context, void *token);
+static void SaveTrace(const char *prefix, const char *port, void *context);
 
-typedef struct app_info_s
+/* Shared by every device */
+static const dfplayer_handlers_t g_handlers =
 {
-	int fd;
-} app_info_t;
+	.pfnHandleInitialize = dfplayer_HandleInitialize,
+	.pfnHandleTrackFinished = dfplayer_HandleTrackFinished,
+	.pfnHandleDeviceState = dfplayer_HandleDeviceState,
+	.pfnHandleError = dfplayer_HandleError,
+	.pfnHandleReply = dfplayer_HandleReply,
+	.pfnHandleCommandComplete = dfplayer_HandleCommandComplete
+};
+static void HandleSignal(int signal_number);
+
+static dfplayer_manager_t *g_manager;
 
 int main(int argc, char *argv[])
 {
-	const char *portname;
-	int fd;
-	bool done = false;
-	void *dfplayer;
+	dfplayer_manager_config_t config;
+	dfplayer_manager_t *manager;
 	dfplayer_init_info_t init_info;
-	app_info_t *app_info;
+	const char *trace_prefix = NULL;
+	void **contexts;
+	int option;
+	int idx;
 
-	if(argc < 2)
-	{
-		fprintf(stderr, "%s [port]\n", argv[0]);
-		return -1;
-	}
-	portname = argv[1];
+	memset(&config, 0, sizeof(config));
+	config.threads = 1;
+	config.tick_interval = 50; /* milliseconds */
 
-	fd = OpenSerial(portname, B9600, 0);
-	if(fd < 0)
+	while((option = getopt(argc, argv, "t:T:")) != -1)
 	{
-        	fprintf(stderr, "Error opening serial port '%s': %d (%s)\n",
-			portname, errno, strerror(errno));
-		return -1;
+		switch(option)
+		{
+			case 't': config.threads = atoi(optarg); break;
+			case 'T': trace_prefix = optarg; break;
+			default: optind = argc; break;
+		}
 	}
 
-	app_info = (app_info_t *) malloc(sizeof(*app_info));
-	if(NULL == app_info)
+	if(optind >= argc)
 	{
-		fprintf(stderr, "Failed to allocate app info structure\n");
+		fprintf(stderr, "%s [-t threads] [-T trace file prefix] [port] [port...]\n", argv[0]);
 		return -1;
 	}
-	app_info->fd = fd;
-
-	init_info.pfnHandleInitialize = dfplayer_HandleInitialize;
-	init_info.pfnHandleTrackFinished = dfplayer_HandleTrackFinished;
-	init_info.pfnHandleDeviceState = dfplayer_HandleDeviceState;
-	init_info.pfnHandleError = dfplayer_HandleError;
-	init_info.pfnHandleReply = dfplayer_HandleReply;
-	init_info.pfnSendSerial = dfplayer_SerialSend; 
-	dfplayer = dfplayer_Initialize((void *) app_info, &init_info);
-	if(NULL == dfplayer)
+
+	manager = dfplayer_ManagerCreate(&config);
+	if(NULL == manager)
 	{
-		fprintf(stderr, "Failed to initialize dfplayer\n");
+		fprintf(stderr, "Failed to create dfplayer manager\n");
 		return -1;
 	}
 
-	while(!done)	
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.handlers = &g_handlers;
+	init_info.tx_window = 1;
+	init_info.tx_retries = 2;
+	init_info.tx_timeout = 500; /* milliseconds */
+	init_info.pfnTraceTimestamp = GetTraceTimestamp;
+
+	contexts = (void **) calloc(argc, sizeof(*contexts));
+	for(idx = optind; idx < argc; ++idx)
 	{
-		done = SerialReceive(dfplayer, fd);
+		contexts[idx] = dfplayer_ManagerAddDevice(manager, argv[idx], B9600, &init_info, argv[idx]);
+		if(NULL == contexts[idx])
+		{
+			fprintf(stderr, "Failed to initialize dfplayer on '%s'\n", argv[idx]);
+			dfplayer_ManagerDestroy(manager);
+			return -1;
+		}
 	}
 
-	printf("Done\n");
-	close(fd);
-
-	return 0;
-}
+	g_manager = manager;
+	signal(SIGINT, HandleSignal);
+	signal(SIGTERM, HandleSignal);
 
-/* -------------------------------------------------------------------------------------------
- * Serial Port 
- */
+	dfplayer_ManagerRun(manager);
 
-static bool SerialReceive(void *dfplayer, int fd)
-{
-	uint8_t data;
-	bool done = false;
-	fd_set fdRead;
-	struct timeval timeout;
-
-	FD_ZERO(&fdRead);
-	FD_SET(fd, &fdRead);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 100000L;
-	if(select(fd + 1, &fdRead, NULL, NULL, &timeout) > 0)
+	if(NULL != trace_prefix)
 	{
-		int result = read(fd, &data, sizeof(data));
-		if(result > 0)
-			dfplayer_HandleSerialChar(dfplayer, data);
-		else if(result < 0)
-			done = true;
+		for(idx = optind; idx < argc; ++idx)
+			SaveTrace(trace_prefix, argv[idx], contexts[idx]);
 	}
 
-	return done;
-}
+	printf("Done\n");
+	dfplayer_ManagerDestroy(manager);
+	free(contexts);
 
-static int OpenSerial(const char *port, unsigned int speed, unsigned int parity)
-{
-        struct termios tty;
-	int result;
-	int fd;
-
-	fd = open(port, O_RDWR | O_NOCTTY | O_SYNC);
-
-        memset(&tty, 0, sizeof(tty));
-        result = tcgetattr(fd, &tty);
-        if(result != 0)
-        {
-                fprintf(stderr, "%s: Error from tcgetattr %d (%s)\n",
-			__func__, errno, strerror(errno));
-                return result;
-        }
-        cfsetospeed(&tty, speed);
-        cfsetispeed(&tty, speed);
-
-        tty.c_iflag &= ~IGNBRK;
-        tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-
-        tty.c_lflag = 0;
-        tty.c_oflag = 0;
-        tty.c_cc[VMIN]  = 1;
-        tty.c_cc[VTIME] = 0;
-
-        tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
-        tty.c_cflag |= (CLOCAL | CREAD);
-        tty.c_cflag &= ~(PARENB | PARODD);
-        tty.c_cflag |= parity;
-        tty.c_cflag &= ~CSTOPB;
-        tty.c_cflag &= ~CRTSCTS;
-
-        if(tcsetattr(fd, TCSANOW, &tty) != 0)
-        {
-                fprintf(stderr, "%s: Error from tcsetattr %d (%s)\n",
-			__func__, errno, strerror(errno));
-                return result;
-        }
-        return fd;
+	return 0;
 }
 
 /* -------------------------------------------------------------------------------------------
@@ -160,38 +118,85 @@ static int OpenSerial(const char *port, unsigned int speed, unsigned int parity)
 
 static void dfplayer_HandleInitialize(void *context, void *token, uint16_t devices_online)
 {
-	fprintf(stderr, "%s: Initialized (%04x device online)\n", __func__, devices_online);
+	fprintf(stderr, "%s: %s: Initialized (%04x device online)\n", __func__,
+		(const char *) dfplayer_ManagerDeviceToken(token), devices_online);
 }
 
 static void dfplayer_HandleReply(void *context, void *token)
 {
-	fprintf(stderr, "%s: Reply\n", __func__);
+	fprintf(stderr, "%s: %s: Reply\n", __func__, (const char *) dfplayer_ManagerDeviceToken(token));
+}
+
+static void dfplayer_HandleCommandComplete(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result)
+{
+	fprintf(stderr, "%s: %s: Command %02x complete (result %d)\n", __func__,
+		(const char *) dfplayer_ManagerDeviceToken(token), command, result);
 }
 
 static void dfplayer_HandleTrackFinished(void *context, void *token, uint16_t track_number, uint16_t device)
 {
-	fprintf(stderr, "%s: Track %u finished (device %04x)\n", __func__, track_number, device);
+	fprintf(stderr, "%s: %s: Track %u finished (device %04x)\n", __func__,
+		(const char *) dfplayer_ManagerDeviceToken(token), track_number, device);
 }
 
 static void dfplayer_HandleDeviceState(void *context, void *token, uint16_t device, bool inserted)
 {
-	fprintf(stderr, "%s: Device %04x %s\n", __func__, device, (inserted) ? "inserted" : "removed");
+	fprintf(stderr, "%s: %s: Device %04x %s\n", __func__,
+		(const char *) dfplayer_ManagerDeviceToken(token), device, (inserted) ? "inserted" : "removed");
 }
 
 static void dfplayer_HandleError(void *context, void *token, dfplayerError_e error)
 {
-	fprintf(stderr, "%s: Error %d\n", __func__, error);
+	fprintf(stderr, "%s: %s: Error %d\n", __func__, (const char *) dfplayer_ManagerDeviceToken(token), error);
 }
 
-static int dfplayer_SerialSend(void *context, void *token, uint8_t *data, uint32_t bytes)
+/* -------------------------------------------------------------------------------------------
+ * Frame Trace
+ */
+
+static uint32_t GetTraceTimestamp(void *context, void *token)
 {
-	app_info_t *info = (app_info_t *) token;	
-	uint8_t idx;
+	struct timespec ts;
 
-	printf("Send: ");
-	for(idx = 0; idx < bytes; ++idx)
-		printf("%s%02x", (idx == 0) ? "" : (idx % 16) ? " " : "\n", data[idx]);
-	printf("\n");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t) ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000); /* microseconds */
+}
 
-	return (write(info->fd, data, bytes) == bytes) ? 0 : -1;
+/* Writes a device's frame trace to <prefix><port name>.trace, e.g. /tmp/ttyUSB0.trace */
+static void SaveTrace(const char *prefix, const char *port, void *context)
+{
+	static dfplayer_trace_entry_t entries[1024];
+	dfplayer_trace_file_t header;
+	const char *name = strrchr(port, '/');
+	char path[256];
+	FILE *file;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = DFPLAYER_TRACE_FILE_MAGIC;
+	header.version = DFPLAYER_TRACE_FILE_VERSION;
+	header.entry_size = sizeof(dfplayer_trace_entry_t);
+	header.resolution = 1;
+	header.count = dfplayer_GetTrace(context, entries, sizeof(entries) / sizeof(entries[0]));
+
+	snprintf(path, sizeof(path), "%s%s.trace", prefix, (NULL != name) ? name + 1 : port);
+	file = fopen(path, "wb");
+	if(NULL == file)
+	{
+		fprintf(stderr, "Failed to create '%s'\n", path);
+		return;
+	}
+	if(fwrite(&header, sizeof(header), 1, file) != 1
+	|| fwrite(entries, sizeof(entries[0]), header.count, file) != header.count)
+	{
+		fprintf(stderr, "Failed to write '%s'\n", path);
+	}
+	fclose(file);
+
+	printf("Saved %u frames to %s\n", header.count, path);
+}
+
+static void HandleSignal(int signal_number)
+{
+	dfplayer_ManagerStop(g_manager);
 }
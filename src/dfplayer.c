@@ -2,7 +2,8 @@
  *  \file dfplayer.c
  *  \brief DFPlayer serial interface library
  */
-#include <malloc.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
@@ -10,55 +11,349 @@
 #include "dfplayer.h"
 
 #if defined DEBUG_PRINT
+	#include <stdio.h>
 	#define DBG(...) fprintf(stderr, __VA_ARGS__)
 #else
 	#define DBG(...)
 #endif
 
-static void dfplayer_HandleReceivedMessage(dfplayer_context_t *ctxt);
-static uint16_t dfplayer_CalculateChecksum(uint8_t *message, uint8_t length);
-static int dfplayer_SendMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1, uint8_t parameter2,
+static void dfplayer_AcceptMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t feedback, uint16_t value);
+static void dfplayer_HandleReceivedMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t feedback,
+	uint16_t value);
+static bool dfplayer_HandleFrame(dfplayer_context_t *ctxt, const uint8_t *frame);
+static uint8_t dfplayer_Resync(dfplayer_context_t *ctxt, uint8_t length);
+static int dfplayer_Row(uint8_t command);
+static bool dfplayer_Describe(uint8_t command, dfplayer_descriptor_t *descriptor);
+#if !defined DFPLAYER_NO_STATIC_FRAMES
+	static const uint8_t *dfplayer_StaticFrame(uint8_t command);
+#endif
+static void dfplayer_BuildFrame(uint8_t *frame, uint8_t command, uint8_t parameter1, uint8_t parameter2,
 	bool feedback);
+static int dfplayer_SendCommand(dfplayer_context_t *ctxt, uint8_t command, uint16_t parameter);
+static int dfplayer_SendMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1, uint8_t parameter2,
+	uint8_t priority);
+static int dfplayer_TransmitMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1,
+	uint8_t parameter2, bool feedback);
+static void dfplayer_ServiceQueue(dfplayer_context_t *ctxt);
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	static int dfplayer_QueueMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1,
+		uint8_t parameter2, uint8_t priority);
+	static uint8_t dfplayer_QueuePosition(dfplayer_context_t *ctxt, uint8_t priority);
+	static void dfplayer_TransmitCommand(dfplayer_context_t *ctxt, dfplayer_command_t *entry);
+	static void dfplayer_RemoveCommand(dfplayer_context_t *ctxt, uint8_t index);
+	static void dfplayer_CompleteCommand(dfplayer_context_t *ctxt, uint8_t index, dfplayerCommandResult_e result);
+	static bool dfplayer_CoalesceCommand(dfplayer_context_t *ctxt, uint8_t command);
+	static bool dfplayer_CoalesceVolumeSteps(dfplayer_context_t *ctxt, uint8_t command);
+	static bool dfplayer_QueuedVolume(dfplayer_context_t *ctxt, uint8_t count, uint8_t *volume);
+	static bool dfplayer_CoalescedCommand(dfplayer_context_t *ctxt, uint8_t command);
+	static void dfplayer_DropCommand(dfplayer_context_t *ctxt, uint8_t index);
+	static void dfplayer_HandleAnswer(dfplayer_context_t *ctxt, uint8_t command, uint16_t value);
+	static uint32_t dfplayer_CommandTimeout(dfplayer_context_t *ctxt, const dfplayer_command_t *entry);
+#endif
+static void dfplayer_RunSchedule(dfplayer_context_t *ctxt, uint32_t now);
+#if DFPLAYER_TX_QUEUE_LENGTH > 0 || DFPLAYER_SCHEDULE_LENGTH > 0
+	static void dfplayer_TimerArm(dfplayer_context_t *ctxt, uint32_t expires);
+#endif
+static void dfplayer_TimerUpdate(dfplayer_context_t *ctxt, uint32_t now);
+static void dfplayer_WheelPlace(dfplayer_wheel_t *wheel, dfplayer_timer_t *timer, uint32_t from);
+static void dfplayer_WheelRemove(dfplayer_wheel_t *wheel, dfplayer_timer_t *timer);
+static void dfplayer_WheelCascade(dfplayer_wheel_t *wheel, uint8_t level);
+static uint32_t dfplayer_WheelNext(const dfplayer_wheel_t *wheel);
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+	static int dfplayer_PlaylistPlay(dfplayer_context_t *ctxt);
+	static void dfplayer_PlaylistFinished(dfplayer_context_t *ctxt, uint16_t track, uint8_t device);
+	static void dfplayer_PlaylistShuffle(dfplayer_context_t *ctxt, uint8_t from);
+	static void dfplayer_PlaylistGap(dfplayer_context_t *ctxt);
+#endif
+static int dfplayer_CacheDeviceIndex(uint16_t device);
+static void dfplayer_CacheUpdate(dfplayer_context_t *ctxt, uint16_t fields);
+static void dfplayer_CacheCommand(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter2);
+
+/* Adds n to a statistics counter; building with DFPLAYER_NO_STATS leaves the counters out */
+#if !defined DFPLAYER_NO_STATS
+	#define DFPLAYER_COUNT(ctxt, counter, n) ((ctxt)->stats.counter += (n))
+#else
+	#define DFPLAYER_COUNT(ctxt, counter, n) ((void) (n))
+#endif
+
+#if defined DFPLAYER_TRACE
+	static void dfplayer_Trace(dfplayer_context_t *ctxt, uint8_t direction, const uint8_t *frame, uint32_t timestamp);
+	static void dfplayer_TraceReceived(dfplayer_context_t *ctxt, uint8_t command, uint8_t feedback, uint16_t value,
+		uint32_t timestamp);
+	#define DFPLAYER_TRACE_FRAME(ctxt, direction, frame) \
+		dfplayer_Trace(ctxt, direction, frame, DFPLAYER_TIMESTAMP(ctxt))
+	#define DFPLAYER_TRACE_RECEIVED(ctxt, command, feedback, value, timestamp) \
+		dfplayer_TraceReceived(ctxt, command, feedback, value, timestamp)
+#else
+	#define DFPLAYER_TRACE_FRAME(ctxt, direction, frame)
+	#define DFPLAYER_TRACE_RECEIVED(ctxt, command, feedback, value, timestamp)
+#endif
+
+/* Applies X to a row of the command table if the row's group is built, so rows of the groups left
+ * out disappear from everything generated from the table */
+#define DFPLAYER_IF_BUILT(X, name, code, group, priority, parameter_max, decoder, argument) \
+	DFPLAYER_IF_##group(X, DFPLAYER_NO_ROW)(name, code, group, priority, parameter_max, decoder, argument)
+#define DFPLAYER_NO_ROW(name, code, group, priority, parameter_max, decoder, argument)
+
+/* Position of each built command in the tables below */
+#define DFPLAYER_ROW_INDEX(name, code, group, priority, parameter_max, decoder, argument) DFPLAYER_ROW_##name,
+#define DFPLAYER_ROW(name, code, group, priority, parameter_max, decoder, argument) \
+	DFPLAYER_IF_BUILT(DFPLAYER_ROW_INDEX, name, code, group, priority, parameter_max, decoder, argument)
+enum { DFPLAYER_COMMANDS(DFPLAYER_ROW) DFPLAYER_ROW_COUNT };
+#undef DFPLAYER_ROW
+#undef DFPLAYER_ROW_INDEX
+
+/* Built commands, in command table order, found through dfplayer_rows; see dfplayer_Describe */
+#define DFPLAYER_DESCRIPTOR_ROW(name, code, group, priority, parameter_max, decoder, argument) \
+	{ parameter_max, DFPLAYER_DECODER_##decoder, argument, DFPLAYER_PRIORITY_##priority },
+#define DFPLAYER_DESCRIPTOR(name, code, group, priority, parameter_max, decoder, argument) \
+	DFPLAYER_IF_BUILT(DFPLAYER_DESCRIPTOR_ROW, name, code, group, priority, parameter_max, decoder, argument)
+static const dfplayer_descriptor_t dfplayer_descriptors[DFPLAYER_ROW_COUNT] DFPLAYER_FLASH =
+{
+	DFPLAYER_COMMANDS(DFPLAYER_DESCRIPTOR)
+};
+#undef DFPLAYER_DESCRIPTOR
+#undef DFPLAYER_DESCRIPTOR_ROW
+
+/* 1 + the row of each built command, by code; 0 for codes that aren't built */
+#define DFPLAYER_ROW_CODE(name, code, group, priority, parameter_max, decoder, argument) \
+	[code] = DFPLAYER_ROW_##name + 1,
+#define DFPLAYER_ROW(name, code, group, priority, parameter_max, decoder, argument) \
+	DFPLAYER_IF_BUILT(DFPLAYER_ROW_CODE, name, code, group, priority, parameter_max, decoder, argument)
+static const uint8_t dfplayer_rows[DFPLAYER_CMD_COUNT] DFPLAYER_FLASH =
+{
+	DFPLAYER_COMMANDS(DFPLAYER_ROW)
+};
+#undef DFPLAYER_ROW
+#undef DFPLAYER_ROW_CODE
+
+#if !defined DFPLAYER_NO_STATIC_FRAMES
+/* Commands that are sent and take no parameter, X(name, group); only these have a precomputed
+ * message. Messages the device sends and commands with a parameter are built when sent. */
+#define DFPLAYER_STATIC_COMMANDS(X) \
+	X(NEXT_TRACK, CONTROL) X(PREVIOUS_TRACK, CONTROL) X(VOLUME_UP, CONTROL) X(VOLUME_DOWN, CONTROL) \
+	X(POWER_MODE_STANDBY, SETTINGS) X(POWER_MODE_NORMAL, SETTINGS) X(RESET, CONTROL) X(PLAY, CONTROL) \
+	X(PAUSE, CONTROL) X(QUERY_STATUS, QUERY) X(QUERY_VOLUME, QUERY) X(QUERY_EQUALIZER, QUERY) \
+	X(QUERY_PLAYBACK_MODE, QUERY) X(QUERY_VERSION, QUERY) X(QUERY_TFCARD_FILES, QUERY) \
+	X(QUERY_UDISK_FILES, QUERY) X(QUERY_FLASH_FILES, QUERY) X(QUERY_TFCARD_TRACK, QUERY) \
+	X(QUERY_UDISK_TRACK, QUERY) X(QUERY_FLASH_TRACK, QUERY)
+#define DFPLAYER_NO_STATIC(name)
+
+#define DFPLAYER_STATIC_INDEX(name) DFPLAYER_STATIC_##name,
+#define DFPLAYER_STATIC(name, group) DFPLAYER_IF_##group(DFPLAYER_STATIC_INDEX, DFPLAYER_NO_STATIC)(name)
+enum { DFPLAYER_STATIC_COMMANDS(DFPLAYER_STATIC) DFPLAYER_STATIC_COUNT };
+#undef DFPLAYER_STATIC
+#undef DFPLAYER_STATIC_INDEX
+
+/* Their messages, requesting a reply, and 1 + the index of each one's message by code (0 for
+ * commands without); see dfplayer_StaticFrame */
+#define DFPLAYER_STATIC_MESSAGE(name) DFPLAYER_STATIC_FRAME(DFPLAYER_CMD_##name),
+#define DFPLAYER_STATIC(name, group) DFPLAYER_IF_##group(DFPLAYER_STATIC_MESSAGE, DFPLAYER_NO_STATIC)(name)
+static const uint8_t dfplayer_static_frames[DFPLAYER_STATIC_COUNT][DFPLAYER_MSG_LENGTH] DFPLAYER_FLASH =
+{
+	DFPLAYER_STATIC_COMMANDS(DFPLAYER_STATIC)
+};
+#undef DFPLAYER_STATIC
+#undef DFPLAYER_STATIC_MESSAGE
+
+#define DFPLAYER_STATIC_CODE(name) [DFPLAYER_CMD_##name] = DFPLAYER_STATIC_##name + 1,
+#define DFPLAYER_STATIC(name, group) DFPLAYER_IF_##group(DFPLAYER_STATIC_CODE, DFPLAYER_NO_STATIC)(name)
+static const uint8_t dfplayer_static_indexes[DFPLAYER_CMD_COUNT] DFPLAYER_FLASH =
+{
+	DFPLAYER_STATIC_COMMANDS(DFPLAYER_STATIC)
+};
+#undef DFPLAYER_STATIC
+#undef DFPLAYER_STATIC_CODE
+#endif
+
+#if defined DFPLAYER_CONTEXT_POOL_SIZE && DFPLAYER_CONTEXT_POOL_SIZE > 0
+/* Contexts handed out by dfplayer_Initialize instead of heap allocations; a slot is free while
+ * its allocation is DFPLAYER_ALLOCATION_NONE */
+static dfplayer_context_t dfplayer_context_pool[DFPLAYER_CONTEXT_POOL_SIZE];
+#endif
+
+#if defined DFPLAYER_NO_LEGACY_HANDLERS
+/* Handlers of contexts initialized without any */
+static const dfplayer_handlers_t dfplayer_no_handlers;
+#endif
+
+/* Alignment of a context, for storage supplied to dfplayer_InitializeInPlace */
+typedef struct { char c; dfplayer_context_t ctxt; } dfplayer_context_alignment_t;
+#define DFPLAYER_CONTEXT_ALIGNMENT (offsetof(dfplayer_context_alignment_t, ctxt))
+
+/* Alignment of a timer wheel, for storage supplied to dfplayer_WheelInitialize */
+typedef struct { char c; dfplayer_wheel_t wheel; } dfplayer_wheel_alignment_t;
+#define DFPLAYER_WHEEL_ALIGNMENT (offsetof(dfplayer_wheel_alignment_t, wheel))
+
+/* Marks a wheel slot, by its index in the slots array, as holding timers or as empty */
+#define DFPLAYER_WHEEL_OCCUPY(wheel, index) \
+	((wheel)->occupied[(index) / DFPLAYER_WHEEL_SLOTS][(index) % DFPLAYER_WHEEL_SLOTS / 32] |= (uint32_t) 1 << ((index) % 32))
+#define DFPLAYER_WHEEL_VACATE(wheel, index) \
+	((wheel)->occupied[(index) / DFPLAYER_WHEEL_SLOTS][(index) % DFPLAYER_WHEEL_SLOTS / 32] &= ~((uint32_t) 1 << ((index) % 32)))
+
+/* Current time; contexts in a wheel keep time with it rather than with their own ticks */
+#define DFPLAYER_NOW(ctxt) (((ctxt)->wheel != NULL) ? (ctxt)->wheel->now : (ctxt)->now)
+
+/* Timestamp for traces and measurements, from the application's clock if it gave one */
+#define DFPLAYER_TIMESTAMP(ctxt) (((ctxt)->pfnTraceTimestamp != NULL) \
+	? (ctxt)->pfnTraceTimestamp((ctxt), (ctxt)->token) : DFPLAYER_NOW(ctxt))
+
+/* Signed distance from time b to time a, valid across wraparound */
+#define DFPLAYER_TIME_DIFF(a, b) ((int32_t) ((uint32_t) (a) - (uint32_t) (b)))
+
+/* Queued command n positions after the oldest; only with a transmit queue */
+#define DFPLAYER_TX_ENTRY(ctxt, n) (&(ctxt)->tx_queue[((ctxt)->tx_head + (n)) % DFPLAYER_TX_QUEUE_LENGTH])
 
 /* ------------------------------------------------------------------------------------------
  * Exported Functions
  */
 
+size_t dfplayer_ContextSize(void)
+{
+	return sizeof(dfplayer_context_t);
+}
+
 void *dfplayer_Initialize(void *token, dfplayer_init_info_t *init_info)
 {
 	dfplayer_context_t *ctxt = NULL;
 
-	ctxt = (dfplayer_context_t *) malloc(sizeof(*ctxt));
+#if defined DFPLAYER_CONTEXT_POOL_SIZE
+	#if DFPLAYER_CONTEXT_POOL_SIZE > 0
+	int idx;
+
+	for(idx = 0; idx < DFPLAYER_CONTEXT_POOL_SIZE; ++idx)
+	{
+		if(DFPLAYER_ALLOCATION_NONE == dfplayer_context_pool[idx].allocation)
+		{
+			ctxt = (dfplayer_context_t *) dfplayer_InitializeInPlace(&dfplayer_context_pool[idx],
+				sizeof(dfplayer_context_pool[idx]), token, init_info);
+			ctxt->allocation = DFPLAYER_ALLOCATION_POOL;
+			break;
+		}
+	}
+	#endif
 	if(NULL == ctxt)
+	{
+		DBG("%s: Context pool exhausted\n", __func__);
+	}
+#else
+	void *storage = malloc(sizeof(*ctxt));
+	if(NULL == storage)
+		return NULL;
+
+	ctxt = (dfplayer_context_t *) dfplayer_InitializeInPlace(storage, sizeof(*ctxt), token, init_info);
+	ctxt->allocation = DFPLAYER_ALLOCATION_HEAP;
+#endif
+
+	return (void *) ctxt;
+}
+
+void *dfplayer_InitializeInPlace(void *storage, size_t size, void *token, dfplayer_init_info_t *init_info)
+{
+	dfplayer_context_t *ctxt = (dfplayer_context_t *) storage;
+
+	if(NULL == storage || size < sizeof(*ctxt) || ((uintptr_t) storage % DFPLAYER_CONTEXT_ALIGNMENT) != 0)
 		return NULL;
 
 	memset(ctxt, 0, sizeof(*ctxt));
+	ctxt->allocation = DFPLAYER_ALLOCATION_CALLER;
 
 	ctxt->token = token;
-	ctxt->pfnHandleInitialize = init_info->pfnHandleInitialize;
-	ctxt->pfnHandleTrackFinished = init_info->pfnHandleTrackFinished;
-	ctxt->pfnHandleDeviceState = init_info->pfnHandleDeviceState;
-	ctxt->pfnHandleError = init_info->pfnHandleError;
-	ctxt->pfnHandleReply = init_info->pfnHandleReply;
+#if !defined DFPLAYER_NO_LEGACY_HANDLERS
+	if(NULL == init_info->handlers)
+	{
+		dfplayer_handlers_t *legacy = &ctxt->legacy_handlers;
+
+		legacy->pfnHandleInitialize = init_info->pfnHandleInitialize;
+		legacy->pfnHandleTrackFinished = init_info->pfnHandleTrackFinished;
+		legacy->pfnHandleDeviceState = init_info->pfnHandleDeviceState;
+		legacy->pfnHandleError = init_info->pfnHandleError;
+		legacy->pfnHandleReply = init_info->pfnHandleReply;
+		legacy->pfnHandleStatusResponse = init_info->pfnHandleStatusResponse;
+		legacy->pfnHandleVolumeResponse = init_info->pfnHandleVolumeResponse;
+		legacy->pfnHandleEqualizerResponse = init_info->pfnHandleEqualizerResponse;
+		legacy->pfnHandlePlaybackModeResponse = init_info->pfnHandlePlaybackModeResponse;
+		legacy->pfnHandleFileCountResponse = init_info->pfnHandleFileCountResponse;
+		legacy->pfnHandleCurrentTrackResponse = init_info->pfnHandleCurrentTrackResponse;
+		legacy->pfnHandleCommandComplete = init_info->pfnHandleCommandComplete;
+		ctxt->handlers = legacy;
+	}
+	else
+		ctxt->handlers = init_info->handlers;
+#else
+	ctxt->handlers = (init_info->handlers != NULL) ? init_info->handlers : &dfplayer_no_handlers;
+#endif
 	ctxt->pfnSendSerial = init_info->pfnSendSerial;
-	ctxt->pfnHandleStatusResponse = init_info->pfnHandleStatusResponse;
-	ctxt->pfnHandleVolumeResponse = init_info->pfnHandleVolumeResponse;
-	ctxt->pfnHandleEqualizerResponse = init_info->pfnHandleEqualizerResponse;
-	ctxt->pfnHandlePlaybackModeResponse = init_info->pfnHandlePlaybackModeResponse;
-	ctxt->pfnHandleFileCountResponse = init_info->pfnHandleFileCountResponse;
-	ctxt->pfnHandleCurrentTrackResponse = init_info->pfnHandleCurrentTrackResponse;
+#if DFPLAYER_TX_BATCH_LENGTH > 0
+	ctxt->pfnSendSerialBatch = init_info->pfnSendSerialBatch;
+#endif
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	ctxt->tx_window = init_info->tx_window;
+	if(ctxt->tx_window > DFPLAYER_TX_QUEUE_LENGTH)
+		ctxt->tx_window = DFPLAYER_TX_QUEUE_LENGTH;
+	ctxt->tx_retries = init_info->tx_retries;
+	ctxt->tx_timeout = init_info->tx_timeout;
+	ctxt->tx_coalesce = init_info->coalesce;
+	ctxt->tx_backoff = init_info->tx_backoff;
+#endif
+	ctxt->wheel = (dfplayer_wheel_t *) init_info->wheel;
+	ctxt->pfnTraceTimestamp = init_info->pfnTraceTimestamp;
+
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+	ctxt->playlist.folder = DFPLAYER_PLAYLIST_FOLDER_UNKNOWN;
+	ctxt->playlist.random = 0x2545F491;
+#endif
+
+#if defined DFPLAYER_SUBMIT_QUEUE
+	{
+		uint32_t idx;
+		for(idx = 0; idx < DFPLAYER_SUBMIT_QUEUE_LENGTH; ++idx)
+			ctxt->submit_queue[idx].sequence = idx;
+	}
+#endif
 
 	return (void *) ctxt;	
 }
 
+void dfplayer_Deinitialize(void *context)
+{
+	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+	uint8_t allocation;
+
+	if(NULL == ctxt)
+		return;
+
+	if(ctxt->wheel != NULL)
+		dfplayer_WheelRemove(ctxt->wheel, &ctxt->timer);
+
+	/* Clearing the context also returns a pool slot */
+	allocation = ctxt->allocation;
+	memset(ctxt, 0, sizeof(*ctxt));
+
+#if !defined DFPLAYER_CONTEXT_POOL_SIZE
+	if(DFPLAYER_ALLOCATION_HEAP == allocation)
+		free(ctxt);
+#else
+	(void) allocation;
+#endif
+}
+
 void dfplayer_HandleSerialChar(void *context, uint8_t c)
 {
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
 	bool done = true; 
 	bool update_checksum = true;
+	bool handled = false;
+	uint8_t rejected;
+	uint8_t replayed;
 
 	assert(NULL != ctxt);
 
+#if !defined DFPLAYER_NO_RESYNC
+	ctxt->message_buffer[ctxt->message_offset] = c;
+#endif
+
 	switch(ctxt->message_offset)
 	{
 		case 0: /* Message start */
@@ -75,6 +370,8 @@ void dfplayer_HandleSerialChar(void *context, uint8_t c)
 				DBG("%s: version\n", __func__);
 				done = false;
 			}
+			else
+				DFPLAYER_COUNT(ctxt, header_errors, 1);
 			break;
 		case 2: /* Data length */
 			if(c == DFPLAYER_MSG_DATA_LENGTH)
@@ -82,6 +379,8 @@ void dfplayer_HandleSerialChar(void *context, uint8_t c)
 				DBG("%s: length\n", __func__);
 				done = false;
 			}
+			else
+				DFPLAYER_COUNT(ctxt, header_errors, 1);
 			break;
 		case 3: /* Command */
 			ctxt->message_command = c;
@@ -119,13 +418,20 @@ void dfplayer_HandleSerialChar(void *context, uint8_t c)
 			if(c == DFPLAYER_MSG_END)
 			{
 				if(ctxt->calculated_checksum == ctxt->expected_checksum)
-					dfplayer_HandleReceivedMessage(ctxt);
+				{
+					dfplayer_AcceptMessage(ctxt, ctxt->message_command, ctxt->message_feedback,
+						((uint16_t) ctxt->message_parameter[0]) << 8 | ctxt->message_parameter[1]);
+					handled = true;
+				}
 				else
 				{
 					DBG("%s: Checksum mismatch (calculated %04x, expected %04x\n",
 						__func__, ctxt->calculated_checksum, ctxt->expected_checksum);
+					DFPLAYER_COUNT(ctxt, checksum_errors, 1);
 				}
 			}
+			else
+				DFPLAYER_COUNT(ctxt, header_errors, 1);
 			break;
 		default:
 			break;
@@ -140,369 +446,1970 @@ void dfplayer_HandleSerialChar(void *context, uint8_t c)
 	else
 	{
 		DBG("%s: restart\n", __func__);
+		rejected = ctxt->message_offset;
 		ctxt->message_offset = 0;
 		ctxt->calculated_checksum = 0;
 		ctxt->expected_checksum = 0;
 		ctxt->message_command = 0;  /* invalid command */
 		ctxt->message_feedback = 0;
+
+		if(!handled)
+		{
+			/* The rejected bytes and this one, less any the parser gets to look at again */
+			replayed = dfplayer_Resync(ctxt, rejected);
+			DFPLAYER_COUNT(ctxt, bytes_discarded, rejected + 1 - replayed);
+		}
 	}	
 } /* dfplayer_HandleSerialChar */
 
-int dfplayer_Play(void *context)
+void dfplayer_HandleSerialBuffer(void *context, const uint8_t *data, size_t length)
 {
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_PLAY, 0, 0, true);
-}
+	const uint8_t *end = data + length;
+	const uint8_t *rejected_end = data; /* end of the last rejected message */
+	const uint8_t *start;
+
+	assert(NULL != ctxt);
+
+	while(data < end)
+	{
+		/* A message split across buffers is completed by the byte parser */
+		if(ctxt->message_offset != 0)
+		{
+			dfplayer_HandleSerialChar(ctxt, *data++);
+			continue;
+		}
+
+		start = (const uint8_t *) memchr(data, DFPLAYER_MSG_START, end - data);
+		if(NULL == start)
+		{
+			DFPLAYER_COUNT(ctxt, bytes_discarded, end - data);
+			break;
+		}
+		DFPLAYER_COUNT(ctxt, bytes_discarded, start - data);
+		if(start < rejected_end)
+			DFPLAYER_COUNT(ctxt, resyncs, 1);
+		data = start;
+
+		if(end - data < DFPLAYER_MSG_LENGTH)
+			dfplayer_HandleSerialChar(ctxt, *data++);
+		else if(dfplayer_HandleFrame(ctxt, data))
+			data += DFPLAYER_MSG_LENGTH;
+		else
+		{
+			/* rescan from the byte following the bad start byte */
+			DFPLAYER_COUNT(ctxt, bytes_discarded, 1);
+			rejected_end = data + DFPLAYER_MSG_LENGTH;
+			++data;
+		}
+	}
+} /* dfplayer_HandleSerialBuffer */
 
-int dfplayer_Pause(void *context)
+int dfplayer_PushSerialChar(void *context, uint8_t c)
 {
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_PAUSE, 0, 0, true);
+#if !defined DFPLAYER_NO_RX_RING
+	uint8_t head;
+
+	assert(NULL != ctxt);
+
+	head = ctxt->rx_head;
+
+	if((uint8_t) (head - DFPLAYER_LOAD_ACQUIRE(&ctxt->rx_tail)) >= DFPLAYER_RX_RING_LENGTH)
+	{
+		DFPLAYER_COUNT(ctxt, rx_overflows, 1);
+		return -1;
+	}
+
+	ctxt->rx_ring[head % DFPLAYER_RX_RING_LENGTH] = c;
+	DFPLAYER_STORE_RELEASE(&ctxt->rx_head, (uint8_t) (head + 1));
+#else
+	dfplayer_HandleSerialChar(ctxt, c);
+#endif
+	return 0;
 }
 
-int dfplayer_NextTrack(void *context)
+size_t dfplayer_Poll(void *context)
 {
+#if !defined DFPLAYER_NO_RX_RING
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_NEXT_TRACK, 0, 0, true);
+	uint8_t tail;
+	uint8_t count;
+	uint8_t offset;
+	uint8_t first;
+
+	assert(NULL != ctxt);
+
+	tail = ctxt->rx_tail;
+	count = (uint8_t) (DFPLAYER_LOAD_ACQUIRE(&ctxt->rx_head) - tail);
+	if(0 == count)
+		return 0;
+
+	/* At most two runs, the second one after the ring wraps */
+	offset = tail % DFPLAYER_RX_RING_LENGTH;
+	first = (count < DFPLAYER_RX_RING_LENGTH - offset) ? count : DFPLAYER_RX_RING_LENGTH - offset;
+	dfplayer_HandleSerialBuffer(ctxt, &ctxt->rx_ring[offset], first);
+	if(count > first)
+		dfplayer_HandleSerialBuffer(ctxt, ctxt->rx_ring, count - first);
+
+	/* The bytes are parsed, so their slots can be reused */
+	DFPLAYER_STORE_RELEASE(&ctxt->rx_tail, (uint8_t) (tail + count));
+	return count;
+#else
+	return 0;
+#endif
 }
 
-int dfplayer_PreviousTrack(void *context)
+uint32_t dfplayer_DispatchEvents(void *context)
 {
+#if defined DFPLAYER_DEFERRED_EVENTS
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_PREVIOUS_TRACK, 0, 0, true);
+	uint8_t tail;
+	uint32_t count = 0;
+
+	assert(NULL != ctxt);
+
+	tail = ctxt->event_tail;
+	while(tail != DFPLAYER_LOAD_ACQUIRE(&ctxt->event_head))
+	{
+		dfplayer_event_t event = ctxt->event_queue[tail % DFPLAYER_EVENT_QUEUE_LENGTH];
+
+		/* Free the slot first; handlers may take a while */
+		DFPLAYER_STORE_RELEASE(&ctxt->event_tail, ++tail);
+		DFPLAYER_TRACE_RECEIVED(ctxt, event.command, event.feedback, event.value, event.timestamp);
+		dfplayer_HandleReceivedMessage(ctxt, event.command, event.feedback, event.value);
+		++count;
+	}
+	return count;
+#else
+	return 0;
+#endif
 }
 
-int dfplayer_SetTrack(void *context, uint16_t track_number)
+int dfplayer_SubmitCommand(void *context, uint8_t command, uint16_t parameter)
 {
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+	dfplayer_descriptor_t descriptor;
+#if defined DFPLAYER_SUBMIT_QUEUE
+	dfplayer_submission_t *slot;
+	uint32_t position;
+	int32_t difference;
+#endif
+
+	assert(NULL != ctxt);
+
+	if(!dfplayer_Describe(command, &descriptor))
+		return -1;
+
+#if defined DFPLAYER_SUBMIT_QUEUE
+	if(parameter > descriptor.parameter_max)
+		return -1;
 
-	if(track_number > DFPLAYER_TRACK_MAX)
+	position = DFPLAYER_LOAD_ACQUIRE(&ctxt->submit_head);
+	for(;;)
 	{
-		DBG("%s: Tack specified too high (%u, %u max)\n",
-			__func__, track_number, DFPLAYER_TRACK_MAX);
+		slot = &ctxt->submit_queue[position % DFPLAYER_SUBMIT_QUEUE_LENGTH];
+		difference = (int32_t) (DFPLAYER_LOAD_ACQUIRE(&slot->sequence) - position);
+		if(difference == 0)
+		{
+			/* The slot is free for this position; claim it unless another thread got there first,
+			 * in which case position is reloaded */
+			if(DFPLAYER_COMPARE_EXCHANGE(&ctxt->submit_head, &position, position + 1))
+				break;
+		}
+		else if(difference < 0)
+		{
+			/* The slot still holds the command submitted a lap earlier */
+#if !defined DFPLAYER_NO_STATS
+			DFPLAYER_FETCH_ADD(&ctxt->stats.submit_overflows, 1);
+#endif
+			return -1;
+		}
+		else
+			position = DFPLAYER_LOAD_ACQUIRE(&ctxt->submit_head);
 	}
 
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_TRACK, track_number >> 8,
-		track_number & 0xFF, true);
+	slot->command = command;
+	slot->parameter[0] = parameter >> 8;
+	slot->parameter[1] = parameter & 0xFF;
+	DFPLAYER_STORE_RELEASE(&slot->sequence, position + 1);
+	return 0;
+#else
+	return dfplayer_SendCommand(ctxt, command, parameter);
+#endif
 }
 
-int dfplayer_SetFolder(void *context, uint8_t folder_number)
+uint32_t dfplayer_DrainCommands(void *context)
 {
+#if defined DFPLAYER_SUBMIT_QUEUE
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+	uint32_t count = 0;
 
-	if(folder_number > DFPLAYER_TRACK_MAX)
+	assert(NULL != ctxt);
+
+	for(;;)
 	{
-		DBG("%s: Folder specified too high (%u, %u max)\n",
-			__func__, folder_number, DFPLAYER_FOLDER_MAX);
-	}
+		dfplayer_submission_t *slot = &ctxt->submit_queue[ctxt->submit_tail % DFPLAYER_SUBMIT_QUEUE_LENGTH];
+		uint8_t command;
+		uint8_t parameter1;
+		uint8_t parameter2;
+
+		/* Stop at an empty queue, or at a slot that's claimed but still being written */
+		if(DFPLAYER_LOAD_ACQUIRE(&slot->sequence) != ctxt->submit_tail + 1)
+			break;
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+		if(ctxt->tx_window != 0 && ctxt->tx_count >= DFPLAYER_TX_QUEUE_LENGTH)
+			break;
+#endif
+
+		command = slot->command;
+		parameter1 = slot->parameter[0];
+		parameter2 = slot->parameter[1];
+		DFPLAYER_STORE_RELEASE(&slot->sequence, ctxt->submit_tail + DFPLAYER_SUBMIT_QUEUE_LENGTH);
+		++(ctxt->submit_tail);
 
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_FOLDER, 0, folder_number, true);
+		(void) dfplayer_SendCommand(ctxt, command, ((uint16_t) parameter1 << 8) | parameter2);
+		++count;
+	}
+	return count;
+#else
+	return 0;
+#endif
 }
 
-int dfplayer_SetPlaybackSource(void *context, uint16_t device)
+void dfplayer_Tick(void *context, uint32_t now)
 {
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_PLAYBACK_SOURCE, device >> 8,
-		device & 0xFF, true);
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	uint8_t idx = 0;
+#endif
+
+	assert(NULL != ctxt);
+
+	ctxt->now = now;
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	while(idx < ctxt->tx_inflight)
+	{
+		dfplayer_command_t *entry = DFPLAYER_TX_ENTRY(ctxt, idx);
+
+		if((uint32_t) (now - entry->timestamp) < dfplayer_CommandTimeout(ctxt, entry))
+			++idx;
+		else if(entry->retries < ctxt->tx_retries)
+		{
+			DBG("%s: Retransmitting command %02x\n", __func__, entry->command);
+			++(entry->retries);
+			DFPLAYER_COUNT(ctxt, retransmissions, 1);
+			dfplayer_TransmitCommand(ctxt, entry);
+			++idx;
+		}
+		else
+		{
+			DBG("%s: Command %02x timed out\n", __func__, entry->command);
+			dfplayer_CompleteCommand(ctxt, idx, DFPLAYER_COMMAND_TIMEOUT); /* next entry moves to idx */
+		}
+	}
+#endif
+
+	dfplayer_RunSchedule(ctxt, now);
+	(void) dfplayer_DrainCommands(ctxt);
+	dfplayer_ServiceQueue(ctxt);
+	(void) dfplayer_Flush(ctxt);
+	dfplayer_TimerUpdate(ctxt, now);
 }
 
-int dfplayer_EnableRepeatPlayback(void *context, bool enable)
+size_t dfplayer_WheelSize(void)
 {
-	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_REPEAT, 0, (enable) ? 1 : 0, true);
+	return sizeof(dfplayer_wheel_t);
 }
 
-int dfplayer_SetEqualizer(void *context, dfplayerEqualizer_e mode)
+void *dfplayer_WheelInitialize(void *storage, size_t size, uint32_t now)
 {
-	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_EQUALIZER, 0, (uint8_t) mode, true);
+	dfplayer_wheel_t *wheel = (dfplayer_wheel_t *) storage;
+	uint8_t level;
+	uint8_t slot;
+
+	if(NULL == storage || size < sizeof(*wheel) || ((uintptr_t) storage % DFPLAYER_WHEEL_ALIGNMENT) != 0)
+		return NULL;
+
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+	for(level = 0; level < DFPLAYER_WHEEL_LEVELS; ++level)
+	{
+		for(slot = 0; slot < DFPLAYER_WHEEL_SLOTS; ++slot)
+		{
+			wheel->slots[level][slot].next = &wheel->slots[level][slot];
+			wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+		}
+	}
+
+	return (void *) wheel;
 }
 
-int dfplayer_SetPlaybackMode(void *context, dfplayerPlaybackMode_e mode)
+uint32_t dfplayer_WheelTick(void *context, uint32_t now)
 {
-	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_PLAYBACK_MODE, 0, (uint8_t) mode, true);
+	dfplayer_wheel_t *wheel = (dfplayer_wheel_t *) context;
+	uint32_t count = 0;
+
+	assert(NULL != wheel);
+
+	while(DFPLAYER_TIME_DIFF(now, wheel->now) > 0)
+	{
+		uint32_t next = dfplayer_WheelNext(wheel);
+		dfplayer_timer_t *head;
+		uint8_t level;
+
+		if(0 == next || next > (uint32_t) DFPLAYER_TIME_DIFF(now, wheel->now))
+		{
+			wheel->now = now; /* nothing to expire or move down on the way */
+			break;
+		}
+		wheel->now += next;
+
+		/* Time entering a new slot of the higher levels moves that slot's timers down, from the
+		 * highest level first so they can move down more than one level */
+		for(level = 1; level < DFPLAYER_WHEEL_LEVELS
+			&& (wheel->now & ((1UL << (DFPLAYER_WHEEL_BITS * level)) - 1)) == 0; ++level)
+		{
+		}
+		while(--level > 0)
+			dfplayer_WheelCascade(wheel, level);
+
+		head = &wheel->slots[0][wheel->now % DFPLAYER_WHEEL_SLOTS];
+		while(head->next != head)
+		{
+			dfplayer_timer_t *timer = head->next;
+
+			dfplayer_WheelRemove(wheel, timer);
+			dfplayer_Tick((char *) timer - offsetof(dfplayer_context_t, timer), wheel->now);
+			++count;
+		}
+	}
+
+	return count;
 }
 
-int dfplayer_VolumeUp(void *context)
+int dfplayer_ScheduleCommand(void *context, uint8_t command, uint16_t parameter, uint32_t at, uint32_t period)
 {
+#if DFPLAYER_SCHEDULE_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_VOLUME_UP, 0, 0, true);
+	dfplayer_descriptor_t descriptor;
+	int idx;
+
+	assert(NULL != ctxt);
+
+	if(!dfplayer_Describe(command, &descriptor) || parameter > descriptor.parameter_max)
+		return -1;
+
+	for(idx = 0; idx < DFPLAYER_SCHEDULE_LENGTH; ++idx)
+	{
+		dfplayer_schedule_t *schedule = &ctxt->schedule[idx];
+
+		if(schedule->active)
+			continue;
+		schedule->command = command;
+		schedule->parameter[0] = parameter >> 8;
+		schedule->parameter[1] = parameter & 0xFF;
+		schedule->due = at;
+		schedule->period = period;
+		schedule->active = true;
+		dfplayer_TimerArm(ctxt, at);
+		return idx;
+	}
+#endif
+	return -1;
 }
 
-int dfplayer_VolumeDown(void *context)
+int dfplayer_CancelSchedule(void *context, int schedule)
 {
+#if DFPLAYER_SCHEDULE_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_VOLUME_DOWN, 0, 0, true);
+
+	assert(NULL != ctxt);
+
+	/* The timer is left armed; when it expires, the tick finds nothing due and re-arms it */
+	if(schedule >= 0 && schedule < DFPLAYER_SCHEDULE_LENGTH && ctxt->schedule[schedule].active)
+	{
+		ctxt->schedule[schedule].active = false;
+		return 0;
+	}
+#endif
+	return -1;
 }
 
-int dfplayer_VolumeSet(void *context, uint8_t volume)
+int dfplayer_PlaylistAdd(void *context, uint16_t device, uint8_t folder, uint16_t track)
 {
+#if DFPLAYER_PLAYLIST_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	if(volume > DFPLAYER_VOL_MAX)
+	dfplayer_playlist_t *playlist;
+	dfplayer_playlist_entry_t *entry;
+
+	assert(NULL != ctxt);
+	playlist = &ctxt->playlist;
+
+	if(dfplayer_CacheDeviceIndex(device) < 0 || folder > DFPLAYER_FOLDER_MAX || track == 0
+	|| track > DFPLAYER_TRACK_MAX || playlist->count >= DFPLAYER_PLAYLIST_LENGTH)
 	{
-		DBG("%s: Volume specified too high (%u, %u max)\n", __func__, volume, DFPLAYER_VOL_MAX);
 		return -1;
 	}
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_VOLUME_SET, 0, volume, true);
+
+	entry = &playlist->entries[playlist->count];
+	entry->track = track;
+	entry->device = (uint8_t) device;
+	entry->folder = folder;
+	playlist->order[playlist->count] = playlist->count;
+	++(playlist->count);
+	return 0;
+#else
+	(void) context;
+	(void) device;
+	(void) folder;
+	(void) track;
+	return -1;
+#endif
 }
 
-int dfplayer_SetStandbyMode(void *context, bool enable)
+void dfplayer_PlaylistClear(void *context)
 {
+#if DFPLAYER_PLAYLIST_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt,
-		(enable) ? DFPLAYER_CMD_POWER_MODE_STANDBY : DFPLAYER_CMD_POWER_MODE_NORMAL,
-		0, 0, true);
+
+	assert(NULL != ctxt);
+
+	dfplayer_PlaylistStop(ctxt);
+	ctxt->playlist.count = 0;
+#else
+	(void) context;
+#endif
 }
 
-int dfplayer_Reset(void *context)
+void dfplayer_PlaylistSetMode(void *context, bool shuffle, dfplayerPlaylistRepeat_e repeat)
 {
+#if DFPLAYER_PLAYLIST_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_RESET, 0, 0, true);
+	dfplayer_playlist_t *playlist;
+	uint8_t idx;
+
+	assert(NULL != ctxt);
+	playlist = &ctxt->playlist;
+
+	playlist->repeat = (uint8_t) repeat;
+	if(shuffle == playlist->shuffle)
+		return;
+	playlist->shuffle = shuffle;
+	if(!playlist->running)
+		return; /* the order is set when it starts */
+
+	/* The entry playing stays; shuffling mixes the ones still to come in this pass, and
+	 * unshuffling carries on from the entry playing in the order added */
+	if(shuffle)
+		dfplayer_PlaylistShuffle(ctxt, playlist->position + 1);
+	else
+	{
+		playlist->position = playlist->order[playlist->position];
+		for(idx = 0; idx < playlist->count; ++idx)
+			playlist->order[idx] = idx;
+	}
+#else
+	(void) context;
+	(void) shuffle;
+	(void) repeat;
+#endif
 }
 
-int dfplayer_QueryStatus(void *context)
+int dfplayer_PlaylistStart(void *context)
 {
+#if DFPLAYER_PLAYLIST_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_QUERY_STATUS, 0, 0, true);
+	dfplayer_playlist_t *playlist;
+	uint8_t idx;
+
+	assert(NULL != ctxt);
+	playlist = &ctxt->playlist;
+
+	if(playlist->count == 0)
+		return -1;
+
+	for(idx = 0; idx < playlist->count; ++idx)
+		playlist->order[idx] = idx;
+	if(playlist->shuffle)
+	{
+		playlist->random ^= DFPLAYER_NOW(ctxt) * 0x9E3779B9UL;
+		if(playlist->random == 0)
+			playlist->random = 1;
+		dfplayer_PlaylistShuffle(ctxt, 0);
+	}
+
+	playlist->position = 0;
+	playlist->device = 0;
+	playlist->folder = DFPLAYER_PLAYLIST_FOLDER_UNKNOWN;
+	playlist->finished_track = 0;
+	playlist->gap_pending = false;
+	playlist->running = (dfplayer_PlaylistPlay(ctxt) == 0);
+	return (playlist->running) ? 0 : -1;
+#else
+	(void) context;
+	return -1;
+#endif
 }
 
-int dfplayer_QueryVolume(void *context)
+void dfplayer_PlaylistStop(void *context)
 {
+#if DFPLAYER_PLAYLIST_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_QUERY_VOLUME, 0, 0, true);
+
+	assert(NULL != ctxt);
+
+	ctxt->playlist.running = false;
+	ctxt->playlist.gap_pending = false;
+#else
+	(void) context;
+#endif
 }
 
-int dfplayer_QueryEqualizer(void *context)
+int dfplayer_PlaylistPosition(void *context)
 {
+#if DFPLAYER_PLAYLIST_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_QUERY_EQUALIZER, 0, 0, true);
+
+	assert(NULL != ctxt);
+
+	if(ctxt->playlist.running)
+		return ctxt->playlist.order[ctxt->playlist.position];
+#else
+	(void) context;
+#endif
+	return -1;
 }
 
-int dfplayer_QueryPlaybackMode(void *context)
+int dfplayer_Flush(void *context)
 {
+#if DFPLAYER_TX_BATCH_LENGTH > 0
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	return dfplayer_SendMessage(ctxt, DFPLAYER_CMD_QUERY_PLAYBACK_MODE, 0, 0, true);
+	uint8_t count;
+	int result;
+
+	assert(NULL != ctxt);
+
+	count = ctxt->tx_batch_count;
+	if(count == 0)
+		return 0;
+	ctxt->tx_batch_count = 0;
+
+	result = ctxt->pfnSendSerialBatch(ctxt, ctxt->token, ctxt->tx_batch[0], count);
+	if(result == 0)
+		DFPLAYER_COUNT(ctxt, frames_sent, count);
+	else
+		DFPLAYER_COUNT(ctxt, send_failures, count);
+	return result;
+#else
+	(void) context;
+	return 0;
+#endif
 }
 
-int dfplayer_QueryFileCount(void *context, uint8_t device)
+uint32_t dfplayer_CoalescedCount(void *context)
 {
+#if !defined DFPLAYER_NO_STATS
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	uint8_t command;
-	switch(device)
-	{
-		case DFPLAYER_DEVICE_TFCARD: command = DFPLAYER_CMD_QUERY_TFCARD_FILES; break;
-		case DFPLAYER_DEVICE_UDISK: command = DFPLAYER_CMD_QUERY_UDISK_FILES; break;
-		case DFPLAYER_DEVICE_FLASH: command = DFPLAYER_CMD_QUERY_FLASH_FILES; break;
-		default: return -1;
-	}
-	return dfplayer_SendMessage(ctxt, command, 0, 0, true);
+	return ctxt->stats.commands_completed[DFPLAYER_COMMAND_COALESCED];
+#else
+	(void) context;
+	return 0;
+#endif
 }
 
-int dfplayer_QueryCurrentTrack(void *context, uint8_t device)
+void dfplayer_GetStats(void *context, dfplayer_stats_t *stats)
 {
 	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
-	uint8_t command;
-	switch(device)
+
+	assert(NULL != ctxt);
+
+#if !defined DFPLAYER_NO_STATS
+	*stats = ctxt->stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	stats->commands_outstanding = ctxt->tx_count;
+	stats->commands_inflight = ctxt->tx_inflight;
+#endif
+}
+
+void dfplayer_ResetStats(void *context)
+{
+	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+
+	assert(NULL != ctxt);
+
+#if !defined DFPLAYER_NO_STATS
+	memset(&ctxt->stats, 0, sizeof(ctxt->stats));
+#endif
+}
+
+uint32_t dfplayer_GetTrace(void *context, dfplayer_trace_entry_t *entries, uint32_t max)
+{
+#if defined DFPLAYER_TRACE
+	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+	uint32_t count;
+	uint32_t idx;
+
+	assert(NULL != ctxt);
+
+	count = (ctxt->trace_count < DFPLAYER_TRACE_LENGTH) ? ctxt->trace_count : DFPLAYER_TRACE_LENGTH;
+	if(count > max)
+		count = max;
+	for(idx = 0; idx < count; ++idx)
+		entries[idx] = ctxt->trace[(ctxt->trace_count - count + idx) % DFPLAYER_TRACE_LENGTH];
+	return count;
+#else
+	return 0;
+#endif
+}
+
+uint16_t dfplayer_GetCachedState(void *context, dfplayer_state_t *state, uint32_t max_age)
+{
+	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+	uint8_t field;
+
+	assert(NULL != ctxt);
+
+	*state = ctxt->state;
+	if(max_age != 0)
+	{
+		for(field = 0; field < DFPLAYER_CACHE_FIELDS; ++field)
+		{
+			if((uint32_t) (DFPLAYER_NOW(ctxt) - ctxt->state_updated[field]) > max_age)
+				state->valid &= ~(1 << field);
+		}
+	}
+
+	return state->valid;
+}
+
+int dfplayer_EncodeFrame(uint8_t *buffer, uint32_t size, uint8_t command, uint16_t parameter, bool feedback)
+{
+	dfplayer_descriptor_t descriptor;
+
+	if(size < DFPLAYER_MSG_LENGTH || !dfplayer_Describe(command, &descriptor) || parameter > descriptor.parameter_max)
+		return -1;
+
+	dfplayer_BuildFrame(buffer, command, parameter >> 8, parameter & 0xFF, feedback);
+	return DFPLAYER_MSG_LENGTH;
+}
+
+const uint8_t *dfplayer_GetStaticFrame(uint8_t command)
+{
+#if !defined DFPLAYER_NO_STATIC_FRAMES
+	return dfplayer_StaticFrame(command);
+#else
+	(void) command;
+	return NULL;
+#endif
+}
+
+int dfplayer_IssueCommand(void *context, uint8_t command, uint16_t parameter, dfplayerPriority_e priority)
+{
+	dfplayer_context_t *ctxt = (dfplayer_context_t *) context;
+	dfplayer_descriptor_t descriptor;
+
+	assert(NULL != ctxt);
+
+	if(!dfplayer_Describe(command, &descriptor) || parameter > descriptor.parameter_max
+	|| (unsigned int) priority >= DFPLAYER_PRIORITIES)
+	{
+		return -1;
+	}
+
+	return dfplayer_SendMessage(ctxt, command, parameter >> 8, parameter & 0xFF, priority);
+}
+
+/* Commands without parameters */
+#define DFPLAYER_SIMPLE_COMMAND(function, name) \
+	int dfplayer_##function(void *context) \
+	{ \
+		return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_##name, 0); \
+	}
+
+DFPLAYER_SIMPLE_COMMAND(Play, PLAY)
+DFPLAYER_SIMPLE_COMMAND(Pause, PAUSE)
+DFPLAYER_SIMPLE_COMMAND(NextTrack, NEXT_TRACK)
+DFPLAYER_SIMPLE_COMMAND(PreviousTrack, PREVIOUS_TRACK)
+DFPLAYER_SIMPLE_COMMAND(VolumeUp, VOLUME_UP)
+DFPLAYER_SIMPLE_COMMAND(VolumeDown, VOLUME_DOWN)
+DFPLAYER_SIMPLE_COMMAND(Reset, RESET)
+#if !defined DFPLAYER_NO_QUERIES
+DFPLAYER_SIMPLE_COMMAND(QueryStatus, QUERY_STATUS)
+DFPLAYER_SIMPLE_COMMAND(QueryVolume, QUERY_VOLUME)
+DFPLAYER_SIMPLE_COMMAND(QueryEqualizer, QUERY_EQUALIZER)
+DFPLAYER_SIMPLE_COMMAND(QueryPlaybackMode, QUERY_PLAYBACK_MODE)
+#endif
+
+int dfplayer_SetTrack(void *context, uint16_t track_number)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_SET_TRACK, track_number);
+}
+
+int dfplayer_SetFolder(void *context, uint8_t folder_number)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_SET_FOLDER, folder_number);
+}
+
+int dfplayer_VolumeSet(void *context, uint8_t volume)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_VOLUME_SET, volume);
+}
+
+#if !defined DFPLAYER_NO_SETTINGS
+int dfplayer_SetPlaybackSource(void *context, uint16_t device)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_SET_PLAYBACK_SOURCE, device);
+}
+
+int dfplayer_EnableRepeatPlayback(void *context, bool enable)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_REPEAT, (enable) ? 1 : 0);
+}
+
+int dfplayer_SetEqualizer(void *context, dfplayerEqualizer_e mode)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_SET_EQUALIZER, mode);
+}
+
+int dfplayer_SetPlaybackMode(void *context, dfplayerPlaybackMode_e mode)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context, DFPLAYER_CMD_SET_PLAYBACK_MODE, mode);
+}
+
+int dfplayer_SetStandbyMode(void *context, bool enable)
+{
+	return dfplayer_SendCommand((dfplayer_context_t *) context,
+		(enable) ? DFPLAYER_CMD_POWER_MODE_STANDBY : DFPLAYER_CMD_POWER_MODE_NORMAL, 0);
+}
+#endif /* DFPLAYER_NO_SETTINGS */
+
+#if !defined DFPLAYER_NO_QUERIES
+int dfplayer_QueryFileCount(void *context, uint8_t device)
+{
+	uint8_t command;
+	switch(device)
+	{
+		case DFPLAYER_DEVICE_TFCARD: command = DFPLAYER_CMD_QUERY_TFCARD_FILES; break;
+		case DFPLAYER_DEVICE_UDISK: command = DFPLAYER_CMD_QUERY_UDISK_FILES; break;
+		case DFPLAYER_DEVICE_FLASH: command = DFPLAYER_CMD_QUERY_FLASH_FILES; break;
+		default: return -1;
+	}
+	return dfplayer_SendCommand((dfplayer_context_t *) context, command, 0);
+}
+
+int dfplayer_QueryCurrentTrack(void *context, uint8_t device)
+{
+	uint8_t command;
+	switch(device)
 	{
 		case DFPLAYER_DEVICE_TFCARD: command = DFPLAYER_CMD_QUERY_TFCARD_TRACK; break;
 		case DFPLAYER_DEVICE_UDISK: command = DFPLAYER_CMD_QUERY_UDISK_TRACK; break;
 		case DFPLAYER_DEVICE_FLASH: command = DFPLAYER_CMD_QUERY_FLASH_TRACK; break;
 		default: return -1;
 	}
-	return dfplayer_SendMessage(ctxt, command, 0, 0, true);
+	return dfplayer_SendCommand((dfplayer_context_t *) context, command, 0);
 }
+#endif /* DFPLAYER_NO_QUERIES */
 
 /* ------------------------------------------------------------------------------------------
  * Private Helper Functions
  */
 
-static uint16_t dfplayer_CalculateChecksum(uint8_t *buffer, uint8_t length)
+/* Validates a command's parameter against the command table and sends it */
+static int dfplayer_SendCommand(dfplayer_context_t *ctxt, uint8_t command, uint16_t parameter)
 {
-	uint16_t checksum = 0;
-	uint8_t idx;
+	dfplayer_descriptor_t descriptor;
 
-	for(idx = 0; idx < length; ++idx)
-		checksum -= buffer[idx];
-	return checksum;
+	if(!dfplayer_Describe(command, &descriptor))
+	{
+		DBG("%s: Command %02x not built\n", __func__, command);
+		return -1;
+	}
+	if(parameter > descriptor.parameter_max)
+	{
+		DBG("%s: Parameter for command %02x too high (%u, %u max)\n",
+			__func__, command, parameter, descriptor.parameter_max);
+		return -1;
+	}
+
+	return dfplayer_SendMessage(ctxt, command, parameter >> 8, parameter & 0xFF, descriptor.priority);
 }
 
-static int dfplayer_SendMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1, uint8_t parameter2,
+/* Position of a command in the tables generated from the command table, or -1 if it isn't built */
+static int dfplayer_Row(uint8_t command)
+{
+	if(command >= DFPLAYER_CMD_COUNT)
+		return -1;
+	return (int) DFPLAYER_FLASH_BYTE(&dfplayer_rows[command]) - 1;
+}
+
+/* Copies a command's description out of the descriptor table; false if the command isn't built */
+static bool dfplayer_Describe(uint8_t command, dfplayer_descriptor_t *descriptor)
+{
+	int row = dfplayer_Row(command);
+
+	if(row < 0)
+		return false;
+	DFPLAYER_FLASH_READ(descriptor, &dfplayer_descriptors[row], sizeof(*descriptor));
+	return true;
+}
+
+#if !defined DFPLAYER_NO_STATIC_FRAMES
+/* The precomputed message of a command, or NULL if it has none */
+static const uint8_t *dfplayer_StaticFrame(uint8_t command)
+{
+	uint8_t index = (command < DFPLAYER_CMD_COUNT) ? DFPLAYER_FLASH_BYTE(&dfplayer_static_indexes[command]) : 0;
+
+	return (index != 0) ? dfplayer_static_frames[index - 1] : NULL;
+}
+#endif
+
+static void dfplayer_BuildFrame(uint8_t *frame, uint8_t command, uint8_t parameter1, uint8_t parameter2,
 	bool feedback)
 {
-	uint8_t message[DFPLAYER_MSG_LENGTH];
 	uint16_t checksum;
 
+#if !defined DFPLAYER_NO_STATIC_FRAMES
+	const uint8_t *message = (feedback && parameter1 == 0 && parameter2 == 0) ? dfplayer_StaticFrame(command) : NULL;
+
+	if(message != NULL)
+	{
+		DFPLAYER_FLASH_READ(frame, message, DFPLAYER_MSG_LENGTH);
+		return;
+	}
+#endif
+
+	checksum = DFPLAYER_CHECKSUM(command, (feedback) ? 1 : 0, parameter1, parameter2);
+	frame[0] = DFPLAYER_MSG_START;
+	frame[1] = DFPLAYER_MSG_VERSION;
+	frame[2] = DFPLAYER_MSG_DATA_LENGTH;
+	frame[3] = command;
+	frame[4] = (feedback) ? 1 : 0;
+	frame[5] = parameter1;
+	frame[6] = parameter2;
+	frame[7] = checksum >> 8;
+	frame[8] = checksum & 0xFF;
+	frame[9] = DFPLAYER_MSG_END;
+}
+
+/* After a message is rejected, its bytes following the start byte (length of them, the last
+ * being the byte that failed it) may hold the start of the next message. They're fed to the
+ * parser again from the first candidate start byte, so a corrupted byte costs at most the
+ * message it's in. Building with DFPLAYER_NO_RESYNC discards them instead. Returns the number
+ * of bytes fed to the parser again. */
+static uint8_t dfplayer_Resync(dfplayer_context_t *ctxt, uint8_t length)
+{
+#if !defined DFPLAYER_NO_RESYNC
+	uint8_t pending[DFPLAYER_MSG_LENGTH];
+	const uint8_t *start;
+	const uint8_t *end = pending + length;
+	uint8_t replayed;
+
+	if(0 == length)
+		return 0;
+
+	/* The parser reuses message_buffer while the bytes are replayed */
+	memcpy(pending, &ctxt->message_buffer[1], length);
+	start = (const uint8_t *) memchr(pending, DFPLAYER_MSG_START, length);
+	if(NULL == start)
+		return 0;
+
+	replayed = (uint8_t) (end - start);
+	DBG("%s: rescanning %u bytes\n", __func__, replayed);
+	DFPLAYER_COUNT(ctxt, resyncs, 1);
+	while(start < end)
+		dfplayer_HandleSerialChar(ctxt, *start++);
+	return replayed;
+#else
+	return 0;
+#endif
+}
+
+/* Validates and handles a complete message starting at frame[0], which must be a start byte */
+static bool dfplayer_HandleFrame(dfplayer_context_t *ctxt, const uint8_t *frame)
+{
+	uint16_t calculated_checksum;
+	uint16_t expected_checksum;
+
+	if(frame[1] != DFPLAYER_MSG_VERSION || frame[2] != DFPLAYER_MSG_DATA_LENGTH
+	|| frame[9] != DFPLAYER_MSG_END)
+	{
+		DBG("%s: Invalid message header or end\n", __func__);
+		DFPLAYER_COUNT(ctxt, header_errors, 1);
+		return false;
+	}
+
+	calculated_checksum = DFPLAYER_CHECKSUM(frame[3], frame[4], frame[5], frame[6]);
+	expected_checksum = ((uint16_t) frame[7]) << 8 | frame[8];
+	if(calculated_checksum != expected_checksum)
+	{
+		DBG("%s: Checksum mismatch (calculated %04x, expected %04x\n",
+			__func__, calculated_checksum, expected_checksum);
+		DFPLAYER_COUNT(ctxt, checksum_errors, 1);
+		return false;
+	}
+
+	dfplayer_AcceptMessage(ctxt, frame[3], frame[4], ((uint16_t) frame[5]) << 8 | frame[6]);
+	return true;
+}
+
+static int dfplayer_TransmitMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1,
+	uint8_t parameter2, bool feedback)
+{
+	uint8_t message[DFPLAYER_MSG_LENGTH];
+	int result;
+
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+	if(ctxt->playlist.gap_pending && command == DFPLAYER_CMD_SET_TRACK)
+		dfplayer_PlaylistGap(ctxt);
+#endif
+
+#if DFPLAYER_TX_BATCH_LENGTH > 0
+	if(ctxt->pfnSendSerialBatch != NULL)
+	{
+		/* Make room by handing over what's collected so far */
+		if(ctxt->tx_batch_count >= DFPLAYER_TX_BATCH_LENGTH)
+			(void) dfplayer_Flush(ctxt);
+		dfplayer_BuildFrame(ctxt->tx_batch[ctxt->tx_batch_count], command, parameter1, parameter2, feedback);
+		DFPLAYER_TRACE_FRAME(ctxt, DFPLAYER_TRACE_TX, ctxt->tx_batch[ctxt->tx_batch_count]);
+		++(ctxt->tx_batch_count);
+		return 0;
+	}
+#endif
+
 	if(ctxt->pfnSendSerial == NULL)
 	{
 		DBG("%s: No serial function handler specified\n", __func__);
 		return -1;
 	}
 
-	message[0] = DFPLAYER_MSG_START;
-	message[1] = DFPLAYER_MSG_VERSION;
-	message[2] = DFPLAYER_MSG_DATA_LENGTH;
-	message[3] = command;
-	message[4] = (feedback) ? 1 : 0;
-	message[5] = parameter1;
-	message[6] = parameter2;
-	checksum = dfplayer_CalculateChecksum(&message[1], 6); /* checksum skips start byte */
-	message[7] = checksum >> 8;
-	message[8] = checksum & 0xFF;
-	message[9] = DFPLAYER_MSG_END;
+	dfplayer_BuildFrame(message, command, parameter1, parameter2, feedback);
+	DFPLAYER_TRACE_FRAME(ctxt, DFPLAYER_TRACE_TX, message);
 
-	return ctxt->pfnSendSerial(ctxt, ctxt->token, message, DFPLAYER_MSG_LENGTH);
+	result = ctxt->pfnSendSerial(ctxt, ctxt->token, message, DFPLAYER_MSG_LENGTH);
+	if(result == 0)
+		DFPLAYER_COUNT(ctxt, frames_sent, 1);
+	else
+		DFPLAYER_COUNT(ctxt, send_failures, 1);
+	return result;
 }
 
-static void dfplayer_HandleReceivedMessage(dfplayer_context_t *ctxt)
+/* Transmits queued commands until the in-flight window is full */
+static void dfplayer_ServiceQueue(dfplayer_context_t *ctxt)
 {
-	DBG("%s: command=%02x, feedback=%u, parameter1=%02x, parameter2=%02x\n", __func__,
-		ctxt->message_command, ctxt->message_feedback, ctxt->message_parameter[0],
-		ctxt->message_parameter[1]);
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	while(ctxt->tx_inflight < ctxt->tx_count && ctxt->tx_inflight < ctxt->tx_window)
+	{
+		dfplayer_command_t *entry = DFPLAYER_TX_ENTRY(ctxt, ctxt->tx_inflight);
+		++(ctxt->tx_inflight);
+		dfplayer_TransmitCommand(ctxt, entry);
+	}
+#else
+	(void) ctxt;
+#endif
+}
 
-	switch(ctxt->message_command)
+/* Sends a command right away, or queues it when the context has a transmit window */
+static int dfplayer_SendMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1, uint8_t parameter2,
+	uint8_t priority)
+{
+	int result;
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	if(ctxt->tx_window != 0)
+		return dfplayer_QueueMessage(ctxt, command, parameter1, parameter2, priority);
+#else
+	(void) priority;
+#endif
+
+	result = dfplayer_TransmitMessage(ctxt, command, parameter1, parameter2, true);
+	if(result == 0)
+		dfplayer_CacheCommand(ctxt, command, parameter2);
+	return result;
+}
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+static int dfplayer_QueueMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter1,
+	uint8_t parameter2, uint8_t priority)
+{
+	dfplayer_command_t *entry;
+
+	if(ctxt->tx_coalesce && dfplayer_CoalesceCommand(ctxt, command))
+		return 0;
+
+	if(ctxt->tx_count >= DFPLAYER_TX_QUEUE_LENGTH)
 	{
-		case DFPLAYER_CMD_UDISK_FINISH:
-			if(ctxt->pfnHandleTrackFinished != NULL)
-			{
-				uint16_t track_number = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleTrackFinished(ctxt, ctxt->token, track_number, DFPLAYER_DEVICE_UDISK);
-			}
-			break;
+		DBG("%s: Transmit queue full\n", __func__);
+		return -1;
+	}
 
-		case DFPLAYER_CMD_TFCARD_FINISH:
-			if(ctxt->pfnHandleTrackFinished != NULL)
-			{
-				uint16_t track_number = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleTrackFinished(ctxt, ctxt->token, track_number, DFPLAYER_DEVICE_TFCARD);
-			}
-			break;
+	entry = DFPLAYER_TX_ENTRY(ctxt, dfplayer_QueuePosition(ctxt, priority));
+	entry->command = command;
+	entry->parameter[0] = parameter1;
+	entry->parameter[1] = parameter2;
+	entry->retries = 0;
+	entry->priority = priority;
+	entry->bypassed = 0;
+	entry->queued = DFPLAYER_NOW(ctxt);
+	++(ctxt->tx_count);
+	DFPLAYER_COUNT(ctxt, commands_queued, 1);
 
-		case DFPLAYER_CMD_FLASH_FINISH:
-			if(ctxt->pfnHandleTrackFinished != NULL)
-			{
-				uint16_t track_number = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleTrackFinished(ctxt, ctxt->token, track_number, DFPLAYER_DEVICE_FLASH);
-			}
-			break;
-			
-		case DFPLAYER_CMD_INITIALIZE:
-			if(ctxt->pfnHandleInitialize != NULL)
-			{
-				uint16_t devices_online = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleInitialize(ctxt, ctxt->token, devices_online);
-			}
-			break;
+	dfplayer_ServiceQueue(ctxt);
+	return 0;
+}
 
-		case DFPLAYER_CMD_DEVICE_PUSH_IN:
-			if(ctxt->pfnHandleDeviceState != NULL)
-			{
-				uint16_t device = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleDeviceState(ctxt, ctxt->token, device, true);
-			}
+/* Makes room for a new command of the given priority and returns its index. It goes ahead of the
+ * less urgent queries waiting at the end of the queue, as long as they haven't been overtaken too
+ * often; commands that change the device's state are never overtaken. */
+static uint8_t dfplayer_QueuePosition(dfplayer_context_t *ctxt, uint8_t priority)
+{
+	uint8_t idx = ctxt->tx_count;
+
+	while(idx > ctxt->tx_inflight)
+	{
+		dfplayer_command_t *previous = DFPLAYER_TX_ENTRY(ctxt, idx - 1);
+
+		if(previous->priority <= priority || !DFPLAYER_CMD_IS_QUERY(previous->command)
+		|| previous->bypassed >= DFPLAYER_TX_MAX_BYPASS)
+		{
 			break;
+		}
+
+		++(previous->bypassed);
+		DFPLAYER_COUNT(ctxt, commands_preempted, 1);
+		*DFPLAYER_TX_ENTRY(ctxt, idx) = *previous;
+		--idx;
+	}
+
+	return idx;
+}
+
+static void dfplayer_TransmitCommand(dfplayer_context_t *ctxt, dfplayer_command_t *entry)
+{
+	entry->timestamp = DFPLAYER_NOW(ctxt);
+	dfplayer_TimerArm(ctxt, entry->timestamp + dfplayer_CommandTimeout(ctxt, entry));
+
+	/* Queries are answered by their response message, so they don't request a reply. A failed
+	 * transmission is treated like a lost message and retransmitted after the timeout. */
+	(void) dfplayer_TransmitMessage(ctxt, entry->command, entry->parameter[0], entry->parameter[1],
+		!DFPLAYER_CMD_IS_QUERY(entry->command));
+}
+
+
+/* Removes the queued command at index, preserving the order of the remaining commands. Commands
+ * before index keep their position; commands after it move down by one. */
+static void dfplayer_RemoveCommand(dfplayer_context_t *ctxt, uint8_t index)
+{
+	for(; index > 0; --index)
+		*DFPLAYER_TX_ENTRY(ctxt, index) = *DFPLAYER_TX_ENTRY(ctxt, index - 1);
+	ctxt->tx_head = (ctxt->tx_head + 1) % DFPLAYER_TX_QUEUE_LENGTH;
+	--(ctxt->tx_count);
+}
+
+static void dfplayer_CompleteCommand(dfplayer_context_t *ctxt, uint8_t index, dfplayerCommandResult_e result)
+{
+	dfplayer_command_t *entry = DFPLAYER_TX_ENTRY(ctxt, index);
+	uint8_t command = entry->command;
+	uint8_t parameter2 = entry->parameter[1];
+#if !defined DFPLAYER_NO_STATS
+	uint8_t priority = entry->priority;
+	uint32_t latency = DFPLAYER_NOW(ctxt) - entry->queued;
+#endif
+
+	dfplayer_RemoveCommand(ctxt, index);
+	--(ctxt->tx_inflight);
+	DFPLAYER_COUNT(ctxt, commands_completed[result], 1);
 
-		case DFPLAYER_CMD_DEVICE_PULL_OUT:
-			if(ctxt->pfnHandleDeviceState != NULL)
+#if !defined DFPLAYER_NO_STATS
+	++(ctxt->stats.latency_count[priority]);
+	ctxt->stats.latency_total[priority] += latency;
+	if(latency > ctxt->stats.latency_max[priority])
+		ctxt->stats.latency_max[priority] = latency;
+#endif
+
+	if(result == DFPLAYER_COMMAND_OK)
+		dfplayer_CacheCommand(ctxt, command, parameter2);
+
+	if(ctxt->handlers->pfnHandleCommandComplete != NULL)
+		ctxt->handlers->pfnHandleCommandComplete(ctxt, ctxt->token, command, result);
+}
+
+/* Merges a new command into the queued commands that haven't been transmitted yet. Returns true
+ * if the new command was absorbed entirely and shouldn't be queued. */
+static bool dfplayer_CoalesceCommand(dfplayer_context_t *ctxt, uint8_t command)
+{
+	dfplayer_command_t *entry;
+	uint8_t opposite;
+	uint8_t volume;
+	uint8_t idx;
+
+	switch(command)
+	{
+		case DFPLAYER_CMD_VOLUME_UP:
+		case DFPLAYER_CMD_VOLUME_DOWN:
+			/* Relative changes fold into a pending absolute volume */
+			for(idx = ctxt->tx_inflight; idx < ctxt->tx_count; ++idx)
 			{
-				uint16_t device = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleDeviceState(ctxt, ctxt->token, device, false);
+				entry = DFPLAYER_TX_ENTRY(ctxt, idx);
+				if(entry->command != DFPLAYER_CMD_VOLUME_SET)
+					continue;
+				if(command == DFPLAYER_CMD_VOLUME_UP && entry->parameter[1] < DFPLAYER_VOL_MAX)
+					++(entry->parameter[1]);
+				else if(command == DFPLAYER_CMD_VOLUME_DOWN && entry->parameter[1] > DFPLAYER_VOL_MIN)
+					--(entry->parameter[1]);
+				return dfplayer_CoalescedCommand(ctxt, command);
 			}
-			break;
 
-		case DFPLAYER_CMD_ERROR_REPORT:
-			if(ctxt->pfnHandleError != NULL)
+			/* ... and cancel an opposite change queued immediately before, as long as the volume
+			 * it starts from is known and neither step stops at a limit */
+			opposite = (command == DFPLAYER_CMD_VOLUME_UP) ? DFPLAYER_CMD_VOLUME_DOWN : DFPLAYER_CMD_VOLUME_UP;
+			if(ctxt->tx_count > ctxt->tx_inflight
+			&& DFPLAYER_TX_ENTRY(ctxt, ctxt->tx_count - 1)->command == opposite
+			&& dfplayer_QueuedVolume(ctxt, ctxt->tx_count - 1, &volume)
+			&& volume > DFPLAYER_VOL_MIN && volume < DFPLAYER_VOL_MAX)
 			{
-				uint16_t error = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleError(ctxt, ctxt->token, (dfplayerError_e) error);
+				dfplayer_DropCommand(ctxt, ctxt->tx_count - 1);
+				return dfplayer_CoalescedCommand(ctxt, command);
 			}
+
+			/* ... and, when the volume is known, turn the queued steps and this one into a single
+			 * absolute volume */
+			if(dfplayer_CoalesceVolumeSteps(ctxt, command))
+				return dfplayer_CoalescedCommand(ctxt, command);
 			break;
 
-		case DFPLAYER_CMD_REPLY:
-			if(ctxt->pfnHandleReply != NULL)
+		case DFPLAYER_CMD_VOLUME_SET:
+		case DFPLAYER_CMD_SET_EQUALIZER:
+		case DFPLAYER_CMD_SET_PLAYBACK_MODE:
+		case DFPLAYER_CMD_REPEAT:
+			/* The last absolute setting wins; an absolute volume also overrides relative changes */
+			idx = ctxt->tx_inflight;
+			while(idx < ctxt->tx_count)
 			{
-				ctxt->pfnHandleReply(ctxt, ctxt->token);
+				entry = DFPLAYER_TX_ENTRY(ctxt, idx);
+				if(entry->command == command
+				|| (command == DFPLAYER_CMD_VOLUME_SET && (entry->command == DFPLAYER_CMD_VOLUME_UP
+					|| entry->command == DFPLAYER_CMD_VOLUME_DOWN)))
+				{
+					dfplayer_DropCommand(ctxt, idx); /* next command moves to idx */
+				}
+				else
+					++idx;
 			}
 			break;
 
-		case DFPLAYER_CMD_QUERY_STATUS:
-			if(ctxt->pfnHandleStatusResponse != NULL)
+		case DFPLAYER_CMD_SET_TRACK:
+			/* Selecting a track cancels earlier track changes made on the same playback source */
+			idx = ctxt->tx_count;
+			while(idx > ctxt->tx_inflight)
 			{
-				bool playing = (ctxt->message_parameter[0]) ? true : false; 
-				ctxt->pfnHandleStatusResponse(ctxt, ctxt->token, playing); 
+				entry = DFPLAYER_TX_ENTRY(ctxt, --idx);
+				if(entry->command == DFPLAYER_CMD_SET_PLAYBACK_SOURCE || entry->command == DFPLAYER_CMD_SET_FOLDER)
+					break;
+				if(entry->command == DFPLAYER_CMD_SET_TRACK || entry->command == DFPLAYER_CMD_NEXT_TRACK
+				|| entry->command == DFPLAYER_CMD_PREVIOUS_TRACK)
+				{
+					dfplayer_DropCommand(ctxt, idx);
+				}
 			}
 			break;
 
-		case DFPLAYER_CMD_QUERY_VOLUME:
-			if(ctxt->pfnHandleVolumeResponse != NULL)
-			{
-				uint16_t volume = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleVolumeResponse(ctxt, ctxt->token, volume);
-			} 
+		default:
 			break;
+	}
 
-		case DFPLAYER_CMD_QUERY_EQUALIZER:
-			if(ctxt->pfnHandleEqualizerResponse != NULL)
-			{
-				dfplayerEqualizer_e mode = (dfplayerEqualizer_e) ctxt->message_parameter[0];
-				ctxt->pfnHandleEqualizerResponse(ctxt, ctxt->token, mode);
-			}
-			break;
+	return false;
+}
 
-		case DFPLAYER_CMD_QUERY_PLAYBACK_MODE:
-			if(ctxt->pfnHandlePlaybackModeResponse != NULL)
-			{
-				dfplayerPlaybackMode_e mode = (dfplayerEqualizer_e) ctxt->message_parameter[0];
-				ctxt->pfnHandlePlaybackModeResponse(ctxt, ctxt->token, mode);
-			}
-			break;
+/* Replaces the volume steps waiting to be transmitted, followed by a new one, with the absolute
+ * volume they lead to. The volume is followed from the cache through every volume command in the
+ * queue, in flight ones included; nothing is merged if it isn't known or no step is waiting. The
+ * first waiting step's entry becomes the volume setting and the other steps are dropped. */
+static bool dfplayer_CoalesceVolumeSteps(dfplayer_context_t *ctxt, uint8_t command)
+{
+	dfplayer_command_t *entry;
+	bool known = (ctxt->state.valid & DFPLAYER_CACHE_VOLUME) != 0;
+	uint8_t volume = ctxt->state.volume;
+	uint8_t first = ctxt->tx_count;
+	uint8_t idx = 0;
 
-		case DFPLAYER_CMD_QUERY_TFCARD_FILES:
-		case DFPLAYER_CMD_QUERY_UDISK_FILES:
-		case DFPLAYER_CMD_QUERY_FLASH_FILES:
-			if(ctxt->pfnHandleFileCountResponse != NULL)
+	while(idx < ctxt->tx_count)
+	{
+		entry = DFPLAYER_TX_ENTRY(ctxt, idx);
+		if(entry->command == DFPLAYER_CMD_VOLUME_SET)
+		{
+			known = true;
+			volume = entry->parameter[1];
+		}
+		else if(entry->command == DFPLAYER_CMD_VOLUME_UP || entry->command == DFPLAYER_CMD_VOLUME_DOWN)
+		{
+			/* Step as the device does, stopping at the limits */
+			if(entry->command == DFPLAYER_CMD_VOLUME_UP && volume < DFPLAYER_VOL_MAX)
+				++volume;
+			else if(entry->command == DFPLAYER_CMD_VOLUME_DOWN && volume > DFPLAYER_VOL_MIN)
+				--volume;
+
+			if(idx >= ctxt->tx_inflight)
 			{
-				uint8_t device = 0;
-				switch(ctxt->message_command)
+				if(!known)
+					return false;
+				if(first != ctxt->tx_count)
 				{
-					case DFPLAYER_CMD_QUERY_TFCARD_FILES: device = DFPLAYER_DEVICE_TFCARD; break;
-					case DFPLAYER_CMD_QUERY_UDISK_FILES: device = DFPLAYER_DEVICE_UDISK; break;
-					case DFPLAYER_CMD_QUERY_FLASH_FILES: device = DFPLAYER_DEVICE_FLASH; break;
+					dfplayer_DropCommand(ctxt, idx); /* next command moves to idx */
+					continue;
 				}
-				uint16_t count = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleFileCountResponse(ctxt, ctxt->token, device, count);
+				first = idx;
 			}
+		}
+		++idx;
+	}
+	if(first == ctxt->tx_count)
+		return false;
+
+	if(command == DFPLAYER_CMD_VOLUME_UP && volume < DFPLAYER_VOL_MAX)
+		++volume;
+	else if(command == DFPLAYER_CMD_VOLUME_DOWN && volume > DFPLAYER_VOL_MIN)
+		--volume;
+
+	/* The first step is accounted for as coalesced too; its entry completes as the setting */
+	entry = DFPLAYER_TX_ENTRY(ctxt, first);
+	(void) dfplayer_CoalescedCommand(ctxt, entry->command);
+	entry->command = DFPLAYER_CMD_VOLUME_SET;
+	entry->parameter[0] = 0;
+	entry->parameter[1] = volume;
+	return true;
+}
+
+/* The volume the device will be at once the first count queued commands, in flight ones
+ * included, have been carried out, starting from the cache; false if it isn't known */
+static bool dfplayer_QueuedVolume(dfplayer_context_t *ctxt, uint8_t count, uint8_t *volume)
+{
+	bool known = (ctxt->state.valid & DFPLAYER_CACHE_VOLUME) != 0;
+	uint8_t idx;
+
+	*volume = ctxt->state.volume;
+	for(idx = 0; idx < count; ++idx)
+	{
+		const dfplayer_command_t *entry = DFPLAYER_TX_ENTRY(ctxt, idx);
+
+		if(entry->command == DFPLAYER_CMD_VOLUME_SET)
+		{
+			known = true;
+			*volume = entry->parameter[1];
+		}
+		else if(entry->command == DFPLAYER_CMD_VOLUME_UP && *volume < DFPLAYER_VOL_MAX)
+			++(*volume);
+		else if(entry->command == DFPLAYER_CMD_VOLUME_DOWN && *volume > DFPLAYER_VOL_MIN)
+			--(*volume);
+	}
+	return known;
+}
+
+static bool dfplayer_CoalescedCommand(dfplayer_context_t *ctxt, uint8_t command)
+{
+	DFPLAYER_COUNT(ctxt, commands_completed[DFPLAYER_COMMAND_COALESCED], 1);
+	if(ctxt->handlers->pfnHandleCommandComplete != NULL)
+		ctxt->handlers->pfnHandleCommandComplete(ctxt, ctxt->token, command, DFPLAYER_COMMAND_COALESCED);
+	return true;
+}
+
+/* Removes a queued command that hasn't been transmitted yet */
+static void dfplayer_DropCommand(dfplayer_context_t *ctxt, uint8_t index)
+{
+	uint8_t command = DFPLAYER_TX_ENTRY(ctxt, index)->command;
+
+	dfplayer_RemoveCommand(ctxt, index);
+	(void) dfplayer_CoalescedCommand(ctxt, command);
+}
+
+/* Matches a received message to the oldest in-flight command it answers. The device answers
+ * in order, so replies go to the oldest non-query and error reports to the oldest command. */
+static void dfplayer_HandleAnswer(dfplayer_context_t *ctxt, uint8_t command, uint16_t value)
+{
+	uint8_t idx;
+
+	/* Only the dfplayerError_e codes are sent in place of an acknowledgement; other error reports
+	 * (e.g. a card failing during playback) arrive on their own and answer no command */
+	if(command == DFPLAYER_CMD_ERROR_REPORT && value >= DFPLAYER_ERROR_COUNT)
+		return;
+
+	for(idx = 0; idx < ctxt->tx_inflight; ++idx)
+	{
+		uint8_t pending = DFPLAYER_TX_ENTRY(ctxt, idx)->command;
+
+		if(command == DFPLAYER_CMD_ERROR_REPORT)
+			dfplayer_CompleteCommand(ctxt, idx, DFPLAYER_COMMAND_ERROR);
+		else if((command == DFPLAYER_CMD_REPLY && !DFPLAYER_CMD_IS_QUERY(pending)) || command == pending)
+			dfplayer_CompleteCommand(ctxt, idx, DFPLAYER_COMMAND_OK);
+		else
+			continue;
+
+		dfplayer_ServiceQueue(ctxt);
+		break;
+	}
+}
+
+/* Time to wait for an answer to the most recent transmission of a command */
+static uint32_t dfplayer_CommandTimeout(dfplayer_context_t *ctxt, const dfplayer_command_t *entry)
+{
+	if(!ctxt->tx_backoff)
+		return ctxt->tx_timeout;
+	return ctxt->tx_timeout << ((entry->retries < 8) ? entry->retries : 8);
+}
+#endif /* DFPLAYER_TX_QUEUE_LENGTH */
+
+/* Sends the scheduled commands that are due */
+static void dfplayer_RunSchedule(dfplayer_context_t *ctxt, uint32_t now)
+{
+#if DFPLAYER_SCHEDULE_LENGTH > 0
+	uint8_t idx;
+
+	for(idx = 0; idx < DFPLAYER_SCHEDULE_LENGTH; ++idx)
+	{
+		dfplayer_schedule_t *schedule = &ctxt->schedule[idx];
+
+		if(!schedule->active || DFPLAYER_TIME_DIFF(now, schedule->due) < 0)
+			continue;
+
+		/* A command that can't be sent, e.g. because the transmit queue is full, stays due and is
+		 * tried again on the next tick */
+		if(dfplayer_SendCommand(ctxt, schedule->command,
+			((uint16_t) schedule->parameter[0] << 8) | schedule->parameter[1]) != 0)
+		{
+			DBG("%s: Scheduled command %02x deferred\n", __func__, schedule->command);
+			continue;
+		}
+
+		if(schedule->period == 0)
+			schedule->active = false;
+		else
+		{
+			schedule->due += schedule->period;
+			if(DFPLAYER_TIME_DIFF(now, schedule->due) >= 0)
+				schedule->due = now + schedule->period;
+		}
+	}
+#else
+	(void) ctxt;
+	(void) now;
+#endif
+}
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0 || DFPLAYER_SCHEDULE_LENGTH > 0
+/* Makes the context's timer expire no later than expires */
+static void dfplayer_TimerArm(dfplayer_context_t *ctxt, uint32_t expires)
+{
+	dfplayer_wheel_t *wheel = ctxt->wheel;
+
+	if(NULL == wheel)
+		return;
+	if(ctxt->timer.next != NULL && DFPLAYER_TIME_DIFF(expires, ctxt->timer.expires) >= 0)
+		return;
+
+	dfplayer_WheelRemove(wheel, &ctxt->timer);
+	ctxt->timer.expires = expires;
+	dfplayer_WheelPlace(wheel, &ctxt->timer, wheel->now + 1);
+}
+#endif
+
+/* Sets the context's timer to the next retransmission, timeout or scheduled command after now,
+ * or takes it out of the wheel if nothing is pending */
+static void dfplayer_TimerUpdate(dfplayer_context_t *ctxt, uint32_t now)
+{
+	uint32_t earliest = 0;
+	bool pending = false;
+#if DFPLAYER_TX_QUEUE_LENGTH > 0 || DFPLAYER_SCHEDULE_LENGTH > 0
+	uint8_t idx;
+#endif
+
+	if(NULL == ctxt->wheel)
+		return;
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	for(idx = 0; idx < ctxt->tx_inflight; ++idx)
+	{
+		dfplayer_command_t *entry = DFPLAYER_TX_ENTRY(ctxt, idx);
+		uint32_t expires = entry->timestamp + dfplayer_CommandTimeout(ctxt, entry);
+
+		if(!pending || DFPLAYER_TIME_DIFF(expires, earliest) < 0)
+			earliest = expires;
+		pending = true;
+	}
+#endif
+#if DFPLAYER_SCHEDULE_LENGTH > 0
+	for(idx = 0; idx < DFPLAYER_SCHEDULE_LENGTH; ++idx)
+	{
+		if(!ctxt->schedule[idx].active)
+			continue;
+		if(!pending || DFPLAYER_TIME_DIFF(ctxt->schedule[idx].due, earliest) < 0)
+			earliest = ctxt->schedule[idx].due;
+		pending = true;
+	}
+#endif
+
+	dfplayer_WheelRemove(ctxt->wheel, &ctxt->timer);
+	if(pending)
+	{
+		/* Anything due now was just handled, so a zero timeout waits for the next time unit */
+		ctxt->timer.expires = (DFPLAYER_TIME_DIFF(earliest, now) > 0) ? earliest : now + 1;
+		dfplayer_WheelPlace(ctxt->wheel, &ctxt->timer, ctxt->wheel->now + 1);
+	}
+}
+
+/* Adds a timer to the slot it belongs in, for a wheel that has yet to process time from on.
+ * A timer already due goes in the first slot processed. */
+static void dfplayer_WheelPlace(dfplayer_wheel_t *wheel, dfplayer_timer_t *timer, uint32_t from)
+{
+	uint32_t expires = (DFPLAYER_TIME_DIFF(timer->expires, from) > 0) ? timer->expires : from;
+	dfplayer_timer_t *head;
+	uint8_t level;
+	uint8_t shift = 0;
+
+	/* The lowest level whose slots reach expires within one turn; the masking keeps the distance
+	 * right when time wraps around */
+	for(level = 0; level < DFPLAYER_WHEEL_LEVELS; ++level, shift += DFPLAYER_WHEEL_BITS)
+	{
+		if((((expires >> shift) - (from >> shift)) & (UINT32_MAX >> shift)) < DFPLAYER_WHEEL_SLOTS)
 			break;
-		case DFPLAYER_CMD_QUERY_TFCARD_TRACK:
-		case DFPLAYER_CMD_QUERY_UDISK_TRACK:
-		case DFPLAYER_CMD_QUERY_FLASH_TRACK:
-			if(ctxt->pfnHandleCurrentTrackResponse != NULL)
+	}
+
+	if(level < DFPLAYER_WHEEL_LEVELS)
+		head = &wheel->slots[level][(expires >> shift) % DFPLAYER_WHEEL_SLOTS];
+	else
+	{
+		/* Beyond the wheel's span; wait in the last slot the wheel reaches */
+		shift -= DFPLAYER_WHEEL_BITS;
+		head = &wheel->slots[DFPLAYER_WHEEL_LEVELS - 1][((from >> shift) + DFPLAYER_WHEEL_SLOTS - 1)
+			% DFPLAYER_WHEEL_SLOTS];
+	}
+
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+	DFPLAYER_WHEEL_OCCUPY(wheel, head - &wheel->slots[0][0]);
+	++(wheel->count);
+}
+
+static void dfplayer_WheelRemove(dfplayer_wheel_t *wheel, dfplayer_timer_t *timer)
+{
+	dfplayer_timer_t *prev = timer->prev;
+
+	if(NULL == timer->next)
+		return;
+
+	prev->next = timer->next;
+	timer->next->prev = prev;
+	if(prev->next == prev) /* only a slot's head links to itself, once its last timer is gone */
+		DFPLAYER_WHEEL_VACATE(wheel, prev - &wheel->slots[0][0]);
+	timer->next = NULL;
+	timer->prev = NULL;
+	--(wheel->count);
+}
+
+/* Moves the timers of the level's slot that time has just entered down to lower levels */
+static void dfplayer_WheelCascade(dfplayer_wheel_t *wheel, uint8_t level)
+{
+	dfplayer_timer_t *head =
+		&wheel->slots[level][(wheel->now >> (DFPLAYER_WHEEL_BITS * level)) % DFPLAYER_WHEEL_SLOTS];
+
+	/* None of them can land back in this slot, so this ends */
+	while(head->next != head)
+	{
+		dfplayer_timer_t *timer = head->next;
+
+		dfplayer_WheelRemove(wheel, timer);
+		dfplayer_WheelPlace(wheel, timer, wheel->now);
+	}
+}
+
+/* Time units from the wheel's time to the next time that has timers to expire or to move down,
+ * or 0 for an empty wheel */
+static uint32_t dfplayer_WheelNext(const dfplayer_wheel_t *wheel)
+{
+	uint32_t next = 0;
+	uint8_t level;
+
+	for(level = 0; level < DFPLAYER_WHEEL_LEVELS; ++level)
+	{
+		uint8_t shift = DFPLAYER_WHEEL_BITS * level;
+		uint64_t mask = ((uint64_t) wheel->occupied[level][1] << 32) | wheel->occupied[level][0];
+		uint32_t slot = wheel->now >> shift;
+		uint8_t from = (slot + 1) % DFPLAYER_WHEEL_SLOTS;
+		uint32_t distance;
+
+		if(0 == mask)
+			continue;
+
+		/* Time enters the first occupied slot after the current one, going around, at the start
+		 * of its span */
+		if(from != 0)
+			mask = (mask >> from) | (mask << (DFPLAYER_WHEEL_SLOTS - from));
+		distance = ((slot + 1 + DFPLAYER_LOWEST_BIT(mask)) << shift) - wheel->now;
+		if(0 == next || distance < next)
+			next = distance;
+	}
+
+	return next;
+}
+
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+/* Sends the commands that play the playlist's current entry */
+static int dfplayer_PlaylistPlay(dfplayer_context_t *ctxt)
+{
+	dfplayer_playlist_t *playlist = &ctxt->playlist;
+	const dfplayer_playlist_entry_t *entry = &playlist->entries[playlist->order[playlist->position]];
+	int result = 0;
+
+	if(entry->device != playlist->device)
+	{
+		result |= dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_PLAYBACK_SOURCE, 0, entry->device,
+			DFPLAYER_PRIORITY_URGENT);
+		playlist->device = entry->device;
+	}
+	if(entry->folder != playlist->folder)
+	{
+		result |= dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_FOLDER, 0, entry->folder, DFPLAYER_PRIORITY_URGENT);
+		playlist->folder = entry->folder;
+	}
+	result |= dfplayer_SendMessage(ctxt, DFPLAYER_CMD_SET_TRACK, entry->track >> 8, entry->track & 0xFF,
+		DFPLAYER_PRIORITY_URGENT);
+
+	if(result != 0)
+	{
+		/* Whatever didn't go out has to be selected again next time */
+		playlist->device = 0;
+		playlist->folder = DFPLAYER_PLAYLIST_FOLDER_UNKNOWN;
+		playlist->gap_pending = false;
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves a running playlist on to its next entry when a track finishes */
+static void dfplayer_PlaylistFinished(dfplayer_context_t *ctxt, uint16_t track, uint8_t device)
+{
+	dfplayer_playlist_t *playlist = &ctxt->playlist;
+	uint32_t now = DFPLAYER_NOW(ctxt);
+	uint8_t last;
+
+	if(!playlist->running)
+		return;
+
+	if(track == playlist->finished_track && device == playlist->finished_device
+	&& (uint32_t) (now - playlist->finished) < DFPLAYER_PLAYLIST_GUARD)
+	{
+		DFPLAYER_COUNT(ctxt, playlist_duplicates, 1);
+		return;
+	}
+	playlist->finished_track = track;
+	playlist->finished_device = device;
+	playlist->finished = now;
+
+	if(playlist->repeat != DFPLAYER_PLAYLIST_REPEAT_ONE && ++(playlist->position) >= playlist->count)
+	{
+		if(playlist->repeat == DFPLAYER_PLAYLIST_REPEAT_NONE)
+		{
+			playlist->running = false;
+			return;
+		}
+
+		playlist->position = 0;
+		if(playlist->shuffle && playlist->count > 1)
+		{
+			/* A new pass doesn't start with the entry that ended the last one */
+			last = playlist->order[playlist->count - 1];
+			dfplayer_PlaylistShuffle(ctxt, 0);
+			if(playlist->order[0] == last)
 			{
-				uint8_t device = 0;
-				switch(ctxt->message_command)
-				{
-					case DFPLAYER_CMD_QUERY_TFCARD_TRACK: device = DFPLAYER_DEVICE_TFCARD; break;
-					case DFPLAYER_CMD_QUERY_UDISK_TRACK: device = DFPLAYER_DEVICE_UDISK; break;
-					case DFPLAYER_CMD_QUERY_FLASH_TRACK: device = DFPLAYER_DEVICE_FLASH; break;
-				}
-				uint16_t track = ((uint16_t) ctxt->message_parameter[0]) << 8
-					| ctxt->message_parameter[1];
-				ctxt->pfnHandleCurrentTrackResponse(ctxt, ctxt->token, device, track);
+				playlist->order[0] = playlist->order[1];
+				playlist->order[1] = last;
 			}
-			break;
+		}
+	}
 
-		case DFPLAYER_CMD_QUERY_VERSION: /* TODO */
+	DFPLAYER_COUNT(ctxt, playlist_advances, 1);
+	playlist->gap_start = DFPLAYER_TIMESTAMP(ctxt);
+	playlist->gap_pending = true;
+	if(dfplayer_PlaylistPlay(ctxt) != 0)
+		playlist->running = false;
+}
+
+/* Fisher-Yates shuffle of the play order from position from on */
+static void dfplayer_PlaylistShuffle(dfplayer_context_t *ctxt, uint8_t from)
+{
+	dfplayer_playlist_t *playlist = &ctxt->playlist;
+	uint8_t idx;
+
+	for(idx = playlist->count; idx > from + 1; --idx)
+	{
+		uint32_t x = playlist->random;
+		uint8_t other;
+		uint8_t swap;
+
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		playlist->random = x;
+
+		other = from + (uint8_t) (x % (idx - from));
+		swap = playlist->order[idx - 1];
+		playlist->order[idx - 1] = playlist->order[other];
+		playlist->order[other] = swap;
+	}
+}
+
+/* The playlist's next track is being sent */
+static void dfplayer_PlaylistGap(dfplayer_context_t *ctxt)
+{
+#if !defined DFPLAYER_NO_STATS
+	uint32_t gap = DFPLAYER_TIMESTAMP(ctxt) - ctxt->playlist.gap_start;
+
+	++(ctxt->stats.playlist_gap_count);
+	ctxt->stats.playlist_gap_total += gap;
+	if(gap > ctxt->stats.playlist_gap_max)
+		ctxt->stats.playlist_gap_max = gap;
+#endif
+	ctxt->playlist.gap_pending = false;
+}
+#endif /* DFPLAYER_PLAYLIST_LENGTH */
+
+/* Maps a DFPLAYER_DEVICE_ flag to a DFPLAYER_CACHE_DEVICE_ index, or -1 if it has no cached state */
+static int dfplayer_CacheDeviceIndex(uint16_t device)
+{
+	switch(device)
+	{
+		case DFPLAYER_DEVICE_UDISK: return DFPLAYER_CACHE_DEVICE_UDISK;
+		case DFPLAYER_DEVICE_TFCARD: return DFPLAYER_CACHE_DEVICE_TFCARD;
+		case DFPLAYER_DEVICE_FLASH: return DFPLAYER_CACHE_DEVICE_FLASH;
+		default: return -1;
+	}
+}
+
+static void dfplayer_CacheUpdate(dfplayer_context_t *ctxt, uint16_t fields)
+{
+	uint8_t field;
+
+	ctxt->state.valid |= fields;
+	for(field = 0; field < DFPLAYER_CACHE_FIELDS; ++field)
+	{
+		if(fields & (1 << field))
+			ctxt->state_updated[field] = DFPLAYER_NOW(ctxt);
+	}
+}
+
+/* Applies a command the device has accepted to the cached state */
+static void dfplayer_CacheCommand(dfplayer_context_t *ctxt, uint8_t command, uint8_t parameter2)
+{
+	dfplayer_state_t *state = &ctxt->state;
+	uint16_t all_tracks = DFPLAYER_CACHE_TRACK(DFPLAYER_CACHE_DEVICE_UDISK)
+		| DFPLAYER_CACHE_TRACK(DFPLAYER_CACHE_DEVICE_TFCARD) | DFPLAYER_CACHE_TRACK(DFPLAYER_CACHE_DEVICE_FLASH);
+
+	switch(command)
+	{
+		case DFPLAYER_CMD_VOLUME_SET:
+			state->volume = parameter2;
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_VOLUME);
+			break;
+		case DFPLAYER_CMD_VOLUME_UP:
+		case DFPLAYER_CMD_VOLUME_DOWN:
+			if(!(state->valid & DFPLAYER_CACHE_VOLUME))
+				break;
+			if(command == DFPLAYER_CMD_VOLUME_UP && state->volume < DFPLAYER_VOL_MAX)
+				++(state->volume);
+			else if(command == DFPLAYER_CMD_VOLUME_DOWN && state->volume > DFPLAYER_VOL_MIN)
+				--(state->volume);
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_VOLUME);
+			break;
+		case DFPLAYER_CMD_SET_EQUALIZER:
+			state->equalizer = (dfplayerEqualizer_e) parameter2;
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_EQUALIZER);
+			break;
+		case DFPLAYER_CMD_SET_PLAYBACK_MODE:
+			state->playback_mode = (dfplayerPlaybackMode_e) parameter2;
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_PLAYBACK_MODE);
+			break;
+		case DFPLAYER_CMD_PLAY:
+			state->playing = true;
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_STATUS);
+			break;
+		case DFPLAYER_CMD_PAUSE:
+		case DFPLAYER_CMD_POWER_MODE_STANDBY:
+			state->playing = false;
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_STATUS);
+			break;
+		case DFPLAYER_CMD_SET_TRACK:
+		case DFPLAYER_CMD_NEXT_TRACK:
+		case DFPLAYER_CMD_PREVIOUS_TRACK:
+			/* The device starts playing, but the cache doesn't know which source the track is on */
+			state->playing = true;
+			dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_STATUS);
+			state->valid &= ~all_tracks;
+			break;
+		case DFPLAYER_CMD_SET_PLAYBACK_SOURCE:
+		case DFPLAYER_CMD_SET_FOLDER:
+			state->valid &= ~(all_tracks | DFPLAYER_CACHE_STATUS);
+			break;
+		case DFPLAYER_CMD_RESET:
+			state->valid = 0;
+			break;
 		default:
-			DBG("%s: Unknown message command (%02x)\n", __func__, ctxt->message_command);
 			break;
 	}
 }
+
+/* Received message decoders; each applies the message to the cached state, then calls the user's
+ * handler. value is the message's 16-bit parameter and argument comes from the command table. */
+
+static void dfplayer_DecodeNone(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	DBG("%s: Message not decoded\n", __func__);
+}
+
+static void dfplayer_DecodeTrackFinished(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	int device = dfplayer_CacheDeviceIndex(argument);
+
+	ctxt->state.playing = false;
+	ctxt->state.track[device] = value;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_STATUS | DFPLAYER_CACHE_TRACK(device));
+
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+	/* Before the handler, so the next track isn't held up by it */
+	dfplayer_PlaylistFinished(ctxt, value, argument);
+#endif
+
+	if(ctxt->handlers->pfnHandleTrackFinished != NULL)
+		ctxt->handlers->pfnHandleTrackFinished(ctxt, ctxt->token, value, argument);
+}
+
+static void dfplayer_DecodeInitialize(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	/* The device (re)started; nothing known about it still holds */
+	ctxt->state.valid = 0;
+	ctxt->state.devices_online = value;
+	ctxt->state.playing = false;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_DEVICES_ONLINE | DFPLAYER_CACHE_STATUS);
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+	ctxt->playlist.device = 0;
+	ctxt->playlist.folder = DFPLAYER_PLAYLIST_FOLDER_UNKNOWN;
+#endif
+
+	if(ctxt->handlers->pfnHandleInitialize != NULL)
+		ctxt->handlers->pfnHandleInitialize(ctxt, ctxt->token, value);
+}
+
+static void dfplayer_DecodeDeviceState(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	dfplayer_state_t *state = &ctxt->state;
+	int device = dfplayer_CacheDeviceIndex(value);
+
+	if(argument)
+		state->devices_online |= value;
+	else
+		state->devices_online &= ~value;
+	if(device >= 0)
+		state->valid &= ~(DFPLAYER_CACHE_TRACK(device) | DFPLAYER_CACHE_FILE_COUNT(device));
+	state->valid &= ~DFPLAYER_CACHE_STATUS;
+	if(state->valid & DFPLAYER_CACHE_DEVICES_ONLINE)
+		dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_DEVICES_ONLINE);
+
+	if(ctxt->handlers->pfnHandleDeviceState != NULL)
+		ctxt->handlers->pfnHandleDeviceState(ctxt, ctxt->token, value, (argument) ? true : false);
+}
+
+static void dfplayer_DecodeError(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	if(value < DFPLAYER_ERROR_COUNT)
+		DFPLAYER_COUNT(ctxt, errors[value], 1);
+
+	if(ctxt->handlers->pfnHandleError != NULL)
+		ctxt->handlers->pfnHandleError(ctxt, ctxt->token, (dfplayerError_e) value);
+}
+
+static void dfplayer_DecodeReply(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	if(ctxt->handlers->pfnHandleReply != NULL)
+		ctxt->handlers->pfnHandleReply(ctxt, ctxt->token);
+}
+
+#if !defined DFPLAYER_NO_QUERIES
+static void dfplayer_DecodeStatus(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	bool playing = (value >> 8) ? true : false;
+
+	ctxt->state.playing = playing;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_STATUS);
+
+	if(ctxt->handlers->pfnHandleStatusResponse != NULL)
+		ctxt->handlers->pfnHandleStatusResponse(ctxt, ctxt->token, playing);
+}
+
+static void dfplayer_DecodeVolume(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	ctxt->state.volume = (uint8_t) value;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_VOLUME);
+
+	if(ctxt->handlers->pfnHandleVolumeResponse != NULL)
+		ctxt->handlers->pfnHandleVolumeResponse(ctxt, ctxt->token, (uint8_t) value);
+}
+
+static void dfplayer_DecodeEqualizer(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	dfplayerEqualizer_e mode = (dfplayerEqualizer_e) (value >> 8);
+
+	ctxt->state.equalizer = mode;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_EQUALIZER);
+
+	if(ctxt->handlers->pfnHandleEqualizerResponse != NULL)
+		ctxt->handlers->pfnHandleEqualizerResponse(ctxt, ctxt->token, mode);
+}
+
+static void dfplayer_DecodePlaybackMode(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	dfplayerPlaybackMode_e mode = (dfplayerPlaybackMode_e) (value >> 8);
+
+	ctxt->state.playback_mode = mode;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_PLAYBACK_MODE);
+
+	if(ctxt->handlers->pfnHandlePlaybackModeResponse != NULL)
+		ctxt->handlers->pfnHandlePlaybackModeResponse(ctxt, ctxt->token, mode);
+}
+
+static void dfplayer_DecodeFileCount(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	int device = dfplayer_CacheDeviceIndex(argument);
+
+	ctxt->state.file_count[device] = value;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_FILE_COUNT(device));
+
+	if(ctxt->handlers->pfnHandleFileCountResponse != NULL)
+		ctxt->handlers->pfnHandleFileCountResponse(ctxt, ctxt->token, argument, value);
+}
+
+static void dfplayer_DecodeCurrentTrack(dfplayer_context_t *ctxt, uint16_t value, uint8_t argument)
+{
+	int device = dfplayer_CacheDeviceIndex(argument);
+
+	ctxt->state.track[device] = value;
+	dfplayer_CacheUpdate(ctxt, DFPLAYER_CACHE_TRACK(device));
+
+	if(ctxt->handlers->pfnHandleCurrentTrackResponse != NULL)
+		ctxt->handlers->pfnHandleCurrentTrackResponse(ctxt, ctxt->token, argument, value);
+}
+#endif /* DFPLAYER_NO_QUERIES */
+
+/* Indexed by the command table's decoder; decoders that aren't built are left NULL, and their
+ * commands are left out of the descriptor table along with the rest of their group */
+static void (* const dfplayer_decoders[DFPLAYER_DECODER_COUNT])(dfplayer_context_t *ctxt, uint16_t value,
+	uint8_t argument) =
+{
+	[DFPLAYER_DECODER_NONE] = dfplayer_DecodeNone,
+	[DFPLAYER_DECODER_TRACK_FINISHED] = dfplayer_DecodeTrackFinished,
+	[DFPLAYER_DECODER_INITIALIZE] = dfplayer_DecodeInitialize,
+	[DFPLAYER_DECODER_DEVICE_STATE] = dfplayer_DecodeDeviceState,
+	[DFPLAYER_DECODER_ERROR] = dfplayer_DecodeError,
+	[DFPLAYER_DECODER_REPLY] = dfplayer_DecodeReply,
+#if !defined DFPLAYER_NO_QUERIES
+	[DFPLAYER_DECODER_STATUS] = dfplayer_DecodeStatus,
+	[DFPLAYER_DECODER_VOLUME] = dfplayer_DecodeVolume,
+	[DFPLAYER_DECODER_EQUALIZER] = dfplayer_DecodeEqualizer,
+	[DFPLAYER_DECODER_PLAYBACK_MODE] = dfplayer_DecodePlaybackMode,
+	[DFPLAYER_DECODER_FILE_COUNT] = dfplayer_DecodeFileCount,
+	[DFPLAYER_DECODER_CURRENT_TRACK] = dfplayer_DecodeCurrentTrack,
+#endif
+};
+
+#if defined DFPLAYER_TRACE
+static void dfplayer_Trace(dfplayer_context_t *ctxt, uint8_t direction, const uint8_t *frame, uint32_t timestamp)
+{
+	dfplayer_trace_entry_t *entry = &ctxt->trace[ctxt->trace_count % DFPLAYER_TRACE_LENGTH];
+
+	entry->timestamp = timestamp;
+	entry->direction = direction;
+	memcpy(entry->frame, frame, DFPLAYER_MSG_LENGTH);
+	entry->reserved = 0;
+	++(ctxt->trace_count);
+}
+
+/* Both parsers only keep the fields of a received message, so its frame is rebuilt */
+static void dfplayer_TraceReceived(dfplayer_context_t *ctxt, uint8_t command, uint8_t feedback, uint16_t value,
+	uint32_t timestamp)
+{
+	uint8_t frame[DFPLAYER_MSG_LENGTH];
+	uint16_t checksum = DFPLAYER_CHECKSUM(command, feedback, value >> 8, value & 0xFF);
+
+	frame[0] = DFPLAYER_MSG_START;
+	frame[1] = DFPLAYER_MSG_VERSION;
+	frame[2] = DFPLAYER_MSG_DATA_LENGTH;
+	frame[3] = command;
+	frame[4] = feedback;
+	frame[5] = value >> 8;
+	frame[6] = value & 0xFF;
+	frame[7] = checksum >> 8;
+	frame[8] = checksum & 0xFF;
+	frame[9] = DFPLAYER_MSG_END;
+	dfplayer_Trace(ctxt, DFPLAYER_TRACE_RX, frame, timestamp);
+}
+#endif /* DFPLAYER_TRACE */
+
+/* Hands a valid message from either parser on to be handled, or queues it for
+ * dfplayer_DispatchEvents when built with DFPLAYER_DEFERRED_EVENTS. Queuing touches nothing the
+ * dispatching side writes but event_tail, so it's safe from an interrupt. The message is counted
+ * here, and a queued one takes its trace timestamp with it, so both reflect when it arrived
+ * rather than when it's dispatched. */
+static void dfplayer_AcceptMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t feedback, uint16_t value)
+{
+#if defined DFPLAYER_DEFERRED_EVENTS
+	uint8_t head = ctxt->event_head;
+	dfplayer_event_t *event;
+
+	DFPLAYER_COUNT(ctxt, frames_received, 1);
+	if((uint8_t) (head - DFPLAYER_LOAD_ACQUIRE(&ctxt->event_tail)) >= DFPLAYER_EVENT_QUEUE_LENGTH)
+	{
+		DFPLAYER_COUNT(ctxt, events_dropped, 1);
+		return;
+	}
+
+	event = &ctxt->event_queue[head % DFPLAYER_EVENT_QUEUE_LENGTH];
+	event->command = command;
+	event->feedback = feedback;
+	event->value = value;
+#if defined DFPLAYER_TRACE
+	event->timestamp = DFPLAYER_TIMESTAMP(ctxt);
+#endif
+	DFPLAYER_STORE_RELEASE(&ctxt->event_head, (uint8_t) (head + 1));
+#else
+	DFPLAYER_COUNT(ctxt, frames_received, 1);
+	DFPLAYER_TRACE_RECEIVED(ctxt, command, feedback, value, DFPLAYER_TIMESTAMP(ctxt));
+	dfplayer_HandleReceivedMessage(ctxt, command, feedback, value);
+#endif
+}
+
+static void dfplayer_HandleReceivedMessage(dfplayer_context_t *ctxt, uint8_t command, uint8_t feedback,
+	uint16_t value)
+{
+	dfplayer_descriptor_t descriptor;
+
+	DBG("%s: command=%02x, feedback=%u, value=%04x\n", __func__, command, feedback, value);
+
+	/* Codes that aren't built have no decoder */
+	if(!dfplayer_Describe(command, &descriptor))
+	{
+		descriptor.decoder = DFPLAYER_DECODER_NONE;
+		descriptor.argument = 0;
+	}
+	if(descriptor.decoder == DFPLAYER_DECODER_NONE)
+		DFPLAYER_COUNT(ctxt, unknown_commands, 1);
+	dfplayer_decoders[descriptor.decoder](ctxt, value, descriptor.argument);
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	if(ctxt->tx_inflight > 0)
+		dfplayer_HandleAnswer(ctxt, command, value);
+#endif
+}
@@ -6,6 +6,8 @@
 #define _DFPLAYER_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +24,7 @@ typedef enum
 	DFPLAYER_ERROR_FRAME_DATA_NOT_RECEIVED = 1,
 	DFPLAYER_ERROR_VERIFICATION_ERROR      = 2
 } dfplayerError_e;
+#define DFPLAYER_ERROR_COUNT 3
 
 typedef enum
 {
@@ -41,12 +44,173 @@ typedef enum
 	DFPLAYER_PLAY_MODE_RANDOM        = 3
 } dfplayerPlaybackMode_e;
 
+#define DFPLAYER_VOL_MIN                 0
+#define DFPLAYER_VOL_MAX                 30
+
+#define DFPLAYER_FOLDER_MIN              0
+#define DFPLAYER_FOLDER_MAX              10
+
+#define DFPLAYER_TRACK_MIN               0
+#define DFPLAYER_TRACK_MAX               2999
+
+/* Command table; the one place a command is described.
+ *   X(name, code, group, priority, parameter maximum, decoder, decoder argument)
+ * group: build-time group, see DFPLAYER_NO_QUERIES and DFPLAYER_NO_SETTINGS
+ * priority: transmit priority class the command is queued with, see dfplayerPriority_e
+ * parameter maximum: largest parameter accepted when sending the command
+ * decoder: how a received message is handled (NONE for messages the device never sends)
+ * decoder argument: device for per-device messages, insertion state for device changes */
+#define DFPLAYER_COMMANDS(X) \
+	X(NEXT_TRACK,          0x01, CONTROL,  NORMAL,     0,                         NONE,           0)                      \
+	X(PREVIOUS_TRACK,      0x02, CONTROL,  NORMAL,     0,                         NONE,           0)                      \
+	X(SET_TRACK,           0x03, CONTROL,  NORMAL,     DFPLAYER_TRACK_MAX,        NONE,           0)                      \
+	X(VOLUME_UP,           0x04, CONTROL,  URGENT,     0,                         NONE,           0)                      \
+	X(VOLUME_DOWN,         0x05, CONTROL,  URGENT,     0,                         NONE,           0)                      \
+	X(VOLUME_SET,          0x06, CONTROL,  URGENT,     DFPLAYER_VOL_MAX,          NONE,           0)                      \
+	X(SET_EQUALIZER,       0x07, SETTINGS, NORMAL,     DFPLAYER_EQ_BASS,          NONE,           0)                      \
+	X(SET_PLAYBACK_MODE,   0x08, SETTINGS, NORMAL,     DFPLAYER_PLAY_MODE_RANDOM, NONE,           0)                      \
+	X(SET_PLAYBACK_SOURCE, 0x09, SETTINGS, NORMAL,     DFPLAYER_DEVICE_FLASH,     NONE,           0)                      \
+	X(POWER_MODE_STANDBY,  0x0a, SETTINGS, URGENT,     0,                         NONE,           0)                      \
+	X(POWER_MODE_NORMAL,   0x0b, SETTINGS, NORMAL,     0,                         NONE,           0)                      \
+	X(RESET,               0x0c, CONTROL,  URGENT,     0,                         NONE,           0)                      \
+	X(PLAY,                0x0d, CONTROL,  NORMAL,     0,                         NONE,           0)                      \
+	X(PAUSE,               0x0e, CONTROL,  URGENT,     0,                         NONE,           0)                      \
+	X(SET_FOLDER,          0x0f, CONTROL,  NORMAL,     DFPLAYER_FOLDER_MAX,       NONE,           0)                      \
+	X(VOLUME_ADJUST,       0x10, SETTINGS, URGENT,     31,                        NONE,           0)                      \
+	X(REPEAT,              0x11, SETTINGS, NORMAL,     1,                         NONE,           0)                      \
+	X(DEVICE_PUSH_IN,      0x3a, EVENT,    NORMAL,     0,                         DEVICE_STATE,   true)                   \
+	X(DEVICE_PULL_OUT,     0x3b, EVENT,    NORMAL,     0,                         DEVICE_STATE,   false)                  \
+	X(UDISK_FINISH,        0x3c, EVENT,    NORMAL,     0,                         TRACK_FINISHED, DFPLAYER_DEVICE_UDISK)  \
+	X(TFCARD_FINISH,       0x3d, EVENT,    NORMAL,     0,                         TRACK_FINISHED, DFPLAYER_DEVICE_TFCARD) \
+	X(FLASH_FINISH,        0x3e, EVENT,    NORMAL,     0,                         TRACK_FINISHED, DFPLAYER_DEVICE_FLASH)  \
+	X(INITIALIZE,          0x3f, EVENT,    NORMAL,     0,                         INITIALIZE,     0)                      \
+	X(ERROR_REPORT,        0x40, EVENT,    NORMAL,     0,                         ERROR,          0)                      \
+	X(REPLY,               0x41, EVENT,    NORMAL,     0,                         REPLY,          0)                      \
+	X(QUERY_STATUS,        0x42, QUERY,    BACKGROUND, 0,                         STATUS,         0)                      \
+	X(QUERY_VOLUME,        0x43, QUERY,    BACKGROUND, 0,                         VOLUME,         0)                      \
+	X(QUERY_EQUALIZER,     0x44, QUERY,    BACKGROUND, 0,                         EQUALIZER,      0)                      \
+	X(QUERY_PLAYBACK_MODE, 0x45, QUERY,    BACKGROUND, 0,                         PLAYBACK_MODE,  0)                      \
+	X(QUERY_VERSION,       0x46, QUERY,    BACKGROUND, 0,                         NONE,           0)                      \
+	X(QUERY_TFCARD_FILES,  0x47, QUERY,    BACKGROUND, 0,                         FILE_COUNT,     DFPLAYER_DEVICE_TFCARD) \
+	X(QUERY_UDISK_FILES,   0x48, QUERY,    BACKGROUND, 0,                         FILE_COUNT,     DFPLAYER_DEVICE_UDISK)  \
+	X(QUERY_FLASH_FILES,   0x49, QUERY,    BACKGROUND, 0,                         FILE_COUNT,     DFPLAYER_DEVICE_FLASH)  \
+	X(QUERY_TFCARD_TRACK,  0x4b, QUERY,    BACKGROUND, 0,                         CURRENT_TRACK,  DFPLAYER_DEVICE_TFCARD) \
+	X(QUERY_UDISK_TRACK,   0x4c, QUERY,    BACKGROUND, 0,                         CURRENT_TRACK,  DFPLAYER_DEVICE_UDISK)  \
+	X(QUERY_FLASH_TRACK,   0x4d, QUERY,    BACKGROUND, 0,                         CURRENT_TRACK,  DFPLAYER_DEVICE_FLASH)
+
+#define DFPLAYER_COMMAND_CODE(name, code, group, priority, parameter_max, decoder, argument) DFPLAYER_CMD_##name = code,
+typedef enum
+{
+	DFPLAYER_COMMANDS(DFPLAYER_COMMAND_CODE)
+	DFPLAYER_CMD_COUNT = 0x4e /* one more than the largest command code */
+} dfplayerCommand_e;
+#undef DFPLAYER_COMMAND_CODE
+
+#define DFPLAYER_FRAME_LENGTH    10 /* bytes */
+
+typedef enum
+{
+	DFPLAYER_COMMAND_OK      = 0, /* acknowledged or answered by the device */
+	DFPLAYER_COMMAND_ERROR   = 1, /* device sent an error report */
+	DFPLAYER_COMMAND_TIMEOUT = 2, /* no answer after all retransmissions */
+	DFPLAYER_COMMAND_COALESCED = 3 /* merged into a later command before transmission */
+} dfplayerCommandResult_e;
+#define DFPLAYER_COMMAND_RESULTS 4
+
+/* Transmit priority classes, most urgent first; see dfplayer_IssueCommand */
+typedef enum
+{
+	DFPLAYER_PRIORITY_URGENT     = 0, /* pausing, standby, reset and volume */
+	DFPLAYER_PRIORITY_NORMAL     = 1,
+	DFPLAYER_PRIORITY_BACKGROUND = 2  /* queries, e.g. status polling */
+} dfplayerPriority_e;
+#define DFPLAYER_PRIORITIES 3
+
+/* What a playlist does after its last entry, see dfplayer_PlaylistSetMode */
+typedef enum
+{
+	DFPLAYER_PLAYLIST_REPEAT_NONE = 0, /* stop */
+	DFPLAYER_PLAYLIST_REPEAT_ONE  = 1, /* play the current entry over and over instead of advancing */
+	DFPLAYER_PLAYLIST_REPEAT_ALL  = 2  /* start again from the first entry, reshuffled if shuffling */
+} dfplayerPlaylistRepeat_e;
+
+/* Protocol statistics, see dfplayer_GetStats */
+typedef struct dfplayer_stats_s
+{
+	/* Receiving */
+	uint32_t frames_received;   /* valid messages */
+	uint32_t bytes_discarded;   /* received bytes that weren't part of a valid message */
+	uint32_t header_errors;     /* messages with a bad version, length or end byte */
+	uint32_t checksum_errors;
+	uint32_t resyncs;           /* start bytes picked up from inside a rejected message */
+	uint32_t unknown_commands;  /* valid messages that aren't decoded */
+	uint32_t errors[DFPLAYER_ERROR_COUNT]; /* error reports, indexed by dfplayerError_e */
+	uint32_t events_dropped;    /* valid messages lost to a full event queue, see dfplayer_DispatchEvents */
+	uint32_t rx_overflows;      /* received bytes lost to a full receive ring, see dfplayer_PushSerialChar */
+	uint32_t submit_overflows;  /* commands refused by a full submission queue, see dfplayer_SubmitCommand */
+
+	/* Sending */
+	uint32_t frames_sent;
+	uint32_t send_failures;     /* messages the send callback didn't accept */
+	uint32_t retransmissions;
+	uint32_t commands_queued;   /* commands accepted into the transmit queue */
+	uint32_t commands_completed[DFPLAYER_COMMAND_RESULTS]; /* indexed by dfplayerCommandResult_e */
+	uint32_t commands_preempted; /* times a queued command was overtaken by a more urgent one */
+
+	/* Time from queueing to completion in dfplayer_Tick time units, for commands that weren't
+	 * coalesced, indexed by dfplayerPriority_e */
+	uint32_t latency_count[DFPLAYER_PRIORITIES];
+	uint32_t latency_total[DFPLAYER_PRIORITIES];
+	uint32_t latency_max[DFPLAYER_PRIORITIES];
+
+	/* Playlist; gaps are from a track-finished message to sending the next track, in
+	 * pfnTraceTimestamp units if it's set and dfplayer_Tick time units otherwise */
+	uint32_t playlist_advances;   /* tracks started on a track-finished message */
+	uint32_t playlist_duplicates; /* repeated track-finished messages ignored */
+	uint32_t playlist_gap_count;
+	uint32_t playlist_gap_total;
+	uint32_t playlist_gap_max;
+
+	uint8_t commands_outstanding; /* queued and not yet completed, when the snapshot was taken */
+	uint8_t commands_inflight;    /* of which transmitted and awaiting an answer */
+} dfplayer_stats_t;
+
+/* Cached device state fields, see dfplayer_GetCachedState */
+#define DFPLAYER_CACHE_DEVICE_UDISK    0
+#define DFPLAYER_CACHE_DEVICE_TFCARD   1
+#define DFPLAYER_CACHE_DEVICE_FLASH    2
+#define DFPLAYER_CACHE_DEVICES         3
+
+#define DFPLAYER_CACHE_VOLUME          0x0001
+#define DFPLAYER_CACHE_EQUALIZER       0x0002
+#define DFPLAYER_CACHE_PLAYBACK_MODE   0x0004
+#define DFPLAYER_CACHE_STATUS          0x0008
+#define DFPLAYER_CACHE_DEVICES_ONLINE  0x0010
+#define DFPLAYER_CACHE_TRACK(i)        (0x0020 << (i)) /* i is a DFPLAYER_CACHE_DEVICE_ index */
+#define DFPLAYER_CACHE_FILE_COUNT(i)   (0x0100 << (i))
+#define DFPLAYER_CACHE_ALL             0x07ff
+#define DFPLAYER_CACHE_FIELDS          11
+
+typedef struct dfplayer_state_s
+{
+	uint16_t valid; /* DFPLAYER_CACHE_ flags of the fields below that hold known values */
+	uint8_t volume;
+	dfplayerEqualizer_e equalizer;
+	dfplayerPlaybackMode_e playback_mode;
+	bool playing;
+	uint16_t devices_online;
+	uint16_t track[DFPLAYER_CACHE_DEVICES];
+	uint16_t file_count[DFPLAYER_CACHE_DEVICES];
+} dfplayer_state_t;
+
 /* Asynchronous events */
 typedef void (*pfn_dfplayer_HandleInitialize)(void *conext, void *token, uint16_t devices_online);
 typedef void (*pfn_dfplayer_HandleTrackFinished)(void *context, void *token, uint16_t track_number, uint16_t device);
 typedef void (*pfn_dfplayer_HandleDeviceState)(void *context, void *token, uint16_t device, bool inserted);
 typedef void (*pfn_dfplayer_HandleError)(void *context, void *token, dfplayerError_e error);
 typedef void (*pfn_dfplayer_HandleReply)(void *context, void *token);
+typedef void (*pfn_dfplayer_HandleCommandComplete)(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result);
 
 typedef void (*pfn_dfplayer_HandleStatusResponse)(void *context, void *token, bool playing);
 typedef void (*pfn_dfplayer_HandleVolumeResponse)(void *context, void *token, uint8_t volume);
@@ -56,52 +220,275 @@ typedef void (*pfn_dfplayer_HandleFileCountResponse)(void *context, void *token,
 typedef void (*pfn_dfplayer_HandleCurrentTrackResponse)(void *context, void *token, uint16_t device, uint16_t track);
 
 typedef int (*pfn_dfplayer_SendSerial)(void *context, void *token, uint8_t *data, uint32_t bytes);
+typedef int (*pfn_dfplayer_SendSerialBatch)(void *context, void *token, uint8_t *frames, uint32_t count);
+typedef uint32_t (*pfn_dfplayer_GetTimestamp)(void *context, void *token);
 
-typedef struct dfplayer_init_info_s
+/* Frame trace, see dfplayer_GetTrace */
+#define DFPLAYER_TRACE_RX    0 /* received from the device */
+#define DFPLAYER_TRACE_TX    1 /* sent to the device */
+
+typedef struct dfplayer_trace_entry_s
+{
+	uint32_t timestamp;
+	uint8_t direction; /* DFPLAYER_TRACE_RX or DFPLAYER_TRACE_TX */
+	uint8_t frame[DFPLAYER_FRAME_LENGTH];
+	uint8_t reserved;
+} dfplayer_trace_entry_t;
+
+/* Saved traces are a dfplayer_trace_file_t followed by count entries, in the byte order of the
+ * machine that saved them */
+#define DFPLAYER_TRACE_FILE_MAGIC    0x52544644 /* "DFTR" */
+#define DFPLAYER_TRACE_FILE_VERSION  1
+
+typedef struct dfplayer_trace_file_s
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;    /* sizeof(dfplayer_trace_entry_t) */
+	uint32_t count;
+	uint32_t resolution;    /* microseconds per timestamp unit */
+} dfplayer_trace_file_t;
+
+/* Application handlers. A table is registered once and shared by every context created with it,
+ * so it must outlive them; each context only keeps a pointer to it. Any handler may be NULL. */
+typedef struct dfplayer_handlers_s
 {
 	pfn_dfplayer_HandleInitialize pfnHandleInitialize;
 	pfn_dfplayer_HandleTrackFinished pfnHandleTrackFinished;
 	pfn_dfplayer_HandleDeviceState pfnHandleDeviceState;
 	pfn_dfplayer_HandleError pfnHandleError;
 	pfn_dfplayer_HandleReply pfnHandleReply;
+	pfn_dfplayer_HandleStatusResponse pfnHandleStatusResponse;
+	pfn_dfplayer_HandleVolumeResponse pfnHandleVolumeResponse;
+	pfn_dfplayer_HandleEqualizerResponse pfnHandleEqualizerResponse;
+	pfn_dfplayer_HandlePlaybackModeResponse pfnHandlePlaybackModeResponse;
+	pfn_dfplayer_HandleFileCountResponse pfnHandleFileCountResponse;
+	pfn_dfplayer_HandleCurrentTrackResponse pfnHandleCurrentTrackResponse;
+	pfn_dfplayer_HandleCommandComplete pfnHandleCommandComplete;
+} dfplayer_handlers_t;
+
+/* Zero the whole structure (e.g. with memset) before setting the fields you need: every option,
+ * the transmit queue included, is off when its field is zero, and fields left uninitialized turn
+ * options on at random. */
+typedef struct dfplayer_init_info_s
+{
+	const dfplayer_handlers_t *handlers; /* NULL for none (or for the deprecated members below) */
+
+	/* Sending, which unlike the handlers is set for each context */
 	pfn_dfplayer_SendSerial pfnSendSerial;
+
+	/* Optional; when set, messages are collected and handed over together by dfplayer_Flush() as
+	 * count consecutive DFPLAYER_FRAME_LENGTH-byte frames, and pfnSendSerial isn't used. Building
+	 * with DFPLAYER_TX_BATCH_LENGTH 0 leaves out batching; this is then ignored. */
+	pfn_dfplayer_SendSerialBatch pfnSendSerialBatch;
+
+	/* Transmit queue; a tx_window of 0 sends each command immediately without tracking it. Building
+	 * with DFPLAYER_TX_QUEUE_LENGTH 0 leaves the queue out, and these fields are then ignored. */
+	uint8_t tx_window;   /* maximum commands awaiting an answer, up to DFPLAYER_TX_QUEUE_LENGTH */
+	uint8_t tx_retries;  /* retransmissions before a command times out */
+	uint32_t tx_timeout; /* in dfplayer_Tick time units */
+	bool coalesce;       /* merge queued commands that haven't been transmitted yet */
+	bool tx_backoff;     /* double the timeout with each retransmission, up to 256 times tx_timeout */
+
+	/* Optional; a timer wheel from dfplayer_WheelInitialize that ticks the context */
+	void *wheel;
+
+	/* Optional; timestamps trace entries when built with DFPLAYER_TRACE and measures playlist
+	 * gaps. If not set, both use the time of the most recent dfplayer_Tick. With
+	 * DFPLAYER_DEFERRED_EVENTS it's also called from the receiving side, e.g. the UART interrupt,
+	 * to timestamp each message as it arrives. */
+	pfn_dfplayer_GetTimestamp pfnTraceTimestamp;
+
+#if !defined DFPLAYER_NO_LEGACY_HANDLERS
+	/* Deprecated, and to be removed in the next release: the handlers as they were set before
+	 * dfplayer_handlers_t. When handlers is NULL, the context copies these into a table of its
+	 * own. Building with DFPLAYER_NO_LEGACY_HANDLERS leaves them and that table out. */
+	pfn_dfplayer_HandleInitialize pfnHandleInitialize;
+	pfn_dfplayer_HandleTrackFinished pfnHandleTrackFinished;
+	pfn_dfplayer_HandleDeviceState pfnHandleDeviceState;
+	pfn_dfplayer_HandleError pfnHandleError;
+	pfn_dfplayer_HandleReply pfnHandleReply;
 	pfn_dfplayer_HandleStatusResponse pfnHandleStatusResponse;
 	pfn_dfplayer_HandleVolumeResponse pfnHandleVolumeResponse;
 	pfn_dfplayer_HandleEqualizerResponse pfnHandleEqualizerResponse;
 	pfn_dfplayer_HandlePlaybackModeResponse pfnHandlePlaybackModeResponse;
 	pfn_dfplayer_HandleFileCountResponse pfnHandleFileCountResponse;
 	pfn_dfplayer_HandleCurrentTrackResponse pfnHandleCurrentTrackResponse;
+	pfn_dfplayer_HandleCommandComplete pfnHandleCommandComplete;
+#endif
 } dfplayer_init_info_t;
 
+/* Contexts are allocated from the heap, or, when built with DFPLAYER_CONTEXT_POOL_SIZE, from a
+ * static pool of that many contexts, without any heap use; with a pool size of 0, only
+ * dfplayer_InitializeInPlace gives contexts. Pool contexts must be initialized and deinitialized
+ * from one thread at a time. Returns NULL if no context is available. */
 void *dfplayer_Initialize(void *token, dfplayer_init_info_t *init_info);
 
+/* Builds a context in caller-supplied storage of at least dfplayer_ContextSize() bytes, aligned
+ * for a pointer (as returned by malloc, for example). Returns storage, or NULL if it's too small
+ * or misaligned. */
+size_t dfplayer_ContextSize(void);
+void *dfplayer_InitializeInPlace(void *storage, size_t size, void *token, dfplayer_init_info_t *init_info);
+
+/* Releases a context from either initialize function; storage from dfplayer_InitializeInPlace is
+ * left to the caller. Queued commands and unsent messages are discarded without calling any
+ * handler. Accepts NULL. */
+void dfplayer_Deinitialize(void *context);
+
+/* Received bytes. After a corrupted message, the parser rescans the bytes it had buffered for the
+ * next start byte, so the message following it isn't lost; building with DFPLAYER_NO_RESYNC
+ * discards them instead. */
 void dfplayer_HandleSerialChar(void *context, uint8_t c);
+void dfplayer_HandleSerialBuffer(void *context, const uint8_t *data, size_t length);
+
+/* Received bytes, through the context's ring of DFPLAYER_RX_RING_LENGTH bytes. Call
+ * dfplayer_PushSerialChar from the UART receive interrupt: it only stores the byte, or counts it
+ * in stats.rx_overflows and returns -1 if the ring is full. dfplayer_Poll, called from the main
+ * loop, hands everything in the ring to the parser in bulk and returns the number of bytes. There
+ * must be one pushing and one polling context. Building with DFPLAYER_NO_RX_RING leaves out the
+ * ring; dfplayer_PushSerialChar then parses the byte at once and dfplayer_Poll returns 0. */
+int dfplayer_PushSerialChar(void *context, uint8_t c);
+size_t dfplayer_Poll(void *context);
+void dfplayer_Tick(void *context, uint32_t now); /* also flushes */
+
+/* A timer wheel ticks the contexts attached to it (see dfplayer_init_info_t) only when one of
+ * their retransmissions, timeouts or scheduled commands is due, so a single wheel and a single
+ * periodic dfplayer_WheelTick can serve thousands of contexts. Arming and expiring a context's
+ * timer take constant time, and a tick skips the time units with nothing due. Contexts in a
+ * wheel also take the current time from it, and the wheel and its contexts must be used from one
+ * thread. The wheel lives in caller-supplied storage of dfplayer_WheelSize() bytes, aligned for a
+ * pointer, and must outlive its contexts.
+ * dfplayer_WheelInitialize returns NULL if the storage is too small or misaligned.
+ * dfplayer_WheelTick advances the wheel to now, in dfplayer_Tick time units, and returns the
+ * number of contexts ticked. */
+size_t dfplayer_WheelSize(void);
+void *dfplayer_WheelInitialize(void *storage, size_t size, uint32_t now);
+uint32_t dfplayer_WheelTick(void *wheel, uint32_t now);
+
+/* Sends a command at a dfplayer_Tick time, and then every period time units unless period is 0,
+ * for example to poll the device's status. A due command is sent by the first dfplayer_Tick at
+ * or after its time, as if its command function had been called, or by a later one if it can't
+ * be sent then, e.g. while the transmit queue is full; after a delay of more than a period, a
+ * periodic command resumes from the time it was sent instead of catching up. A context
+ * holds up to DFPLAYER_SCHEDULE_LENGTH scheduled commands. Returns the schedule's index for
+ * dfplayer_CancelSchedule, or -1 if the command or parameter is invalid or the context's
+ * schedule is full. */
+int dfplayer_ScheduleCommand(void *context, uint8_t command, uint16_t parameter, uint32_t at, uint32_t period);
+int dfplayer_CancelSchedule(void *context, int schedule);
+
+/* Playlist of up to DFPLAYER_PLAYLIST_LENGTH entries, each a track in a folder (0 for none) on a
+ * source device (DFPLAYER_DEVICE_UDISK, _TFCARD or _FLASH). While it runs, each track-finished
+ * message starts the next entry from inside the receive path, before the track-finished handler
+ * is called, with the source and folder selected first if they differ from the previous entry's.
+ * Its commands are urgent, so they go ahead of queued queries. A track-finished message naming
+ * the same source and track as the one before it within DFPLAYER_PLAYLIST_GUARD time units is
+ * taken to be the repeat some modules send, and ignored; the guard relies on dfplayer_Tick (or a
+ * wheel) keeping time. Don't change the source or folder while the playlist runs.
+ * dfplayer_PlaylistAdd returns -1 for an invalid entry or a full playlist; entries added while
+ * running are played after the others. dfplayer_PlaylistStart plays the first entry, shuffling
+ * first if set, and returns -1 if the playlist is empty or its commands can't be sent.
+ * dfplayer_PlaylistStop only stops advancing; the track playing carries on.
+ * dfplayer_PlaylistPosition returns the index, in the order added, of the entry playing, or -1 if
+ * the playlist isn't running. */
+int dfplayer_PlaylistAdd(void *context, uint16_t device, uint8_t folder, uint16_t track);
+void dfplayer_PlaylistClear(void *context);
+void dfplayer_PlaylistSetMode(void *context, bool shuffle, dfplayerPlaylistRepeat_e repeat);
+int dfplayer_PlaylistStart(void *context);
+void dfplayer_PlaylistStop(void *context);
+int dfplayer_PlaylistPosition(void *context);
+
+/* Building with DFPLAYER_DEFERRED_EVENTS makes both parsers queue valid messages, up to
+ * DFPLAYER_EVENT_QUEUE_LENGTH of them, instead of handling them. Receiving then takes bounded time
+ * and calls no handler or send function, so dfplayer_HandleSerialChar can run in a UART
+ * interrupt. This decodes the queued messages, matches them to commands and calls the handlers;
+ * call it from the main loop, the context that also calls dfplayer_Tick and the command
+ * functions. Messages arriving while the queue is full are counted in stats.events_dropped.
+ * Returns the number of messages dispatched, always 0 without DFPLAYER_DEFERRED_EVENTS. */
+uint32_t dfplayer_DispatchEvents(void *context);
+
+/* Commands from other threads. Building with DFPLAYER_SUBMIT_QUEUE gives each context a lock-free
+ * queue of DFPLAYER_SUBMIT_QUEUE_LENGTH commands. Any number of threads may add to it with
+ * dfplayer_SubmitCommand, which checks the parameter against the command table and never calls a
+ * send function; it returns -1 for an invalid command or, counted in stats.submit_overflows, a
+ * full queue. dfplayer_DrainCommands, called from the thread that owns the context (dfplayer_Tick
+ * also calls it), passes submitted commands on in order as if the command functions had been
+ * called, so frames are only ever written from that thread. Commands wait in the queue while the
+ * transmit queue is full. Returns the number of commands passed on. Without
+ * DFPLAYER_SUBMIT_QUEUE, dfplayer_SubmitCommand sends the command at once, like the command
+ * functions, and dfplayer_DrainCommands returns 0. */
+int dfplayer_SubmitCommand(void *context, uint8_t command, uint16_t parameter);
+uint32_t dfplayer_DrainCommands(void *context);
+int dfplayer_Flush(void *context);
+uint32_t dfplayer_CoalescedCount(void *context); /* commands_completed[DFPLAYER_COMMAND_COALESCED] */
+
+/* Copies the protocol statistics counters; cheap enough to poll. dfplayer_ResetStats zeroes the
+ * counters, but not the outstanding command counts, which describe the transmit queue. Building
+ * with DFPLAYER_NO_STATS leaves the counters out of the context; they then always read 0. */
+void dfplayer_GetStats(void *context, dfplayer_stats_t *stats);
+void dfplayer_ResetStats(void *context);
+
+/* Building with DFPLAYER_TRACE records every frame sent and every valid frame received in a ring
+ * of the last DFPLAYER_TRACE_LENGTH frames, without allocation or formatting. This copies up to
+ * max of the most recent entries, oldest first, and returns how many were copied (always 0
+ * without DFPLAYER_TRACE). Call it from the thread driving the context. */
+uint32_t dfplayer_GetTrace(void *context, dfplayer_trace_entry_t *entries, uint32_t max);
+
+/* Copies the device state tracked from sent commands and received messages, without any serial
+ * communication. Fields not updated within max_age dfplayer_Tick time units are left out of
+ * state->valid; a max_age of 0 accepts any age. Returns state->valid. */
+uint16_t dfplayer_GetCachedState(void *context, dfplayer_state_t *state, uint32_t max_age);
+
+/* Encodes a command message into a caller-supplied buffer, e.g. to pack many messages into one
+ * write. Returns the number of bytes written, or -1 if the buffer is too small or the command or
+ * parameter is invalid. */
+int dfplayer_EncodeFrame(uint8_t *buffer, uint32_t size, uint8_t command, uint16_t parameter, bool feedback);
+
+/* Returns the precomputed message (DFPLAYER_FRAME_LENGTH bytes, checksum included) for a command
+ * that takes no parameter, requesting a reply, or NULL if none exists. On AVR the message is in
+ * program memory; read it with memcpy_P or pgm_read_byte. Building with DFPLAYER_NO_STATIC_FRAMES
+ * leaves out the precomputed messages. */
+const uint8_t *dfplayer_GetStaticFrame(uint8_t command);
+
+/* With a transmit window, queued commands are sent in priority order: a command is queued ahead
+ * of waiting queries of a less urgent class, so status polling doesn't hold up a pause. Commands
+ * that change the device's state keep their order relative to each other, and a query that has
+ * been overtaken DFPLAYER_TX_MAX_BYPASS times isn't overtaken again. The command functions use
+ * the priority given in the command table; this sends any command with the priority given. Returns
+ * -1 if the command or parameter is invalid or the transmit queue is full. */
+int dfplayer_IssueCommand(void *context, uint8_t command, uint16_t parameter, dfplayerPriority_e priority);
 
 int dfplayer_Play(void *context);
 int dfplayer_Pause(void *context);
 int dfplayer_NextTrack(void *context);
 int dfplayer_PreviousTrack(void *context);
 int dfplayer_SetTrack(void *context, uint16_t track_number);
-int dfplayer_SetPlaybackMode(void *context, dfplayerPlaybackMode_e mode);
-int dfplayer_SetPlaybackSource(void *context, uint16_t device);
 int dfplayer_SetFolder(void *context, uint8_t folder_number);
-int dfplayer_EnableRepeatPlayback(void *context, bool enable);
 
-int dfplayer_SetEqualizer(void *context, dfplayerEqualizer_e mode);
 int dfplayer_VolumeUp(void *context);
 int dfplayer_VolumeDown(void *context);
 int dfplayer_VolumeSet(void *context, uint8_t volume);
 
-int dfplayer_SetStandbyMode(void *context, bool enable);
 int dfplayer_Reset(void *context);
 
-/* The following functions cause response handler functions to be called */
+/* Building with DFPLAYER_NO_SETTINGS leaves out the following functions */
+#if !defined DFPLAYER_NO_SETTINGS
+int dfplayer_SetPlaybackMode(void *context, dfplayerPlaybackMode_e mode);
+int dfplayer_SetPlaybackSource(void *context, uint16_t device);
+int dfplayer_EnableRepeatPlayback(void *context, bool enable);
+int dfplayer_SetEqualizer(void *context, dfplayerEqualizer_e mode);
+int dfplayer_SetStandbyMode(void *context, bool enable);
+#endif
+
+/* The following functions cause response handler functions to be called. Building with
+ * DFPLAYER_NO_QUERIES leaves them out, along with the decoding of their responses. */
+#if !defined DFPLAYER_NO_QUERIES
 int dfplayer_QueryStatus(void *context);
 int dfplayer_QueryVolume(void *context);
 int dfplayer_QueryEqualizer(void *context);
 int dfplayer_QueryPlaybackMode(void *context);
 int dfplayer_QueryFileCount(void *context, uint8_t device); 
 int dfplayer_QueryCurrentTrack(void *context, uint8_t device); 
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,386 @@
+/*! \copyright 2016-2017 Zorxx Software. All rights reserved.
+ *  \file dfplayer.hpp
+ *  \brief Header-only C++ interface to the dfplayer library
+ *
+ * dfplayer::Player<Derived> wraps a context. Handlers are member functions of the derived class,
+ * found at compile time:
+ *
+ *   class Speaker : public dfplayer::Player<Speaker>
+ *   {
+ *   public:
+ *       int Send(const uint8_t *data, uint32_t bytes);   // required
+ *       void OnTrackFinished(uint16_t track, dfplayer::Device device);
+ *   };
+ *
+ * Each derived class gets one const handler table, shared by all of its players, that holds only
+ * the handlers it defines; events it doesn't handle are skipped by the library without a call.
+ * A defined handler is reached through one call into a trampoline that the handler is inlined
+ * into. Handlers must be public, or the derived class must befriend Player<Derived>. The
+ * following may be defined, with these signatures:
+ *
+ *   void OnInitialize(uint16_t devices_online);       // DFPLAYER_DEVICE_ flags
+ *   void OnTrackFinished(uint16_t track, Device device);
+ *   void OnDeviceState(Device device, bool inserted);
+ *   void OnError(Error error);
+ *   void OnReply();
+ *   void OnCommandComplete(Command command, CommandResult result);
+ *   void OnStatus(bool playing);
+ *   void OnVolume(uint8_t volume);
+ *   void OnEqualizer(Equalizer mode);
+ *   void OnPlaybackMode(PlaybackMode mode);
+ *   void OnFileCount(Device device, uint16_t file_count);
+ *   void OnCurrentTrack(Device device, uint16_t track);
+ *
+ *   int SendBatch(const uint8_t *frames, uint32_t count); // replaces Send, see pfnSendSerialBatch
+ *   uint32_t TraceTimestamp();                            // see pfnTraceTimestamp
+ *
+ * Only C++11 is needed, and no standard library, so the wrapper can be used on microcontrollers.
+ */
+#ifndef _DFPLAYER_HPP
+#define _DFPLAYER_HPP
+
+#include "dfplayer.h"
+
+namespace dfplayer
+{
+
+enum class Device : uint16_t
+{
+	UDisk  = DFPLAYER_DEVICE_UDISK,
+	TfCard = DFPLAYER_DEVICE_TFCARD,
+	Pc     = DFPLAYER_DEVICE_PC,
+	Flash  = DFPLAYER_DEVICE_FLASH
+};
+
+enum class Equalizer : uint8_t
+{
+	Normal    = DFPLAYER_EQ_NORMAL,
+	Pop       = DFPLAYER_EQ_POP,
+	Rock      = DFPLAYER_EQ_ROCK,
+	Jazz      = DFPLAYER_EQ_JAZZ,
+	Classical = DFPLAYER_EQ_CLASSICAL,
+	Bass      = DFPLAYER_EQ_BASS
+};
+
+enum class PlaybackMode : uint8_t
+{
+	Repeat       = DFPLAYER_PLAY_MODE_REPEAT,
+	FolderRepeat = DFPLAYER_PLAY_MODE_FOLDER_REPEAT,
+	SingleRepeat = DFPLAYER_PLAY_MODE_SINGLE_REPEAT,
+	Random       = DFPLAYER_PLAY_MODE_RANDOM
+};
+
+enum class Error : uint8_t
+{
+	Busy                 = DFPLAYER_ERROR_BUSY,
+	FrameDataNotReceived = DFPLAYER_ERROR_FRAME_DATA_NOT_RECEIVED,
+	VerificationError    = DFPLAYER_ERROR_VERIFICATION_ERROR
+};
+
+enum class CommandResult : uint8_t
+{
+	Ok        = DFPLAYER_COMMAND_OK,
+	Error     = DFPLAYER_COMMAND_ERROR,
+	Timeout   = DFPLAYER_COMMAND_TIMEOUT,
+	Coalesced = DFPLAYER_COMMAND_COALESCED
+};
+
+enum class Priority : uint8_t
+{
+	Urgent     = DFPLAYER_PRIORITY_URGENT,
+	Normal     = DFPLAYER_PRIORITY_NORMAL,
+	Background = DFPLAYER_PRIORITY_BACKGROUND
+};
+
+enum class PlaylistRepeat : uint8_t
+{
+	None = DFPLAYER_PLAYLIST_REPEAT_NONE,
+	One  = DFPLAYER_PLAYLIST_REPEAT_ONE,
+	All  = DFPLAYER_PLAYLIST_REPEAT_ALL
+};
+
+#define DFPLAYER_HPP_COMMAND(name, code, group, priority, parameter_max, decoder, argument) name = code,
+enum class Command : uint8_t
+{
+	DFPLAYER_COMMANDS(DFPLAYER_HPP_COMMAND)
+};
+#undef DFPLAYER_HPP_COMMAND
+
+/* Transmit queue settings, see dfplayer_init_info_t */
+struct Settings
+{
+	uint8_t tx_window;
+	uint8_t tx_retries;
+	uint32_t tx_timeout;
+	bool coalesce;
+	bool tx_backoff;
+	void *wheel; /* see dfplayer_WheelInitialize */
+};
+
+namespace detail
+{
+	template <typename A, typename B> struct IsSame { static constexpr bool value = false; };
+	template <typename A> struct IsSame<A, A> { static constexpr bool value = true; };
+	template <bool B> struct Bool {};
+
+	/* Handler table entry; f if the derived class defines the handler, else NULL */
+	template <typename F> constexpr F Select(bool defined, F f)
+	{
+		return (defined) ? f : nullptr;
+	}
+}
+
+/* Whether Derived defines a handler rather than inheriting Player's placeholder */
+#define DFPLAYER_HPP_DEFINES(handler) \
+	(!::dfplayer::detail::IsSame<decltype(&Derived::handler), decltype(&Player::handler)>::value)
+
+template <typename Derived>
+class Player
+{
+public:
+	Player() : context_(nullptr) {}
+	~Player() { dfplayer_Deinitialize(context_); }
+
+	Player(const Player &) = delete;
+	Player &operator=(const Player &) = delete;
+
+	/* Returns false if no context is available, see dfplayer_Initialize */
+	bool Initialize(const Settings &settings = Settings())
+	{
+		dfplayer_init_info_t info = dfplayer_init_info_t();
+
+		if(context_ != nullptr)
+			return true;
+
+		info.handlers = &handlers_;
+		SetSend(&info, detail::Bool<DFPLAYER_HPP_DEFINES(SendBatch)>());
+		info.tx_window = settings.tx_window;
+		info.tx_retries = settings.tx_retries;
+		info.tx_timeout = settings.tx_timeout;
+		info.coalesce = settings.coalesce;
+		info.tx_backoff = settings.tx_backoff;
+		info.wheel = settings.wheel;
+		info.pfnTraceTimestamp = detail::Select(DFPLAYER_HPP_DEFINES(TraceTimestamp), &Player::HandleTraceTimestamp);
+
+		context_ = dfplayer_Initialize(static_cast<Derived *>(this), &info);
+		return context_ != nullptr;
+	}
+
+	void *Context() const { return context_; }
+
+	/* Receiving and servicing, see dfplayer.h */
+	void Receive(uint8_t c) { dfplayer_HandleSerialChar(context_, c); }
+	void Receive(const uint8_t *data, size_t length) { dfplayer_HandleSerialBuffer(context_, data, length); }
+	bool Push(uint8_t c) { return dfplayer_PushSerialChar(context_, c) == 0; }
+	size_t Poll() { return dfplayer_Poll(context_); }
+	uint32_t DispatchEvents() { return dfplayer_DispatchEvents(context_); }
+	bool SubmitCommand(Command command, uint16_t parameter = 0)
+	{
+		return dfplayer_SubmitCommand(context_, static_cast<uint8_t>(command), parameter) == 0;
+	}
+	uint32_t DrainCommands() { return dfplayer_DrainCommands(context_); }
+	void Tick(uint32_t now) { dfplayer_Tick(context_, now); }
+	bool Flush() { return dfplayer_Flush(context_) == 0; }
+
+	dfplayer_stats_t Stats() const
+	{
+		dfplayer_stats_t stats;
+		dfplayer_GetStats(context_, &stats);
+		return stats;
+	}
+	void ResetStats() { dfplayer_ResetStats(context_); }
+
+	dfplayer_state_t CachedState(uint32_t max_age = 0) const
+	{
+		dfplayer_state_t state;
+		dfplayer_GetCachedState(context_, &state, max_age);
+		return state;
+	}
+
+	/* Commands; each returns false if it wasn't accepted */
+	bool Issue(Command command, uint16_t parameter, Priority priority)
+	{
+		return dfplayer_IssueCommand(context_, static_cast<uint8_t>(command), parameter,
+			static_cast<dfplayerPriority_e>(priority)) == 0;
+	}
+	/* Returns the schedule index, or -1 if none is free, see dfplayer_ScheduleCommand */
+	int Schedule(Command command, uint16_t parameter, uint32_t at, uint32_t period = 0)
+	{
+		return dfplayer_ScheduleCommand(context_, static_cast<uint8_t>(command), parameter, at, period);
+	}
+	bool CancelSchedule(int schedule) { return dfplayer_CancelSchedule(context_, schedule) == 0; }
+
+	/* Playlist, see dfplayer_PlaylistStart */
+	bool PlaylistAdd(Device device, uint8_t folder, uint16_t track)
+	{
+		return dfplayer_PlaylistAdd(context_, static_cast<uint16_t>(device), folder, track) == 0;
+	}
+	void PlaylistClear() { dfplayer_PlaylistClear(context_); }
+	void PlaylistSetMode(bool shuffle, PlaylistRepeat repeat)
+	{
+		dfplayer_PlaylistSetMode(context_, shuffle, static_cast<dfplayerPlaylistRepeat_e>(repeat));
+	}
+	bool PlaylistStart() { return dfplayer_PlaylistStart(context_) == 0; }
+	void PlaylistStop() { dfplayer_PlaylistStop(context_); }
+	int PlaylistPosition() { return dfplayer_PlaylistPosition(context_); }
+	bool Play() { return dfplayer_Play(context_) == 0; }
+	bool Pause() { return dfplayer_Pause(context_) == 0; }
+	bool NextTrack() { return dfplayer_NextTrack(context_) == 0; }
+	bool PreviousTrack() { return dfplayer_PreviousTrack(context_) == 0; }
+	bool SetTrack(uint16_t track) { return dfplayer_SetTrack(context_, track) == 0; }
+	bool SetFolder(uint8_t folder) { return dfplayer_SetFolder(context_, folder) == 0; }
+	bool VolumeUp() { return dfplayer_VolumeUp(context_) == 0; }
+	bool VolumeDown() { return dfplayer_VolumeDown(context_) == 0; }
+	bool SetVolume(uint8_t volume) { return dfplayer_VolumeSet(context_, volume) == 0; }
+	bool Reset() { return dfplayer_Reset(context_) == 0; }
+
+#if !defined DFPLAYER_NO_SETTINGS
+	bool SetPlaybackMode(PlaybackMode mode)
+	{
+		return dfplayer_SetPlaybackMode(context_, static_cast<dfplayerPlaybackMode_e>(mode)) == 0;
+	}
+	bool SetPlaybackSource(Device device)
+	{
+		return dfplayer_SetPlaybackSource(context_, static_cast<uint16_t>(device)) == 0;
+	}
+	bool EnableRepeatPlayback(bool enable) { return dfplayer_EnableRepeatPlayback(context_, enable) == 0; }
+	bool SetEqualizer(Equalizer mode)
+	{
+		return dfplayer_SetEqualizer(context_, static_cast<dfplayerEqualizer_e>(mode)) == 0;
+	}
+	bool SetStandbyMode(bool enable) { return dfplayer_SetStandbyMode(context_, enable) == 0; }
+#endif
+
+#if !defined DFPLAYER_NO_QUERIES
+	bool QueryStatus() { return dfplayer_QueryStatus(context_) == 0; }
+	bool QueryVolume() { return dfplayer_QueryVolume(context_) == 0; }
+	bool QueryEqualizer() { return dfplayer_QueryEqualizer(context_) == 0; }
+	bool QueryPlaybackMode() { return dfplayer_QueryPlaybackMode(context_) == 0; }
+	bool QueryFileCount(Device device)
+	{
+		return dfplayer_QueryFileCount(context_, static_cast<uint8_t>(device)) == 0;
+	}
+	bool QueryCurrentTrack(Device device)
+	{
+		return dfplayer_QueryCurrentTrack(context_, static_cast<uint8_t>(device)) == 0;
+	}
+#endif
+
+	/* Placeholders, never called; they only mark handlers the derived class doesn't define */
+	void OnInitialize(uint16_t) {}
+	void OnTrackFinished(uint16_t, Device) {}
+	void OnDeviceState(Device, bool) {}
+	void OnError(Error) {}
+	void OnReply() {}
+	void OnCommandComplete(Command, CommandResult) {}
+	void OnStatus(bool) {}
+	void OnVolume(uint8_t) {}
+	void OnEqualizer(Equalizer) {}
+	void OnPlaybackMode(PlaybackMode) {}
+	void OnFileCount(Device, uint16_t) {}
+	void OnCurrentTrack(Device, uint16_t) {}
+	int SendBatch(const uint8_t *, uint32_t) { return -1; }
+	uint32_t TraceTimestamp() { return 0; }
+
+private:
+	static Derived *Self(void *token) { return static_cast<Derived *>(token); }
+
+	/* Chosen at compile time, so that a class defining only SendBatch needs no Send */
+	static void SetSend(dfplayer_init_info_t *info, detail::Bool<true>)
+	{
+		info->pfnSendSerialBatch = &Player::HandleSendBatch;
+	}
+	static void SetSend(dfplayer_init_info_t *info, detail::Bool<false>)
+	{
+		info->pfnSendSerial = &Player::HandleSend;
+	}
+
+	static void HandleInitialize(void *, void *token, uint16_t devices_online)
+	{
+		Self(token)->OnInitialize(devices_online);
+	}
+	static void HandleTrackFinished(void *, void *token, uint16_t track, uint16_t device)
+	{
+		Self(token)->OnTrackFinished(track, static_cast<Device>(device));
+	}
+	static void HandleDeviceState(void *, void *token, uint16_t device, bool inserted)
+	{
+		Self(token)->OnDeviceState(static_cast<Device>(device), inserted);
+	}
+	static void HandleError(void *, void *token, dfplayerError_e error)
+	{
+		Self(token)->OnError(static_cast<Error>(error));
+	}
+	static void HandleReply(void *, void *token)
+	{
+		Self(token)->OnReply();
+	}
+	static void HandleCommandComplete(void *, void *token, uint8_t command, dfplayerCommandResult_e result)
+	{
+		Self(token)->OnCommandComplete(static_cast<Command>(command), static_cast<CommandResult>(result));
+	}
+	static void HandleStatus(void *, void *token, bool playing)
+	{
+		Self(token)->OnStatus(playing);
+	}
+	static void HandleVolume(void *, void *token, uint8_t volume)
+	{
+		Self(token)->OnVolume(volume);
+	}
+	static void HandleEqualizer(void *, void *token, dfplayerEqualizer_e mode)
+	{
+		Self(token)->OnEqualizer(static_cast<Equalizer>(mode));
+	}
+	static void HandlePlaybackMode(void *, void *token, dfplayerPlaybackMode_e mode)
+	{
+		Self(token)->OnPlaybackMode(static_cast<PlaybackMode>(mode));
+	}
+	static void HandleFileCount(void *, void *token, uint16_t device, uint16_t file_count)
+	{
+		Self(token)->OnFileCount(static_cast<Device>(device), file_count);
+	}
+	static void HandleCurrentTrack(void *, void *token, uint16_t device, uint16_t track)
+	{
+		Self(token)->OnCurrentTrack(static_cast<Device>(device), track);
+	}
+	static int HandleSend(void *, void *token, uint8_t *data, uint32_t bytes)
+	{
+		return Self(token)->Send(data, bytes);
+	}
+	static int HandleSendBatch(void *, void *token, uint8_t *frames, uint32_t count)
+	{
+		return Self(token)->SendBatch(frames, count);
+	}
+	static uint32_t HandleTraceTimestamp(void *, void *token)
+	{
+		return Self(token)->TraceTimestamp();
+	}
+
+	static const dfplayer_handlers_t handlers_;
+
+	void *context_;
+};
+
+/* In dfplayer_handlers_t order */
+template <typename Derived>
+const dfplayer_handlers_t Player<Derived>::handlers_ =
+{
+	detail::Select(DFPLAYER_HPP_DEFINES(OnInitialize), &Player::HandleInitialize),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnTrackFinished), &Player::HandleTrackFinished),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnDeviceState), &Player::HandleDeviceState),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnError), &Player::HandleError),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnReply), &Player::HandleReply),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnStatus), &Player::HandleStatus),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnVolume), &Player::HandleVolume),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnEqualizer), &Player::HandleEqualizer),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnPlaybackMode), &Player::HandlePlaybackMode),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnFileCount), &Player::HandleFileCount),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnCurrentTrack), &Player::HandleCurrentTrack),
+	detail::Select(DFPLAYER_HPP_DEFINES(OnCommandComplete), &Player::HandleCommandComplete)
+};
+
+#undef DFPLAYER_HPP_DEFINES
+
+} /* namespace dfplayer */
+
+#endif /* _DFPLAYER_HPP */
@@ -0,0 +1,381 @@
+/*! \copyright 2016-2017 Zorxx Software. All rights reserved.
+ *  \file dfplayer_coroutine.hpp
+ *  \brief C++20 coroutine interface: commands and queries that can be awaited
+ *
+ * dfplayer::AsyncPlayer<Derived> is a dfplayer::Player whose commands return awaitables instead
+ * of bool. A coroutine awaiting one is resumed once the device has answered, with the decoded
+ * value for queries, or once the command failed (error report, timeout, or not accepted):
+ *
+ *   dfplayer::Task Report(Speaker &speaker)
+ *   {
+ *       auto volume = co_await speaker.QueryVolume();
+ *       auto files = co_await speaker.QueryFileCount(dfplayer::Device::TfCard);
+ *       if(volume && files)
+ *           printf("volume %u, %u files\n", volume.value, files.value);
+ *   }
+ *
+ * Coroutines are resumed by a dfplayer::Executor, from its Run(). Call that from the serial event
+ * loop after handing received bytes to the player and after Tick(), on the same thread; one
+ * executor can serve any number of players. Any number of commands may be awaited at once, up to
+ * the transmit queue length. A command is only sent when awaited.
+ *
+ * AsyncPlayer handles OnCommandComplete and the query responses itself; the derived class may
+ * still define the other handlers of dfplayer.hpp, and must define Send or SendBatch. Commands
+ * issued through Player's bool functions (e.g. Player<Derived>::Play()) bypass the awaiters and
+ * must not be mixed with awaited commands of the same kind. A player must outlive the coroutines
+ * awaiting it.
+ */
+#ifndef _DFPLAYER_COROUTINE_HPP
+#define _DFPLAYER_COROUTINE_HPP
+
+#include <coroutine>
+#include <exception>
+#include "dfplayer.hpp"
+
+namespace dfplayer
+{
+
+enum class Status : uint8_t
+{
+	Ok,
+	Error,    /* the device reported an error */
+	Timeout,  /* no answer after all retransmissions */
+	Rejected  /* not accepted, e.g. with the transmit queue full or an invalid parameter */
+};
+
+template <typename T>
+struct Result
+{
+	Status status;
+	T value; /* only meaningful when status is Ok */
+
+	explicit operator bool() const { return status == Status::Ok; }
+};
+
+template <>
+struct Result<void>
+{
+	Status status;
+
+	explicit operator bool() const { return status == Status::Ok; }
+};
+
+/* A detached coroutine; it starts when called and frees itself when it returns */
+class Task
+{
+public:
+	struct promise_type
+	{
+		Task get_return_object() noexcept { return Task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+namespace detail
+{
+	/* An awaited command; lives in the awaiting coroutine's frame while it is suspended */
+	struct Operation
+	{
+		Operation *next;
+		std::coroutine_handle<> handle;
+		uint8_t command;
+		Status status;
+		uint16_t value;
+	};
+
+	/* Singly linked list of operations, oldest first */
+	struct OperationList
+	{
+		Operation *head = nullptr;
+		Operation *tail = nullptr;
+
+		void Append(Operation *operation)
+		{
+			operation->next = nullptr;
+			if(tail != nullptr)
+				tail->next = operation;
+			else
+				head = operation;
+			tail = operation;
+		}
+
+		/* Removes and returns the oldest operation for command, or nullptr */
+		Operation *Remove(uint8_t command)
+		{
+			Operation *previous = nullptr;
+
+			for(Operation *operation = head; operation != nullptr; operation = operation->next)
+			{
+				if(operation->command != command)
+				{
+					previous = operation;
+					continue;
+				}
+				if(previous != nullptr)
+					previous->next = operation->next;
+				else
+					head = operation->next;
+				if(tail == operation)
+					tail = previous;
+				return operation;
+			}
+			return nullptr;
+		}
+
+		Operation *Pop()
+		{
+			Operation *operation = head;
+
+			if(operation != nullptr)
+			{
+				head = operation->next;
+				if(head == nullptr)
+					tail = nullptr;
+			}
+			return operation;
+		}
+	};
+}
+
+class Executor
+{
+public:
+	/* Resumes every coroutine whose command has completed, including those completing while
+	 * this runs. Returns the number resumed. */
+	size_t Run()
+	{
+		detail::Operation *operation;
+		size_t count = 0;
+
+		while((operation = ready_.Pop()) != nullptr)
+		{
+			operation->handle.resume();
+			++count;
+		}
+		return count;
+	}
+
+	bool Idle() const { return ready_.head == nullptr; }
+
+	void Schedule(detail::Operation *operation) { ready_.Append(operation); }
+
+private:
+	detail::OperationList ready_;
+};
+
+template <typename Derived>
+class AsyncPlayer : public Player<Derived>
+{
+	using Issue = int (*)(void *context, uint16_t parameter);
+
+public:
+	template <typename T>
+	class [[nodiscard]] Awaitable : private detail::Operation
+	{
+	public:
+		Awaitable(AsyncPlayer &player, uint8_t command, uint16_t parameter, Issue issue)
+			: player_(player), parameter_(parameter), issue_(issue)
+		{
+			this->command = command;
+			this->status = Status::Rejected;
+			this->value = 0;
+		}
+
+		bool await_ready() const noexcept { return false; }
+
+		/* Sends the command; a command that isn't accepted resumes the caller immediately */
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			if(issue_(player_.Context(), parameter_) != 0)
+				return false;
+			this->handle = handle;
+			player_.pending_.Append(this);
+			return true;
+		}
+
+		Result<T> await_resume() const
+		{
+			if constexpr(detail::IsSame<T, void>::value)
+				return Result<T>{ this->status };
+			else
+				return Result<T>{ this->status, static_cast<T>(this->value) };
+		}
+
+	private:
+		AsyncPlayer &player_;
+		uint16_t parameter_;
+		Issue issue_;
+	};
+
+	explicit AsyncPlayer(Executor &executor) : executor_(executor) {}
+
+	/* Awaited commands need tracking and their own answers, so the transmit window is at least
+	 * one and coalescing is off; the library must be built with a transmit queue */
+	bool Initialize(Settings settings = Settings())
+	{
+		if(settings.tx_window == 0)
+			settings.tx_window = 1;
+		settings.coalesce = false;
+		return Player<Derived>::Initialize(settings);
+	}
+
+	Awaitable<void> Play()
+	{
+		return Submit<void>(DFPLAYER_CMD_PLAY, 0, [](void *c, uint16_t) { return dfplayer_Play(c); });
+	}
+	Awaitable<void> Pause()
+	{
+		return Submit<void>(DFPLAYER_CMD_PAUSE, 0, [](void *c, uint16_t) { return dfplayer_Pause(c); });
+	}
+	Awaitable<void> NextTrack()
+	{
+		return Submit<void>(DFPLAYER_CMD_NEXT_TRACK, 0, [](void *c, uint16_t) { return dfplayer_NextTrack(c); });
+	}
+	Awaitable<void> PreviousTrack()
+	{
+		return Submit<void>(DFPLAYER_CMD_PREVIOUS_TRACK, 0,
+			[](void *c, uint16_t) { return dfplayer_PreviousTrack(c); });
+	}
+	Awaitable<void> SetTrack(uint16_t track)
+	{
+		return Submit<void>(DFPLAYER_CMD_SET_TRACK, track,
+			[](void *c, uint16_t p) { return dfplayer_SetTrack(c, p); });
+	}
+	Awaitable<void> SetFolder(uint8_t folder)
+	{
+		return Submit<void>(DFPLAYER_CMD_SET_FOLDER, folder,
+			[](void *c, uint16_t p) { return dfplayer_SetFolder(c, static_cast<uint8_t>(p)); });
+	}
+	Awaitable<void> VolumeUp()
+	{
+		return Submit<void>(DFPLAYER_CMD_VOLUME_UP, 0, [](void *c, uint16_t) { return dfplayer_VolumeUp(c); });
+	}
+	Awaitable<void> VolumeDown()
+	{
+		return Submit<void>(DFPLAYER_CMD_VOLUME_DOWN, 0, [](void *c, uint16_t) { return dfplayer_VolumeDown(c); });
+	}
+	Awaitable<void> SetVolume(uint8_t volume)
+	{
+		return Submit<void>(DFPLAYER_CMD_VOLUME_SET, volume,
+			[](void *c, uint16_t p) { return dfplayer_VolumeSet(c, static_cast<uint8_t>(p)); });
+	}
+	Awaitable<void> Reset()
+	{
+		return Submit<void>(DFPLAYER_CMD_RESET, 0, [](void *c, uint16_t) { return dfplayer_Reset(c); });
+	}
+
+#if !defined DFPLAYER_NO_SETTINGS
+	Awaitable<void> SetPlaybackMode(PlaybackMode mode)
+	{
+		return Submit<void>(DFPLAYER_CMD_SET_PLAYBACK_MODE, static_cast<uint16_t>(mode), [](void *c, uint16_t p)
+			{ return dfplayer_SetPlaybackMode(c, static_cast<dfplayerPlaybackMode_e>(p)); });
+	}
+	Awaitable<void> SetPlaybackSource(Device device)
+	{
+		return Submit<void>(DFPLAYER_CMD_SET_PLAYBACK_SOURCE, static_cast<uint16_t>(device),
+			[](void *c, uint16_t p) { return dfplayer_SetPlaybackSource(c, p); });
+	}
+	Awaitable<void> EnableRepeatPlayback(bool enable)
+	{
+		return Submit<void>(DFPLAYER_CMD_REPEAT, enable,
+			[](void *c, uint16_t p) { return dfplayer_EnableRepeatPlayback(c, p != 0); });
+	}
+	Awaitable<void> SetEqualizer(Equalizer mode)
+	{
+		return Submit<void>(DFPLAYER_CMD_SET_EQUALIZER, static_cast<uint16_t>(mode), [](void *c, uint16_t p)
+			{ return dfplayer_SetEqualizer(c, static_cast<dfplayerEqualizer_e>(p)); });
+	}
+	Awaitable<void> SetStandbyMode(bool enable)
+	{
+		return Submit<void>((enable) ? DFPLAYER_CMD_POWER_MODE_STANDBY : DFPLAYER_CMD_POWER_MODE_NORMAL, enable,
+			[](void *c, uint16_t p) { return dfplayer_SetStandbyMode(c, p != 0); });
+	}
+#endif
+
+#if !defined DFPLAYER_NO_QUERIES
+	Awaitable<bool> QueryStatus()
+	{
+		return Submit<bool>(DFPLAYER_CMD_QUERY_STATUS, 0,
+			[](void *c, uint16_t) { return dfplayer_QueryStatus(c); });
+	}
+	Awaitable<uint8_t> QueryVolume()
+	{
+		return Submit<uint8_t>(DFPLAYER_CMD_QUERY_VOLUME, 0,
+			[](void *c, uint16_t) { return dfplayer_QueryVolume(c); });
+	}
+	Awaitable<Equalizer> QueryEqualizer()
+	{
+		return Submit<Equalizer>(DFPLAYER_CMD_QUERY_EQUALIZER, 0,
+			[](void *c, uint16_t) { return dfplayer_QueryEqualizer(c); });
+	}
+	Awaitable<PlaybackMode> QueryPlaybackMode()
+	{
+		return Submit<PlaybackMode>(DFPLAYER_CMD_QUERY_PLAYBACK_MODE, 0,
+			[](void *c, uint16_t) { return dfplayer_QueryPlaybackMode(c); });
+	}
+	Awaitable<uint16_t> QueryFileCount(Device device)
+	{
+		return Submit<uint16_t>(PerDevice(device, DFPLAYER_CMD_QUERY_TFCARD_FILES, DFPLAYER_CMD_QUERY_UDISK_FILES,
+			DFPLAYER_CMD_QUERY_FLASH_FILES), static_cast<uint16_t>(device),
+			[](void *c, uint16_t p) { return dfplayer_QueryFileCount(c, static_cast<uint8_t>(p)); });
+	}
+	Awaitable<uint16_t> QueryCurrentTrack(Device device)
+	{
+		return Submit<uint16_t>(PerDevice(device, DFPLAYER_CMD_QUERY_TFCARD_TRACK, DFPLAYER_CMD_QUERY_UDISK_TRACK,
+			DFPLAYER_CMD_QUERY_FLASH_TRACK), static_cast<uint16_t>(device),
+			[](void *c, uint16_t p) { return dfplayer_QueryCurrentTrack(c, static_cast<uint8_t>(p)); });
+	}
+#endif
+
+	/* Handlers; a query's response is decoded just before its command completes */
+	void OnCommandComplete(dfplayer::Command command, CommandResult result)
+	{
+		detail::Operation *operation = pending_.Remove(static_cast<uint8_t>(command));
+
+		if(operation == nullptr)
+			return;
+		switch(result)
+		{
+			case CommandResult::Ok: operation->status = Status::Ok; break;
+			case CommandResult::Error: operation->status = Status::Error; break;
+			default: operation->status = Status::Timeout; break;
+		}
+		operation->value = answer_;
+		executor_.Schedule(operation);
+	}
+	void OnStatus(bool playing) { answer_ = playing; }
+	void OnVolume(uint8_t volume) { answer_ = volume; }
+	void OnEqualizer(Equalizer mode) { answer_ = static_cast<uint16_t>(mode); }
+	void OnPlaybackMode(PlaybackMode mode) { answer_ = static_cast<uint16_t>(mode); }
+	void OnFileCount(Device, uint16_t file_count) { answer_ = file_count; }
+	void OnCurrentTrack(Device, uint16_t track) { answer_ = track; }
+
+private:
+	template <typename T>
+	Awaitable<T> Submit(uint8_t command, uint16_t parameter, Issue issue)
+	{
+		return Awaitable<T>(*this, command, parameter, issue);
+	}
+
+	static uint8_t PerDevice(Device device, uint8_t tfcard, uint8_t udisk, uint8_t flash)
+	{
+		switch(device)
+		{
+			case Device::TfCard: return tfcard;
+			case Device::UDisk: return udisk;
+			case Device::Flash: return flash;
+			default: return 0; /* rejected by the library */
+		}
+	}
+
+	Executor &executor_;
+	detail::OperationList pending_; /* sent and not yet completed, oldest first */
+	uint16_t answer_ = 0;           /* value of the most recent query response */
+};
+
+} /* namespace dfplayer */
+
+#endif /* _DFPLAYER_COROUTINE_HPP */
@@ -5,85 +5,425 @@
 #define _DFPLAYER_PRIVATE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "dfplayer.h"
 
-#define DFPLAYER_CMD_NEXT_TRACK          0x01
-#define DFPLAYER_CMD_PREVIOUS_TRACK      0x02
-#define DFPLAYER_CMD_SET_TRACK           0x03 /* 0-2999 */
-#define DFPLAYER_CMD_VOLUME_UP           0x04
-#define DFPLAYER_CMD_VOLUME_DOWN         0x05
-#define DFPLAYER_CMD_VOLUME_SET          0x06 /* 0-30 */
-#define DFPLAYER_CMD_SET_EQUALIZER       0x07
-#define DFPLAYER_CMD_SET_PLAYBACK_MODE   0x08
-#define DFPLAYER_CMD_SET_PLAYBACK_SOURCE 0x09
-#define DFPLAYER_CMD_POWER_MODE_STANDBY  0x0a
-#define DFPLAYER_CMD_POWER_MODE_NORMAL   0x0b
-#define DFPLAYER_CMD_RESET               0x0c
-#define DFPLAYER_CMD_PLAY                0x0d
-#define DFPLAYER_CMD_PAUSE               0x0e
-#define DFPLAYER_CMD_SET_FOLDER          0x0f /* 1-10 */
-#define DFPLAYER_CMD_VOLUME_ADJUST       0x10 /* 0-31 */
-#define DFPLAYER_CMD_REPEAT              0x11 /* 1=enable, 0=disable */
-#define DFPLAYER_CMD_DEVICE_PUSH_IN      0x3a
-#define DFPLAYER_CMD_DEVICE_PULL_OUT     0x3b
-#define DFPLAYER_CMD_UDISK_FINISH        0x3c
-#define DFPLAYER_CMD_TFCARD_FINISH       0x3d
-#define DFPLAYER_CMD_FLASH_FINISH        0x3e
-#define DFPLAYER_CMD_INITIALIZE          0x3f
-#define DFPLAYER_CMD_ERROR_REPORT        0x40
-#define DFPLAYER_CMD_REPLY               0x41
-#define DFPLAYER_CMD_QUERY_STATUS        0x42
-#define DFPLAYER_CMD_QUERY_VOLUME        0x43
-#define DFPLAYER_CMD_QUERY_EQUALIZER     0x44
-#define DFPLAYER_CMD_QUERY_PLAYBACK_MODE 0x45
-#define DFPLAYER_CMD_QUERY_VERSION       0x46
-#define DFPLAYER_CMD_QUERY_TFCARD_FILES  0x47
-#define DFPLAYER_CMD_QUERY_UDISK_FILES   0x48
-#define DFPLAYER_CMD_QUERY_FLASH_FILES   0x49
-#define DFPLAYER_CMD_QUERY_TFCARD_TRACK  0x4B
-#define DFPLAYER_CMD_QUERY_UDISK_TRACK   0x4C
-#define DFPLAYER_CMD_QUERY_FLASH_TRACK   0x4D
-
 #define DFPLAYER_MSG_START               0x7e
 #define DFPLAYER_MSG_END                 0xef
 #define DFPLAYER_MSG_VERSION             0xff
-#define DFPLAYER_MSG_LENGTH              10   /* bytes */
+#define DFPLAYER_MSG_LENGTH              DFPLAYER_FRAME_LENGTH
 #define DFPLAYER_MSG_PARAMETER_LENGTH    2    /* bytes */
 #define DFPLAYER_MSG_DATA_LENGTH         6    /* bytes */
 
-#define DFPLAYER_VOL_MIN                 0
-#define DFPLAYER_VOL_MAX                 30
+/* Checksum of a message; the negated sum of all bytes between the start byte and the checksum */
+#define DFPLAYER_CHECKSUM(command, feedback, parameter1, parameter2) \
+	((uint16_t) (0 - (DFPLAYER_MSG_VERSION + DFPLAYER_MSG_DATA_LENGTH + (command) + (feedback) \
+		+ (parameter1) + (parameter2))))
+
+/* Message for a command without parameters, requesting a reply */
+#define DFPLAYER_STATIC_FRAME(code) \
+	{ DFPLAYER_MSG_START, DFPLAYER_MSG_VERSION, DFPLAYER_MSG_DATA_LENGTH, (code), 1, 0, 0, \
+		DFPLAYER_CHECKSUM(code, 1, 0, 0) >> 8, DFPLAYER_CHECKSUM(code, 1, 0, 0) & 0xFF, DFPLAYER_MSG_END }
+
+typedef enum
+{
+	DFPLAYER_DECODER_NONE = 0,
+	DFPLAYER_DECODER_TRACK_FINISHED,
+	DFPLAYER_DECODER_INITIALIZE,
+	DFPLAYER_DECODER_DEVICE_STATE,
+	DFPLAYER_DECODER_ERROR,
+	DFPLAYER_DECODER_REPLY,
+	DFPLAYER_DECODER_STATUS,
+	DFPLAYER_DECODER_VOLUME,
+	DFPLAYER_DECODER_EQUALIZER,
+	DFPLAYER_DECODER_PLAYBACK_MODE,
+	DFPLAYER_DECODER_FILE_COUNT,
+	DFPLAYER_DECODER_CURRENT_TRACK,
+	DFPLAYER_DECODER_COUNT
+} dfplayerDecoder_e;
+
+/* Where a context's storage came from, so dfplayer_Deinitialize can give it back */
+typedef enum
+{
+	DFPLAYER_ALLOCATION_NONE = 0, /* an unused pool slot */
+	DFPLAYER_ALLOCATION_CALLER,   /* dfplayer_InitializeInPlace */
+	DFPLAYER_ALLOCATION_HEAP,
+	DFPLAYER_ALLOCATION_POOL
+} dfplayerAllocation_e;
+
+/* Build-time command groups; DFPLAYER_IF_<group>(a, b) selects a if the group is built, else b */
+#define DFPLAYER_IF_CONTROL(enabled, disabled) enabled
+#define DFPLAYER_IF_EVENT(enabled, disabled) enabled
+#if defined DFPLAYER_NO_QUERIES
+	#define DFPLAYER_IF_QUERY(enabled, disabled) disabled
+#else
+	#define DFPLAYER_IF_QUERY(enabled, disabled) enabled
+#endif
+#if defined DFPLAYER_NO_SETTINGS
+	#define DFPLAYER_IF_SETTINGS(enabled, disabled) disabled
+#else
+	#define DFPLAYER_IF_SETTINGS(enabled, disabled) enabled
+#endif
+
+typedef struct dfplayer_descriptor_s
+{
+	uint16_t parameter_max;
+	uint8_t decoder;  /* dfplayerDecoder_e */
+	uint8_t argument;
+	uint8_t priority; /* dfplayerPriority_e */
+} dfplayer_descriptor_t;
+
+/* Constant tables stay in flash on AVR, where const data is otherwise copied to RAM at startup;
+ * they're read with DFPLAYER_FLASH_BYTE and DFPLAYER_FLASH_READ */
+#if defined __AVR__
+	#include <avr/pgmspace.h>
+	#define DFPLAYER_FLASH PROGMEM
+	#define DFPLAYER_FLASH_BYTE(address) pgm_read_byte(address)
+	#define DFPLAYER_FLASH_READ(destination, source, size) memcpy_P((destination), (source), (size))
+#else
+	#define DFPLAYER_FLASH
+	#define DFPLAYER_FLASH_BYTE(address) (*(address))
+	#define DFPLAYER_FLASH_READ(destination, source, size) memcpy((destination), (source), (size))
+#endif
+
+#if !defined DFPLAYER_TX_QUEUE_LENGTH
+	#define DFPLAYER_TX_QUEUE_LENGTH     8    /* commands; 0 leaves out the transmit queue */
+#endif
+
+#if !defined DFPLAYER_TX_MAX_BYPASS
+	#define DFPLAYER_TX_MAX_BYPASS       4    /* times a queued query can be overtaken */
+#endif
+
+#if !defined DFPLAYER_SCHEDULE_LENGTH
+	#define DFPLAYER_SCHEDULE_LENGTH     4    /* scheduled commands per context */
+#endif
+
+#if !defined DFPLAYER_PLAYLIST_LENGTH
+	#define DFPLAYER_PLAYLIST_LENGTH     16   /* playlist entries per context, up to 255 */
+#endif
+#if DFPLAYER_PLAYLIST_LENGTH > 255
+	#error "DFPLAYER_PLAYLIST_LENGTH must be 255 or less"
+#endif
+
+#if !defined DFPLAYER_PLAYLIST_GUARD
+	#define DFPLAYER_PLAYLIST_GUARD      1000 /* time units a repeated track-finished message is ignored */
+#endif
+
+#if !defined DFPLAYER_TRACE_LENGTH
+	#define DFPLAYER_TRACE_LENGTH        64   /* frames, a power of two */
+#endif
+#if DFPLAYER_TRACE_LENGTH == 0 || (DFPLAYER_TRACE_LENGTH & (DFPLAYER_TRACE_LENGTH - 1)) != 0
+	#error "DFPLAYER_TRACE_LENGTH must be a power of two"
+#endif
+
+#if !defined DFPLAYER_TX_BATCH_LENGTH
+	#define DFPLAYER_TX_BATCH_LENGTH     8    /* messages; 0 leaves out batching */
+#endif
 
-#define DFPLAYER_FOLDER_MIN              0
-#define DFPLAYER_FOLDER_MAX              10
+#if !defined DFPLAYER_EVENT_QUEUE_LENGTH
+	#define DFPLAYER_EVENT_QUEUE_LENGTH  16   /* messages, a power of two up to 128 */
+#endif
+#if DFPLAYER_EVENT_QUEUE_LENGTH == 0 || DFPLAYER_EVENT_QUEUE_LENGTH > 128 \
+	|| (DFPLAYER_EVENT_QUEUE_LENGTH & (DFPLAYER_EVENT_QUEUE_LENGTH - 1)) != 0
+	#error "DFPLAYER_EVENT_QUEUE_LENGTH must be a power of two up to 128"
+#endif
 
-#define DFPLAYER_TRACK_MIN               0
-#define DFPLAYER_TRACK_MAX               2999
+#if !defined DFPLAYER_RX_RING_LENGTH
+	#define DFPLAYER_RX_RING_LENGTH      32   /* bytes, a power of two up to 128 */
+#endif
+#if DFPLAYER_RX_RING_LENGTH == 0 || DFPLAYER_RX_RING_LENGTH > 128 \
+	|| (DFPLAYER_RX_RING_LENGTH & (DFPLAYER_RX_RING_LENGTH - 1)) != 0
+	#error "DFPLAYER_RX_RING_LENGTH must be a power of two up to 128"
+#endif
+
+#if !defined DFPLAYER_SUBMIT_QUEUE_LENGTH
+	#define DFPLAYER_SUBMIT_QUEUE_LENGTH 16   /* commands, a power of two */
+#endif
+#if DFPLAYER_SUBMIT_QUEUE_LENGTH == 0 || (DFPLAYER_SUBMIT_QUEUE_LENGTH & (DFPLAYER_SUBMIT_QUEUE_LENGTH - 1)) != 0
+	#error "DFPLAYER_SUBMIT_QUEUE_LENGTH must be a power of two"
+#endif
+
+/* Index handoff between an interrupt handler (or another thread) and the main loop: the writer
+ * fills a slot before publishing the index, and the reader sees the slot once it sees the index.
+ * Indexes are uint8_t. GCC and Clang use their atomic builtins and other C11 compilers fences
+ * around volatile accesses. Without either, volatile accesses are only enough on a single core
+ * whose compiler keeps memory accesses in order around them; define these for such targets. */
+#if !defined DFPLAYER_LOAD_ACQUIRE
+	#if defined __GNUC__
+		#define DFPLAYER_LOAD_ACQUIRE(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+		#define DFPLAYER_STORE_RELEASE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#else
+		#if defined __STDC_VERSION__ && __STDC_VERSION__ >= 201112L && !defined __STDC_NO_ATOMICS__
+			#include <stdatomic.h>
+			#define DFPLAYER_ACQUIRE_FENCE()  atomic_thread_fence(memory_order_acquire)
+			#define DFPLAYER_RELEASE_FENCE()  atomic_thread_fence(memory_order_release)
+		#else
+			#define DFPLAYER_ACQUIRE_FENCE()
+			#define DFPLAYER_RELEASE_FENCE()
+		#endif
+
+		static inline uint8_t dfplayer_LoadAcquire(const volatile uint8_t *index)
+		{
+			uint8_t value = *index;
+			DFPLAYER_ACQUIRE_FENCE();
+			return value;
+		}
+
+		static inline void dfplayer_StoreRelease(volatile uint8_t *index, uint8_t value)
+		{
+			DFPLAYER_RELEASE_FENCE();
+			*index = value;
+		}
+
+		#define DFPLAYER_LOAD_ACQUIRE(p)      dfplayer_LoadAcquire(p)
+		#define DFPLAYER_STORE_RELEASE(p, v)  dfplayer_StoreRelease((p), (v))
+	#endif
+#endif
+
+/* Several threads adding to the submission queue claim its positions, which are uint32_t, with a
+ * compare-and-swap; on failure it loads the current value into *expected. GCC and Clang use their
+ * atomic builtins; for other compilers, define these along with DFPLAYER_LOAD_ACQUIRE and
+ * DFPLAYER_STORE_RELEASE for uint32_t. */
+#if defined DFPLAYER_SUBMIT_QUEUE && !defined DFPLAYER_COMPARE_EXCHANGE
+	#if defined __GNUC__
+		#define DFPLAYER_COMPARE_EXCHANGE(p, expected, desired) \
+			__atomic_compare_exchange_n((p), (expected), (desired), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+		#define DFPLAYER_FETCH_ADD(p, v)      ((void) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+	#else
+		#error "DFPLAYER_SUBMIT_QUEUE needs DFPLAYER_COMPARE_EXCHANGE and DFPLAYER_FETCH_ADD for this compiler"
+	#endif
+#endif
+
+#define DFPLAYER_CMD_IS_QUERY(c)         ((c) >= DFPLAYER_CMD_QUERY_STATUS)
+
+typedef struct dfplayer_command_s
+{
+	uint8_t command;
+	uint8_t parameter[DFPLAYER_MSG_PARAMETER_LENGTH];
+	uint8_t retries;
+	uint8_t priority;   /* dfplayerPriority_e */
+	uint8_t bypassed;   /* times overtaken by a more urgent command */
+	uint32_t queued;    /* time the command was queued */
+	uint32_t timestamp; /* time of the most recent transmission */
+} dfplayer_command_t;
+
+/* A received message waiting for dfplayer_DispatchEvents */
+typedef struct dfplayer_event_s
+{
+	uint8_t command;
+	uint8_t feedback;
+	uint16_t value;
+#if defined DFPLAYER_TRACE
+	uint32_t timestamp; /* when the message was received, for its trace entry */
+#endif
+} dfplayer_event_t;
+
+/* A command waiting to be sent at a given time, see dfplayer_ScheduleCommand */
+typedef struct dfplayer_schedule_s
+{
+	uint8_t command;
+	uint8_t parameter[DFPLAYER_MSG_PARAMETER_LENGTH];
+	bool active;
+	uint32_t due;
+	uint32_t period; /* 0 for a command sent once */
+} dfplayer_schedule_t;
+
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+/* Playlist, see dfplayer_PlaylistStart */
+typedef struct dfplayer_playlist_entry_s
+{
+	uint16_t track;
+	uint8_t device; /* DFPLAYER_DEVICE_ flag */
+	uint8_t folder;
+} dfplayer_playlist_entry_t;
+
+#define DFPLAYER_PLAYLIST_FOLDER_UNKNOWN 0xFF
+
+typedef struct dfplayer_playlist_s
+{
+	dfplayer_playlist_entry_t entries[DFPLAYER_PLAYLIST_LENGTH];
+	uint8_t order[DFPLAYER_PLAYLIST_LENGTH]; /* entries in the order they're played */
+	uint8_t count;
+	uint8_t position;      /* in order, of the entry playing */
+	bool running;
+	bool shuffle;
+	uint8_t repeat;        /* dfplayerPlaylistRepeat_e */
+
+	/* Source and folder the playlist last selected; 0 and DFPLAYER_PLAYLIST_FOLDER_UNKNOWN when
+	 * they have to be selected again */
+	uint8_t device;
+	uint8_t folder;
+
+	/* The track-finished message that last advanced the playlist, to tell a repeat of it */
+	uint8_t finished_device;
+	uint16_t finished_track;
+	uint32_t finished;
+
+	bool gap_pending;      /* advanced, and the next track hasn't been sent yet */
+	uint32_t gap_start;    /* timestamp of the track-finished message */
+	uint32_t random;       /* xorshift32 state for shuffling */
+} dfplayer_playlist_t;
+#endif /* DFPLAYER_PLAYLIST_LENGTH */
+
+/* A timer in a wheel's doubly-linked slot list. Each slot's list head is a timer of its own. */
+typedef struct dfplayer_timer_s
+{
+	struct dfplayer_timer_s *next; /* NULL while not in a wheel */
+	struct dfplayer_timer_s *prev;
+	uint32_t expires;
+} dfplayer_timer_t;
+
+/* Hierarchical timer wheel. A level 0 slot holds the timers expiring at one time unit, and each
+ * slot of the next level covers all the slots of the level below, so the wheel spans 2^24 time
+ * units. As time enters a slot's span, its timers are moved down to the level below; timers
+ * further out than the wheel spans wait in the last level and are placed again. */
+#define DFPLAYER_WHEEL_BITS    6  /* slots per level fit the bits of an occupancy mask */
+#define DFPLAYER_WHEEL_SLOTS   (1 << DFPLAYER_WHEEL_BITS)
+#define DFPLAYER_WHEEL_LEVELS  4
+
+/* Index of the lowest set bit of a non-zero occupancy mask */
+#if !defined DFPLAYER_LOWEST_BIT
+	#if defined __GNUC__
+		#define DFPLAYER_LOWEST_BIT(mask)  ((uint8_t) __builtin_ctzll(mask))
+	#else
+		static inline uint8_t dfplayer_LowestBit(uint64_t mask)
+		{
+			uint8_t bit = 0;
+
+			while((mask & 1) == 0)
+			{
+				mask >>= 1;
+				++bit;
+			}
+			return bit;
+		}
+
+		#define DFPLAYER_LOWEST_BIT(mask)  dfplayer_LowestBit(mask)
+	#endif
+#endif
+
+typedef struct dfplayer_wheel_s
+{
+	uint32_t now;   /* the latest time whose level 0 slot has been processed */
+	uint32_t count; /* timers in the wheel */
+	/* Bit n of a level's mask is set while slot n holds timers; in 32 bit words so the wheel
+	 * needs no more than pointer alignment */
+	uint32_t occupied[DFPLAYER_WHEEL_LEVELS][DFPLAYER_WHEEL_SLOTS / 32];
+	dfplayer_timer_t slots[DFPLAYER_WHEEL_LEVELS][DFPLAYER_WHEEL_SLOTS];
+} dfplayer_wheel_t;
+
+/* A command added by dfplayer_SubmitCommand. The slot is free for the command submitted at
+ * position n while its sequence is n, and holds that command once its sequence is n + 1. */
+typedef struct dfplayer_submission_s
+{
+	uint32_t sequence;
+	uint8_t command;
+	uint8_t parameter[DFPLAYER_MSG_PARAMETER_LENGTH];
+} dfplayer_submission_t;
 
 typedef struct dfplayer_context_s
 {
-	/* Receive message state information */
+	/* Receive message state information. This, the handlers and the receive counters at the
+	 * start of stats are what receiving touches, and are kept together at the front. */
 	uint8_t message_offset;
-	uint16_t expected_checksum;
-	uint16_t calculated_checksum;
 	uint8_t message_command;
 	uint8_t message_feedback;
 	uint8_t message_parameter[DFPLAYER_MSG_PARAMETER_LENGTH];
+	uint16_t expected_checksum;
+	uint16_t calculated_checksum;
+#if !defined DFPLAYER_NO_RESYNC
+	uint8_t message_buffer[DFPLAYER_MSG_LENGTH]; /* raw bytes of the message being received */
+#endif
 
-	/* User's message handler functions */
+	/* User's message handler functions, shared with other contexts */
+	const dfplayer_handlers_t *handlers;
 	void *token;
-	pfn_dfplayer_HandleInitialize pfnHandleInitialize;
-	pfn_dfplayer_HandleTrackFinished pfnHandleTrackFinished;
-	pfn_dfplayer_HandleDeviceState pfnHandleDeviceState;
-	pfn_dfplayer_HandleError pfnHandleError;
-	pfn_dfplayer_HandleReply pfnHandleReply;
+
+#if !defined DFPLAYER_NO_STATS
+	/* Protocol statistics; the outstanding command counts are filled in by dfplayer_GetStats */
+	dfplayer_stats_t stats;
+#endif
+
+#if !defined DFPLAYER_NO_RX_RING
+	/* Bytes pushed by the receive interrupt and not yet polled; the interrupt only advances
+	 * rx_head and dfplayer_Poll only advances rx_tail. Both count freely, modulo 256. */
+	uint8_t rx_ring[DFPLAYER_RX_RING_LENGTH];
+	uint8_t rx_head;
+	uint8_t rx_tail;
+#endif
+
+#if defined DFPLAYER_DEFERRED_EVENTS
+	/* Messages received but not yet dispatched; the receiving side only advances event_head and
+	 * the dispatching side only advances event_tail. Both count freely, modulo 256. */
+	dfplayer_event_t event_queue[DFPLAYER_EVENT_QUEUE_LENGTH];
+	uint8_t event_head;
+	uint8_t event_tail;
+#endif
+
+#if defined DFPLAYER_SUBMIT_QUEUE
+	/* Commands submitted from any thread; submitting threads claim positions by advancing
+	 * submit_head and only dfplayer_DrainCommands advances submit_tail. Both count freely. */
+	dfplayer_submission_t submit_queue[DFPLAYER_SUBMIT_QUEUE_LENGTH];
+	uint32_t submit_head;
+	uint32_t submit_tail;
+#endif
+
+	/* Sending a message right away, when pfnSendSerialBatch isn't set */
 	pfn_dfplayer_SendSerial pfnSendSerial;
-	pfn_dfplayer_HandleStatusResponse pfnHandleStatusResponse;
-	pfn_dfplayer_HandleVolumeResponse pfnHandleVolumeResponse;
-	pfn_dfplayer_HandleEqualizerResponse pfnHandleEqualizerResponse;
-	pfn_dfplayer_HandlePlaybackModeResponse pfnHandlePlaybackModeResponse;
-	pfn_dfplayer_HandleFileCountResponse pfnHandleFileCountResponse;
-	pfn_dfplayer_HandleCurrentTrackResponse pfnHandleCurrentTrackResponse;
+
+#if DFPLAYER_TX_QUEUE_LENGTH > 0
+	/* Transmit queue; the first tx_inflight entries after tx_head await an answer */
+	dfplayer_command_t tx_queue[DFPLAYER_TX_QUEUE_LENGTH];
+	uint8_t tx_head;
+	uint8_t tx_count;
+	uint8_t tx_inflight;
+	uint8_t tx_window;
+	uint8_t tx_retries;
+	uint32_t tx_timeout;
+	bool tx_coalesce;
+	bool tx_backoff;
+#endif
+	uint32_t now;
+
+	/* Timer wheel the context is ticked from, or NULL if the application ticks it; the timer
+	 * expires at the earliest retransmission, timeout or scheduled command */
+	dfplayer_wheel_t *wheel;
+	dfplayer_timer_t timer;
+
+#if DFPLAYER_SCHEDULE_LENGTH > 0
+	dfplayer_schedule_t schedule[DFPLAYER_SCHEDULE_LENGTH];
+#endif
+
+#if DFPLAYER_PLAYLIST_LENGTH > 0
+	dfplayer_playlist_t playlist;
+#endif
+
+	/* Optional clock for trace entries and playlist gaps */
+	pfn_dfplayer_GetTimestamp pfnTraceTimestamp;
+
+#if DFPLAYER_TX_BATCH_LENGTH > 0
+	/* Messages waiting for dfplayer_Flush */
+	pfn_dfplayer_SendSerialBatch pfnSendSerialBatch;
+	uint8_t tx_batch[DFPLAYER_TX_BATCH_LENGTH][DFPLAYER_MSG_LENGTH];
+	uint8_t tx_batch_count;
+#endif
+
+	/* Shadow copy of the device state */
+	dfplayer_state_t state;
+	uint32_t state_updated[DFPLAYER_CACHE_FIELDS]; /* indexed by DFPLAYER_CACHE_ flag bit */
+
+	uint8_t allocation; /* dfplayerAllocation_e */
+
+#if !defined DFPLAYER_NO_LEGACY_HANDLERS
+	/* Handlers from the deprecated dfplayer_init_info_t members, when no table was given */
+	dfplayer_handlers_t legacy_handlers;
+#endif
+
+#if defined DFPLAYER_TRACE
+	/* Frame trace; entry n is at trace[n % DFPLAYER_TRACE_LENGTH] */
+	uint32_t trace_count; /* entries ever recorded */
+	dfplayer_trace_entry_t trace[DFPLAYER_TRACE_LENGTH];
+#endif
 } dfplayer_context_t;
 
 #endif /* _DFPLAYER_PRIVATE_H */
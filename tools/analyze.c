@@ -0,0 +1,630 @@
+/* \file analyze.c
+ * \brief Summarizes large serial logs: messages per command, error reports and timing
+ *
+ * Files are either raw received bytes, as logged straight from a UART, or captures (see
+ * dfplayer_capture.h), whose timestamps add the time between messages of each command. Files are
+ * mapped rather than read, and split across threads by byte range; captures are split at record
+ * boundaries, and each thread walks its records in place. Threads find start bytes with memchr(),
+ * which the C library vectorizes, and check the candidates in place. Only the few bytes of a
+ * message split between chunks are copied.
+ *
+ * A message is counted wherever ten bytes form a valid one. A start byte that doesn't begin a
+ * valid message and isn't inside one counts as a header or checksum error. Unlike the library's
+ * parser, this needs no state carried from byte to byte, so any range can be analyzed on its own.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dfplayer_private.h"
+#include "dfplayer.h"
+#include "dfplayer_capture.h"
+
+#define ANALYZE_MAX_THREADS    64
+#define ANALYZE_DIRECTIONS     2  /* DFPLAYER_CAPTURE_RX, DFPLAYER_CAPTURE_TX */
+#define ANALYZE_GAP_BUCKETS    20 /* below 1 ms, then one per power of two milliseconds */
+
+typedef struct analyze_command_s
+{
+	uint64_t messages;
+	uint64_t first, last;  /* time of the first and last message */
+	uint64_t gaps;         /* times between consecutive messages */
+	uint64_t gap_total, gap_min, gap_max;
+	uint64_t histogram[ANALYZE_GAP_BUCKETS];
+} analyze_command_t;
+
+typedef struct analyze_counts_s
+{
+	uint64_t bytes;
+	uint64_t header_errors;
+	uint64_t checksum_errors;
+	uint64_t errors[DFPLAYER_ERROR_COUNT + 1]; /* error reports by code, the last for unknown codes */
+	analyze_command_t commands[256];
+} analyze_counts_t;
+
+/* One direction's messages, checked chunk by chunk */
+typedef struct analyze_scan_s
+{
+	uint8_t held[DFPLAYER_FRAME_LENGTH - 1]; /* from the next start byte to check, until its message is complete */
+	size_t length;  /* bytes held */
+	size_t from;    /* held start bytes before from precede the thread's share, and are only context */
+	size_t to;      /* held start bytes from to on follow the thread's share */
+	size_t skip;    /* bytes of the next chunk inside the last message, when nothing is held */
+	bool timed;
+	analyze_counts_t counts;
+} analyze_scan_t;
+
+/* Where a thread's share begins, and what it needs to know of the data before it */
+typedef struct analyze_start_s
+{
+	size_t offset;
+	uint64_t time;      /* timestamp units, unwrapped, of the preceding capture record */
+	uint32_t previous;  /* timestamp of the preceding capture record */
+	uint8_t context[ANALYZE_DIRECTIONS][DFPLAYER_FRAME_LENGTH - 1]; /* last bytes of each direction */
+	uint8_t context_length[ANALYZE_DIRECTIONS];
+} analyze_start_t;
+
+typedef struct analyze_job_s
+{
+	pthread_t thread;
+	const uint8_t *data;                /* raw bytes, or NULL for a capture */
+	const dfplayer_capture_t *capture;
+	size_t size;                        /* of the raw bytes or the capture's records */
+	analyze_start_t start;
+	size_t end;                         /* where the next thread's share begins */
+	analyze_scan_t scans[ANALYZE_DIRECTIONS];
+} analyze_job_t;
+
+#define ANALYZE_COMMAND_NAME(name, code, group, priority, parameter_max, decoder, argument) [code] = #name,
+static const char * const analyze_command_names[DFPLAYER_CMD_COUNT] =
+{
+	DFPLAYER_COMMANDS(ANALYZE_COMMAND_NAME)
+};
+#undef ANALYZE_COMMAND_NAME
+
+static const char * const analyze_error_names[DFPLAYER_ERROR_COUNT + 1] =
+{
+	"BUSY", "FRAME_DATA_NOT_RECEIVED", "VERIFICATION_ERROR", "unknown"
+};
+
+static int Analyze(const char *path, uint32_t threads);
+static void Analyze_SplitRaw(const uint8_t *data, size_t size, uint32_t threads, analyze_job_t *jobs);
+static void Analyze_SplitCapture(const dfplayer_capture_t *capture, uint32_t threads, analyze_job_t *jobs);
+static void Analyze_Remember(uint8_t *context, uint8_t *length, const uint8_t *data, size_t bytes);
+static void *Analyze_Thread(void *argument);
+static void Analyze_Records(analyze_job_t *job);
+static void Analyze_Feed(analyze_scan_t *scan, const uint8_t *data, size_t length, uint64_t time, bool own);
+static size_t Analyze_Scan(analyze_scan_t *scan, const uint8_t *data, size_t position, size_t end, uint64_t time,
+	bool counted);
+static void Analyze_AddGap(analyze_command_t *command, uint64_t gap);
+static void Analyze_Merge(analyze_counts_t *total, const analyze_counts_t *counts);
+static void Analyze_Print(const char *direction, const analyze_counts_t *counts, bool timed);
+static double GetTimeSeconds(void);
+
+int main(int argc, char *argv[])
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t threads = (cores > 0) ? (uint32_t) cores : 1;
+	int result = 0;
+	int option;
+	int idx;
+
+	while((option = getopt(argc, argv, "t:")) != -1)
+	{
+		switch(option)
+		{
+			case 't': threads = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "%s [-t threads] file [file...]\n"
+					"Files are raw received bytes or dfplayer captures\n", argv[0]);
+				return -1;
+		}
+	}
+
+	if(threads < 1)
+		threads = 1;
+	if(threads > ANALYZE_MAX_THREADS)
+		threads = ANALYZE_MAX_THREADS;
+	if(optind >= argc)
+	{
+		fprintf(stderr, "No files given\n");
+		return -1;
+	}
+
+	for(idx = optind; idx < argc; ++idx)
+	{
+		if(Analyze(argv[idx], threads) != 0)
+			result = -1;
+	}
+
+	return result;
+}
+
+static int Analyze(const char *path, uint32_t threads)
+{
+	static analyze_job_t jobs[ANALYZE_MAX_THREADS];
+	dfplayer_capture_t records;
+	analyze_counts_t *totals;
+	struct stat info;
+	const uint8_t *map;
+	bool capture = false;
+	double start, elapsed;
+	uint32_t idx;
+	int direction;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &info) != 0)
+	{
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if(0 == info.st_size)
+	{
+		printf("%s: empty\n", path);
+		close(fd);
+		return 0;
+	}
+
+	map = (const uint8_t *) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(MAP_FAILED == map)
+	{
+		fprintf(stderr, "Failed to map '%s'\n", path);
+		return -1;
+	}
+	posix_madvise((void *) map, info.st_size, POSIX_MADV_SEQUENTIAL);
+
+	totals = (analyze_counts_t *) calloc(ANALYZE_DIRECTIONS, sizeof(analyze_counts_t));
+	if(NULL == totals)
+	{
+		fprintf(stderr, "Out of memory\n");
+		munmap((void *) map, info.st_size);
+		return -1;
+	}
+
+	/* Small files aren't worth splitting */
+	start = GetTimeSeconds();
+	if(info.st_size < (off_t) threads * 65536)
+		threads = 1;
+	if(info.st_size >= (off_t) sizeof(dfplayer_capture_file_t)
+	&& ((const dfplayer_capture_file_t *) map)->magic == DFPLAYER_CAPTURE_MAGIC)
+	{
+		capture = true;
+		memcpy(&records.header, map, sizeof(records.header));
+		if(records.header.version != DFPLAYER_CAPTURE_VERSION)
+		{
+			fprintf(stderr, "'%s' is an unsupported capture\n", path);
+			free(totals);
+			munmap((void *) map, info.st_size);
+			return -1;
+		}
+		records.data = (uint8_t *) map + sizeof(records.header);
+		records.length = info.st_size - sizeof(records.header);
+		Analyze_SplitCapture(&records, threads, jobs);
+	}
+	else
+		Analyze_SplitRaw(map, info.st_size, threads, jobs);
+
+	for(idx = 0; idx < threads; ++idx)
+	{
+		if(pthread_create(&jobs[idx].thread, NULL, Analyze_Thread, &jobs[idx]) != 0)
+		{
+			fprintf(stderr, "Failed to start a thread\n");
+			exit(-1);
+		}
+	}
+
+	/* Threads' results are merged in file order, so times between messages carry across */
+	for(idx = 0; idx < threads; ++idx)
+	{
+		pthread_join(jobs[idx].thread, NULL);
+		for(direction = 0; direction < ANALYZE_DIRECTIONS; ++direction)
+			Analyze_Merge(&totals[direction], &jobs[idx].scans[direction].counts);
+	}
+	elapsed = GetTimeSeconds() - start;
+
+	printf("%s: %s, %llu bytes, %u threads, %.3f s (%.0f MB/s)\n", path, (capture) ? "capture" : "raw",
+		(unsigned long long) info.st_size, threads, elapsed, info.st_size / elapsed / 1e6);
+	Analyze_Print("RX", &totals[DFPLAYER_CAPTURE_RX], capture);
+	if(capture)
+		Analyze_Print("TX", &totals[DFPLAYER_CAPTURE_TX], capture);
+
+	free(totals);
+	munmap((void *) map, info.st_size);
+	return 0;
+}
+
+/* Splits raw bytes into equal shares */
+static void Analyze_SplitRaw(const uint8_t *data, size_t size, uint32_t threads, analyze_job_t *jobs)
+{
+	uint32_t idx;
+
+	for(idx = 0; idx < threads; ++idx)
+	{
+		analyze_job_t *job = &jobs[idx];
+		size_t before;
+
+		memset(&job->start, 0, sizeof(job->start));
+		job->data = data;
+		job->capture = NULL;
+		job->size = size;
+		job->start.offset = size / threads * idx;
+		job->end = (idx + 1 == threads) ? size : size / threads * (idx + 1);
+
+		before = (job->start.offset < DFPLAYER_FRAME_LENGTH - 1) ? job->start.offset : DFPLAYER_FRAME_LENGTH - 1;
+		memcpy(job->start.context[DFPLAYER_CAPTURE_RX], &data[job->start.offset - before], before);
+		job->start.context_length[DFPLAYER_CAPTURE_RX] = before;
+	}
+}
+
+/* Splits a capture into shares of about equal size, each starting at the first record at or
+ * after its share of the bytes. Records carry no marker to find them by from an arbitrary offset,
+ * so their headers are walked once here, along with the time. Apart from the last few bytes of
+ * each direction, which the next share needs as context, the data is left to the threads. */
+static void Analyze_SplitCapture(const dfplayer_capture_t *capture, uint32_t threads, analyze_job_t *jobs)
+{
+	dfplayer_capture_record_t record;
+	analyze_start_t start;
+	const uint8_t *data;
+	size_t offset = 0;
+	size_t next = 0;
+	uint32_t idx = 0;
+
+	memset(&start, 0, sizeof(start));
+	if(dfplayer_CaptureNext(capture, &next, &record, &data) == 0)
+		start.previous = record.timestamp; /* the first record is at time 0 */
+
+	for(next = 0; idx < threads && dfplayer_CaptureNext(capture, &next, &record, &data) == 0; offset = next)
+	{
+		for(; idx < threads && offset >= capture->length / threads * idx; ++idx)
+		{
+			jobs[idx].start = start;
+			jobs[idx].start.offset = offset;
+		}
+
+		start.time += (uint32_t) (record.timestamp - start.previous);
+		start.previous = record.timestamp;
+		if(DFPLAYER_CAPTURE_RX == record.type || DFPLAYER_CAPTURE_TX == record.type)
+			Analyze_Remember(start.context[record.type], &start.context_length[record.type], data, record.length);
+	}
+	for(; idx < threads; ++idx)
+	{
+		jobs[idx].start = start;
+		jobs[idx].start.offset = offset; /* nothing left to share */
+	}
+
+	for(idx = 0; idx < threads; ++idx)
+	{
+		jobs[idx].data = NULL;
+		jobs[idx].capture = capture;
+		jobs[idx].size = capture->length;
+		jobs[idx].end = (idx + 1 == threads) ? capture->length : jobs[idx + 1].start.offset;
+	}
+}
+
+/* Keeps the last DFPLAYER_FRAME_LENGTH - 1 bytes of a direction */
+static void Analyze_Remember(uint8_t *context, uint8_t *length, const uint8_t *data, size_t bytes)
+{
+	size_t kept;
+
+	if(bytes >= DFPLAYER_FRAME_LENGTH - 1)
+	{
+		memcpy(context, &data[bytes - (DFPLAYER_FRAME_LENGTH - 1)], DFPLAYER_FRAME_LENGTH - 1);
+		*length = DFPLAYER_FRAME_LENGTH - 1;
+		return;
+	}
+
+	kept = (*length < DFPLAYER_FRAME_LENGTH - 1 - bytes) ? *length : DFPLAYER_FRAME_LENGTH - 1 - bytes;
+	memmove(context, &context[*length - kept], kept);
+	memcpy(&context[kept], data, bytes);
+	*length = kept + bytes;
+}
+
+/* Analyzes one share. The context before it only tells where a message running into the share
+ * ends; bytes after it are only read to complete messages starting inside it. */
+static void *Analyze_Thread(void *argument)
+{
+	analyze_job_t *job = (analyze_job_t *) argument;
+	int direction;
+
+	for(direction = 0; direction < ANALYZE_DIRECTIONS; ++direction)
+	{
+		analyze_scan_t *scan = &job->scans[direction];
+
+		memset(scan, 0, sizeof(*scan));
+		memcpy(scan->held, job->start.context[direction], job->start.context_length[direction]);
+		scan->length = scan->from = scan->to = job->start.context_length[direction];
+		scan->timed = (job->capture != NULL);
+	}
+
+	if(job->capture != NULL)
+		Analyze_Records(job);
+	else
+	{
+		size_t after = job->size - job->end;
+
+		Analyze_Feed(&job->scans[DFPLAYER_CAPTURE_RX], &job->data[job->start.offset], job->end - job->start.offset, 0, true);
+		Analyze_Feed(&job->scans[DFPLAYER_CAPTURE_RX], &job->data[job->end],
+			(after < DFPLAYER_FRAME_LENGTH - 1) ? after : DFPLAYER_FRAME_LENGTH - 1, 0, false);
+	}
+
+	return NULL;
+}
+
+/* Walks a share's capture records in place, and those after it until no message is left open */
+static void Analyze_Records(analyze_job_t *job)
+{
+	const dfplayer_capture_t *capture = job->capture;
+	dfplayer_capture_record_t record;
+	const uint8_t *data;
+	uint64_t time = job->start.time;
+	uint32_t previous = job->start.previous;
+	size_t offset = job->start.offset;
+	size_t next = offset;
+
+	for(; dfplayer_CaptureNext(capture, &next, &record, &data) == 0; offset = next)
+	{
+		bool own = (offset < job->end);
+
+		if(!own && job->scans[DFPLAYER_CAPTURE_RX].to <= job->scans[DFPLAYER_CAPTURE_RX].from
+		&& job->scans[DFPLAYER_CAPTURE_TX].to <= job->scans[DFPLAYER_CAPTURE_TX].from)
+		{
+			break;
+		}
+
+		time += (uint32_t) (record.timestamp - previous);
+		previous = record.timestamp;
+		if(DFPLAYER_CAPTURE_RX == record.type || DFPLAYER_CAPTURE_TX == record.type)
+			Analyze_Feed(&job->scans[record.type], data, record.length, time * capture->header.resolution, own);
+	}
+}
+
+/* Checks the start bytes of a chunk logged at time, after those held from earlier chunks. Chunks
+ * that aren't the thread's own (own false) only complete held messages. A message is logged when
+ * its last byte arrives, so held start bytes take the time of the chunk that completes them. */
+static void Analyze_Feed(analyze_scan_t *scan, const uint8_t *data, size_t length, uint64_t time, bool own)
+{
+	uint8_t window[2 * (DFPLAYER_FRAME_LENGTH - 1)];
+	size_t position = scan->skip;
+	size_t end;
+
+	if(own)
+	{
+		scan->counts.bytes += length;
+		scan->to = scan->length;
+	}
+
+	if(scan->length > 0)
+	{
+		size_t joined = (length < DFPLAYER_FRAME_LENGTH - 1) ? length : DFPLAYER_FRAME_LENGTH - 1;
+
+		memcpy(window, scan->held, scan->length);
+		memcpy(&window[scan->length], data, joined);
+		joined += scan->length;
+		end = (joined >= DFPLAYER_FRAME_LENGTH) ? joined - DFPLAYER_FRAME_LENGTH + 1 : 0;
+		if(end > scan->to)
+			end = scan->to;
+
+		position = Analyze_Scan(scan, window, 0, (scan->from < end) ? scan->from : end, time, false);
+		position = Analyze_Scan(scan, window, position, end, time, true);
+		if(position < scan->to)
+		{
+			/* Still not complete; the chunk is short enough to be held as well */
+			memmove(scan->held, &window[position], joined - position);
+			scan->from = (scan->from > position) ? scan->from - position : 0;
+			scan->to = ((own) ? joined : scan->to) - position;
+			scan->length = joined - position;
+			return;
+		}
+		position -= scan->length;
+		scan->length = scan->from = scan->to = 0;
+	}
+	if(!own)
+		return;
+
+	end = (length >= DFPLAYER_FRAME_LENGTH) ? length - DFPLAYER_FRAME_LENGTH + 1 : 0;
+	position = Analyze_Scan(scan, data, position, end, time, true);
+	if(position >= length)
+		scan->skip = position - length;
+	else
+	{
+		scan->skip = 0;
+		scan->length = scan->to = length - position;
+		memcpy(scan->held, &data[position], scan->length);
+	}
+}
+
+static inline bool Analyze_IsMessage(const uint8_t *data)
+{
+	return data[1] == DFPLAYER_MSG_VERSION && data[2] == DFPLAYER_MSG_DATA_LENGTH && data[9] == DFPLAYER_MSG_END
+		&& (((uint16_t) data[7] << 8) | data[8]) == DFPLAYER_CHECKSUM(data[3], data[4], data[5], data[6]);
+}
+
+/* Checks the start bytes in [position, end), each followed by at least a message's worth of data,
+ * and returns where checking continues, past end if a message runs beyond it. Unless counted,
+ * messages are only skipped over. */
+static size_t Analyze_Scan(analyze_scan_t *scan, const uint8_t *data, size_t position, size_t end, uint64_t time,
+	bool counted)
+{
+	analyze_counts_t *counts = &scan->counts;
+
+	while(position < end)
+	{
+		const uint8_t *found = (const uint8_t *) memchr(&data[position], DFPLAYER_MSG_START, end - position);
+
+		if(NULL == found)
+			return end;
+		position = found - data;
+
+		if(!Analyze_IsMessage(found))
+		{
+			if(counted && found[1] == DFPLAYER_MSG_VERSION && found[2] == DFPLAYER_MSG_DATA_LENGTH
+			&& found[9] == DFPLAYER_MSG_END)
+			{
+				++(counts->checksum_errors);
+			}
+			else if(counted)
+				++(counts->header_errors);
+			++position;
+			continue;
+		}
+
+		if(counted)
+		{
+			analyze_command_t *command = &counts->commands[found[3]];
+
+			if(DFPLAYER_CMD_ERROR_REPORT == found[3])
+				++(counts->errors[(found[6] < DFPLAYER_ERROR_COUNT) ? found[6] : DFPLAYER_ERROR_COUNT]);
+			if(scan->timed)
+			{
+				if(command->messages > 0)
+					Analyze_AddGap(command, time - command->last);
+				else
+					command->first = time;
+				command->last = time;
+			}
+			++(command->messages);
+		}
+		position += DFPLAYER_FRAME_LENGTH;
+	}
+
+	return position;
+}
+
+static void Analyze_AddGap(analyze_command_t *command, uint64_t gap)
+{
+	uint64_t milliseconds = gap / 1000;
+	int bucket = 0;
+
+	while(milliseconds > 0 && bucket < ANALYZE_GAP_BUCKETS - 1)
+	{
+		milliseconds >>= 1;
+		++bucket;
+	}
+	++(command->histogram[bucket]);
+
+	if(0 == command->gaps || gap < command->gap_min)
+		command->gap_min = gap;
+	if(gap > command->gap_max)
+		command->gap_max = gap;
+	command->gap_total += gap;
+	++(command->gaps);
+}
+
+/* Adds the counts of the range following the ones already in total */
+static void Analyze_Merge(analyze_counts_t *total, const analyze_counts_t *counts)
+{
+	int code;
+	int idx;
+
+	total->bytes += counts->bytes;
+	total->header_errors += counts->header_errors;
+	total->checksum_errors += counts->checksum_errors;
+	for(idx = 0; idx <= DFPLAYER_ERROR_COUNT; ++idx)
+		total->errors[idx] += counts->errors[idx];
+
+	for(code = 0; code < 256; ++code)
+	{
+		analyze_command_t *into = &total->commands[code];
+		const analyze_command_t *from = &counts->commands[code];
+
+		if(0 == from->messages)
+			continue;
+
+		if(into->messages > 0)
+			Analyze_AddGap(into, from->first - into->last);
+		else
+			into->first = from->first;
+		into->last = from->last;
+		into->messages += from->messages;
+
+		if(from->gaps > 0)
+		{
+			if(0 == into->gaps || from->gap_min < into->gap_min)
+				into->gap_min = from->gap_min;
+			if(from->gap_max > into->gap_max)
+				into->gap_max = from->gap_max;
+			into->gap_total += from->gap_total;
+			into->gaps += from->gaps;
+			for(idx = 0; idx < ANALYZE_GAP_BUCKETS; ++idx)
+				into->histogram[idx] += from->histogram[idx];
+		}
+	}
+}
+
+static void Analyze_Print(const char *direction, const analyze_counts_t *counts, bool timed)
+{
+	uint64_t messages = 0;
+	int code;
+	int idx;
+
+	for(code = 0; code < 256; ++code)
+		messages += counts->commands[code].messages;
+
+	printf("%s: %llu bytes, %llu messages, %llu bytes outside messages, %llu header errors, %llu checksum errors\n",
+		direction, (unsigned long long) counts->bytes, (unsigned long long) messages,
+		(unsigned long long) (counts->bytes - messages * DFPLAYER_FRAME_LENGTH),
+		(unsigned long long) counts->header_errors, (unsigned long long) counts->checksum_errors);
+
+	for(idx = 0; idx <= DFPLAYER_ERROR_COUNT; ++idx)
+	{
+		if(counts->errors[idx] > 0)
+		{
+			printf("  error report %-24s %10llu (%.3f per 1000 messages)\n", analyze_error_names[idx],
+				(unsigned long long) counts->errors[idx], counts->errors[idx] * 1000.0 / messages);
+		}
+	}
+
+	if(messages > 0)
+	{
+		printf("  %-20s %10s %7s", "command", "messages", "share");
+		if(timed)
+			printf(" %12s %12s %12s  gaps per bucket: <1 ms, <2, <4, <8 ... ms", "gap mean ms", "min ms", "max ms");
+		printf("\n");
+	}
+
+	for(code = 0; code < 256; ++code)
+	{
+		const analyze_command_t *command = &counts->commands[code];
+		const char *name = (code < DFPLAYER_CMD_COUNT) ? analyze_command_names[code] : NULL;
+		int used = ANALYZE_GAP_BUCKETS;
+
+		if(0 == command->messages)
+			continue;
+
+		if(name != NULL)
+			printf("  %-20s", name);
+		else
+			printf("  0x%02x%16s", code, "");
+		printf(" %10llu %6.2f%%", (unsigned long long) command->messages, command->messages * 100.0 / messages);
+
+		if(timed && command->gaps > 0)
+		{
+			printf(" %12.3f %12.3f %12.3f ", command->gap_total / 1000.0 / command->gaps, command->gap_min / 1000.0,
+				command->gap_max / 1000.0);
+			while(used > 1 && 0 == command->histogram[used - 1])
+				--used;
+			for(idx = 0; idx < used; ++idx)
+				printf(" %llu", (unsigned long long) command->histogram[idx]);
+		}
+		printf("\n");
+	}
+}
+
+static double GetTimeSeconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,107 @@
+/* \file async.cpp
+ * \brief Queries the emulator from coroutines, through dfplayer::AsyncPlayer
+ *
+ * A few coroutines await commands and queries concurrently while the loop below moves the
+ * emulator's virtual clock, ticks the player and runs the executor. Builds as C++20, which the
+ * coroutine interface needs.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "dfplayer_coroutine.hpp"
+#include "dfplayer_emulator.h"
+
+class Speaker : public dfplayer::AsyncPlayer<Speaker>
+{
+public:
+	explicit Speaker(dfplayer::Executor &executor) : AsyncPlayer(executor) {}
+
+	int Send(const uint8_t *data, uint32_t bytes)
+	{
+		dfplayer_EmulatorReceive(emulator, data, bytes);
+		return 0;
+	}
+
+	dfplayer_emulator_t *emulator = nullptr;
+	uint32_t running = 0;
+	uint32_t failed = 0;
+};
+
+static int Async_Transmit(void *token, const uint8_t *data, uint32_t bytes)
+{
+	static_cast<Speaker *>(token)->Receive(data, bytes);
+	return 0;
+}
+
+/* Sets a volume and reads it back, along with the file count. Workers share the device, so the
+ * volume read may be another worker's. */
+static dfplayer::Task Async_Worker(Speaker &speaker, uint32_t id, uint32_t rounds)
+{
+	++(speaker.running);
+	for(uint32_t round = 0; round < rounds; ++round)
+	{
+		auto set = co_await speaker.SetVolume(static_cast<uint8_t>((id * 7 + round) % (DFPLAYER_VOL_MAX + 1)));
+		auto volume = co_await speaker.QueryVolume();
+		auto files = co_await speaker.QueryFileCount(dfplayer::Device::TfCard);
+
+		if(!set || !volume || !files)
+			++(speaker.failed);
+		else
+			printf("worker %u: volume %u, %u files\n", id, volume.value, files.value);
+	}
+	--(speaker.running);
+}
+
+int main(int argc, char *argv[])
+{
+	dfplayer_emulator_config_t config = dfplayer_emulator_config_t();
+	dfplayer::Executor executor;
+	Speaker speaker(executor);
+	uint32_t workers = 3;
+	uint32_t rounds = 2;
+	uint64_t now = 0;
+	int option;
+
+	while((option = getopt(argc, argv, "w:r:")) != -1)
+	{
+		switch(option)
+		{
+			case 'w': workers = strtoul(optarg, NULL, 0); break;
+			case 'r': rounds = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "%s [-w workers] [-r rounds]\n", argv[0]);
+				return -1;
+		}
+	}
+
+	config.pfnTransmit = Async_Transmit;
+	config.token = &speaker;
+	config.baud = 9600;
+	config.latency = 20000;
+	config.jitter = 10000;
+	config.devices_online = DFPLAYER_DEVICE_TFCARD;
+	config.file_count = 100;
+	speaker.emulator = dfplayer_EmulatorCreate(&config, now);
+	if(NULL == speaker.emulator || !speaker.Initialize(dfplayer::Settings{ 4, 2, 200, true, false, nullptr }))
+	{
+		fprintf(stderr, "Failed to start\n");
+		return -1;
+	}
+
+	for(uint32_t id = 0; id < workers; ++id)
+		Async_Worker(speaker, id, rounds);
+	while(speaker.running > 0 && now < 3600000000ull)
+	{
+		uint64_t next = dfplayer_EmulatorNextEvent(speaker.emulator);
+		uint64_t tick = (now / 10000 + 1) * 10000; /* Tick every 10 ms */
+
+		now = (next < tick) ? next : tick;
+		dfplayer_EmulatorAdvance(speaker.emulator, now);
+		speaker.Tick(static_cast<uint32_t>(now / 1000));
+		executor.Run();
+	}
+
+	printf("%u workers done in %.3f s, %u rounds failed\n", workers - speaker.running, now / 1e6, speaker.failed);
+	dfplayer_EmulatorDestroy(speaker.emulator);
+	return (0 == speaker.running && 0 == speaker.failed) ? 0 : -1;
+}
@@ -0,0 +1,867 @@
+/* \file benchmark.c
+ * \brief Measures the dfplayer library's parser, encoder, command latency, priorities and memory use
+ *
+ * Results are written as JSON so they can be compared from release to release. Command latency
+ * is measured against the emulator on a virtual clock, so it reflects the protocol (wire time,
+ * device latency, retransmissions) rather than the speed of the machine running the benchmark.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include "dfplayer_private.h"
+#include "dfplayer.h"
+#include "dfplayer_emulator.h"
+
+#define BENCHMARK_ROUND_TRIP_COMMANDS  7
+
+typedef struct benchmark_options_s
+{
+	uint32_t frames;       /* frames per parser and encoder run */
+	uint32_t round_trips;  /* commands per round-trip run */
+	uint32_t noise_rate;   /* parser noise and bit errors, per million frames */
+	uint32_t contexts;     /* contexts serviced together by the many-contexts parser run */
+	uint32_t seed;
+	dfplayer_emulator_config_t emulator;
+} benchmark_options_t;
+
+/* State shared with the library's and emulator's callbacks */
+typedef struct benchmark_link_s
+{
+	void *dfplayer;
+	dfplayer_emulator_t *emulator;
+	uint64_t now;          /* virtual clock, microseconds */
+	uint32_t wire_time;    /* microseconds per transmitted message */
+	uint8_t pending[DFPLAYER_TX_BATCH_LENGTH * DFPLAYER_FRAME_LENGTH]; /* host output on the wire */
+	uint32_t pending_length;
+	uint64_t pending_due;
+	uint32_t decoded;      /* messages handed to a handler */
+	uint8_t awaited;       /* command whose completion sets complete, 0 for any */
+	bool complete;
+	dfplayerCommandResult_e result;
+} benchmark_link_t;
+
+typedef struct benchmark_samples_s
+{
+	uint8_t command;
+	uint32_t count;
+	uint32_t failures;
+	uint32_t *latency;
+} benchmark_samples_t;
+
+#define BENCHMARK_COMMAND_NAME(name, code, group, priority, parameter_max, decoder, argument) [code] = #name,
+static const char * const benchmark_command_names[DFPLAYER_CMD_COUNT] =
+{
+	DFPLAYER_COMMANDS(BENCHMARK_COMMAND_NAME)
+};
+#undef BENCHMARK_COMMAND_NAME
+
+static void Benchmark_Parser(benchmark_options_t *options, bool noisy, bool buffered);
+static void Benchmark_Contexts(benchmark_options_t *options);
+static void Benchmark_Resync(benchmark_options_t *options);
+static void Benchmark_Encoder(benchmark_options_t *options);
+static void Benchmark_RoundTrip(benchmark_options_t *options);
+static void Benchmark_Priority(benchmark_options_t *options);
+static void Benchmark_Wheel(benchmark_options_t *options);
+static void Benchmark_Playlist(benchmark_options_t *options);
+static void Benchmark_Step(benchmark_link_t *link);
+static void Benchmark_Memory(void);
+static void Benchmark_DeviceFrame(uint8_t *data, uint8_t command, uint16_t value);
+static int Benchmark_IssueCommand(void *dfplayer, uint8_t command, uint32_t iteration);
+static void Benchmark_PrintSamples(benchmark_samples_t *samples, bool last);
+static void *Benchmark_CreateContext(benchmark_link_t *link, uint8_t tx_window);
+static void *Benchmark_CreateContextInPlace(benchmark_link_t *link, void *storage);
+static uint32_t Benchmark_Timestamp(void *context, void *token);
+static int Benchmark_SendSerial(void *context, void *token, uint8_t *data, uint32_t bytes);
+static int Benchmark_SendSerialBatch(void *context, void *token, uint8_t *frames, uint32_t count);
+static int Benchmark_EmulatorTransmit(void *token, const uint8_t *data, uint32_t bytes);
+static void Benchmark_HandleTrackFinished(void *context, void *token, uint16_t track_number, uint16_t device);
+static void Benchmark_HandleVolumeResponse(void *context, void *token, uint8_t volume);
+static void Benchmark_HandleCommandComplete(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result);
+static int CompareLatency(const void *a, const void *b);
+static uint32_t Random(uint32_t *state);
+static double GetTimeSeconds(void);
+
+int main(int argc, char *argv[])
+{
+	benchmark_options_t options;
+	int option;
+
+	memset(&options, 0, sizeof(options));
+	options.frames = 1000000;
+	options.round_trips = 10000;
+	options.noise_rate = 10000;
+	options.contexts = 4096;
+	options.seed = 1;
+	options.emulator.baud = 9600;
+	options.emulator.latency = 20000;
+	options.emulator.jitter = 10000;
+	options.emulator.devices_online = DFPLAYER_DEVICE_TFCARD;
+	options.emulator.file_count = 100;
+
+	while((option = getopt(argc, argv, "f:r:n:x:s:b:l:j:d:e:c:")) != -1)
+	{
+		switch(option)
+		{
+			case 'f': options.frames = strtoul(optarg, NULL, 0); break;
+			case 'r': options.round_trips = strtoul(optarg, NULL, 0); break;
+			case 'n': options.noise_rate = strtoul(optarg, NULL, 0); break;
+			case 'x': options.contexts = strtoul(optarg, NULL, 0); break;
+			case 's': options.seed = strtoul(optarg, NULL, 0); break;
+			case 'b': options.emulator.baud = strtoul(optarg, NULL, 0); break;
+			case 'l': options.emulator.latency = strtoul(optarg, NULL, 0); break;
+			case 'j': options.emulator.jitter = strtoul(optarg, NULL, 0); break;
+			case 'd': options.emulator.drop_rate = strtoul(optarg, NULL, 0); break;
+			case 'e': options.emulator.busy_rate = strtoul(optarg, NULL, 0); break;
+			case 'c': options.emulator.corrupt_rate = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "%s [-f frames] [-r round trips] [-n parser noise] [-x contexts] [-s seed]\n"
+					"  [-b baud] [-l latency us] [-j jitter us] [-d drop] [-e busy] [-c corrupt]\n"
+					"Noise and fault rates are per million messages\n", argv[0]);
+				return -1;
+		}
+	}
+	options.emulator.seed = options.seed;
+
+	printf("{\n");
+	printf("  \"frames\": %u,\n", options.frames);
+	printf("  \"seed\": %u,\n", options.seed);
+	printf("  \"parser\": {\n");
+	Benchmark_Parser(&options, false, false);
+	Benchmark_Parser(&options, true, false);
+	Benchmark_Parser(&options, false, true);
+	Benchmark_Parser(&options, true, true);
+	printf("  },\n");
+	Benchmark_Contexts(&options);
+	Benchmark_Resync(&options);
+	Benchmark_Encoder(&options);
+	Benchmark_RoundTrip(&options);
+	Benchmark_Priority(&options);
+	Benchmark_Wheel(&options);
+	Benchmark_Playlist(&options);
+	Benchmark_Memory();
+	printf("}\n");
+
+	return 0;
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Measurements
+ */
+
+/* Decodes a stream of volume answers and track-finished events. Noise is a random byte between
+ * messages or a flipped bit inside one, each at half the noise rate. */
+static void Benchmark_Parser(benchmark_options_t *options, bool noisy, bool buffered)
+{
+	benchmark_link_t link;
+	uint32_t random = options->seed;
+	uint32_t length = 0;
+	uint32_t frame;
+	uint8_t *stream;
+	double start, elapsed;
+	size_t idx;
+
+	stream = (uint8_t *) malloc((size_t) options->frames * (DFPLAYER_FRAME_LENGTH + 1));
+	if(NULL == stream)
+		return;
+
+	for(frame = 0; frame < options->frames; ++frame)
+	{
+		uint8_t command = (frame & 1) ? DFPLAYER_CMD_QUERY_VOLUME : DFPLAYER_CMD_TFCARD_FINISH;
+		uint8_t *data;
+
+		if(noisy && Random(&random) % 2000000 < options->noise_rate)
+			stream[length++] = Random(&random) & 0xFF;
+		data = &stream[length];
+		Benchmark_DeviceFrame(data, command, frame % DFPLAYER_VOL_MAX);
+		length += DFPLAYER_FRAME_LENGTH;
+		if(noisy && Random(&random) % 2000000 < options->noise_rate)
+			data[Random(&random) % DFPLAYER_FRAME_LENGTH] ^= 1 << (Random(&random) % 8);
+	}
+
+	memset(&link, 0, sizeof(link));
+	link.dfplayer = Benchmark_CreateContext(&link, 0);
+
+	start = GetTimeSeconds();
+	if(buffered)
+		dfplayer_HandleSerialBuffer(link.dfplayer, stream, length);
+	else
+	{
+		for(idx = 0; idx < length; ++idx)
+			dfplayer_HandleSerialChar(link.dfplayer, stream[idx]);
+	}
+	elapsed = GetTimeSeconds() - start;
+
+	printf("    \"%s_%s\": { \"bytes\": %u, \"decoded\": %u, \"lost\": %u, \"seconds\": %.6f, "
+		"\"frames_per_second\": %.0f, \"bytes_per_second\": %.0f }%s\n",
+		(buffered) ? "buffer" : "char", (noisy) ? "noisy" : "clean", length, link.decoded,
+		options->frames - link.decoded, elapsed, link.decoded / elapsed, length / elapsed,
+		(buffered && noisy) ? "" : ",");
+
+	dfplayer_Deinitialize(link.dfplayer);
+	free(stream);
+}
+
+/* Many contexts serviced in turn, one byte each, as when a process drives a large number of
+ * players; each byte then lands in a context that's likely to have left the cache. The contexts
+ * are laid out next to each other in one block. */
+static void Benchmark_Contexts(benchmark_options_t *options)
+{
+	benchmark_link_t link;
+	uint8_t frames[2][DFPLAYER_FRAME_LENGTH];
+	uint32_t rounds, round;
+	uint32_t idx, offset;
+	size_t context_size = dfplayer_ContextSize();
+	uint8_t *storage;
+	void **contexts;
+	double start, elapsed;
+	uint64_t bytes;
+
+	if(options->contexts == 0)
+		return;
+	storage = (uint8_t *) malloc(options->contexts * context_size);
+	contexts = (void **) malloc(options->contexts * sizeof(*contexts));
+	if(NULL == storage || NULL == contexts)
+	{
+		free(storage);
+		free(contexts);
+		return;
+	}
+
+	memset(&link, 0, sizeof(link));
+	for(idx = 0; idx < options->contexts; ++idx)
+	{
+		link.dfplayer = Benchmark_CreateContextInPlace(&link, &storage[idx * context_size]);
+		contexts[idx] = link.dfplayer;
+	}
+	Benchmark_DeviceFrame(frames[0], DFPLAYER_CMD_TFCARD_FINISH, 1);
+	Benchmark_DeviceFrame(frames[1], DFPLAYER_CMD_QUERY_VOLUME, 20);
+
+	rounds = options->frames / options->contexts;
+	if(rounds == 0)
+		rounds = 1;
+
+	start = GetTimeSeconds();
+	for(round = 0; round < rounds; ++round)
+	{
+		for(offset = 0; offset < DFPLAYER_FRAME_LENGTH; ++offset)
+		{
+			for(idx = 0; idx < options->contexts; ++idx)
+				dfplayer_HandleSerialChar(contexts[idx], frames[idx & 1][offset]);
+		}
+	}
+	elapsed = GetTimeSeconds() - start;
+	bytes = (uint64_t) rounds * options->contexts * DFPLAYER_FRAME_LENGTH;
+
+	printf("  \"contexts\": { \"contexts\": %u, \"context_bytes\": %u, \"bytes\": %llu, \"decoded\": %u, "
+		"\"seconds\": %.6f, \"bytes_per_second\": %.0f, \"ns_per_byte\": %.2f },\n", options->contexts,
+		(unsigned int) context_size, (unsigned long long) bytes, link.decoded, elapsed, bytes / elapsed,
+		elapsed * 1e9 / bytes);
+
+	for(idx = 0; idx < options->contexts; ++idx)
+		dfplayer_Deinitialize(contexts[idx]);
+	free(contexts);
+	free(storage);
+}
+
+/* Frame loss against error rate, for flipped bits and for dropped bytes (e.g. UART overruns).
+ * Each damaged frame is necessarily lost; any loss beyond that is frames that followed a damaged
+ * one and that the parser failed to resynchronize to. Track numbers cover the whole range, so
+ * start bytes also show up inside messages. */
+static void Benchmark_Resync(benchmark_options_t *options)
+{
+	static const double bit_error_rates[] = { 1e-5, 1e-4, 1e-3, 1e-2 };
+	const uint32_t count = sizeof(bit_error_rates) / sizeof(bit_error_rates[0]);
+	uint32_t rate;
+	int drop;
+
+	printf("  \"resync\": [\n");
+	for(drop = 0; drop < 2; ++drop)
+	{
+		for(rate = 0; rate < count; ++rate)
+		{
+			/* Chance of a byte having an error, as a fraction of 2^32 */
+			double byte_error_rate = 1.0 - pow(1.0 - bit_error_rates[rate], 8);
+			uint32_t threshold = (uint32_t) (byte_error_rate * 4294967295.0);
+			uint32_t random = options->seed;
+			uint32_t length = 0;
+			uint32_t damaged = 0;
+			uint32_t frame, idx;
+			benchmark_link_t char_link, buffer_link;
+			uint8_t *stream;
+
+			stream = (uint8_t *) malloc((size_t) options->frames * DFPLAYER_FRAME_LENGTH);
+			if(NULL == stream)
+				return;
+
+			for(frame = 0; frame < options->frames; ++frame)
+			{
+				uint8_t data[DFPLAYER_FRAME_LENGTH];
+				bool error = false;
+
+				if(frame & 1)
+					Benchmark_DeviceFrame(data, DFPLAYER_CMD_QUERY_VOLUME, frame % DFPLAYER_VOL_MAX);
+				else
+					Benchmark_DeviceFrame(data, DFPLAYER_CMD_TFCARD_FINISH, frame % DFPLAYER_TRACK_MAX);
+				for(idx = 0; idx < DFPLAYER_FRAME_LENGTH; ++idx)
+				{
+					if(Random(&random) >= threshold)
+					{
+						stream[length++] = data[idx];
+						continue;
+					}
+					if(!drop)
+						stream[length++] = data[idx] ^ (1 << (Random(&random) % 8));
+					error = true;
+				}
+				if(error)
+					++damaged;
+			}
+
+			memset(&char_link, 0, sizeof(char_link));
+			char_link.dfplayer = Benchmark_CreateContext(&char_link, 0);
+			for(idx = 0; idx < length; ++idx)
+				dfplayer_HandleSerialChar(char_link.dfplayer, stream[idx]);
+
+			memset(&buffer_link, 0, sizeof(buffer_link));
+			buffer_link.dfplayer = Benchmark_CreateContext(&buffer_link, 0);
+			dfplayer_HandleSerialBuffer(buffer_link.dfplayer, stream, length);
+
+			printf("    { \"error\": \"%s\", \"bit_error_rate\": %g, \"frames\": %u, \"damaged\": %u, "
+				"\"char_lost\": %u, \"buffer_lost\": %u, \"char_excess_loss_rate\": %.6f, "
+				"\"buffer_excess_loss_rate\": %.6f }%s\n", (drop) ? "drop" : "flip", bit_error_rates[rate],
+				options->frames, damaged, options->frames - char_link.decoded,
+				options->frames - buffer_link.decoded,
+				((double) options->frames - char_link.decoded - damaged) / options->frames,
+				((double) options->frames - buffer_link.decoded - damaged) / options->frames,
+				(drop && rate + 1 == count) ? "" : ",");
+
+			dfplayer_Deinitialize(char_link.dfplayer);
+			dfplayer_Deinitialize(buffer_link.dfplayer);
+			free(stream);
+		}
+	}
+	printf("  ],\n");
+}
+
+/* Sends commands straight to a callback that discards them, and encodes into a caller buffer */
+static void Benchmark_Encoder(benchmark_options_t *options)
+{
+	uint8_t frame[DFPLAYER_FRAME_LENGTH];
+	benchmark_link_t link;
+	double start, send_elapsed, static_elapsed, encode_elapsed;
+	uint32_t idx;
+
+	memset(&link, 0, sizeof(link));
+	link.dfplayer = Benchmark_CreateContext(&link, 0);
+
+	start = GetTimeSeconds();
+	for(idx = 0; idx < options->frames; ++idx)
+		dfplayer_VolumeSet(link.dfplayer, idx % DFPLAYER_VOL_MAX);
+	send_elapsed = GetTimeSeconds() - start;
+
+	start = GetTimeSeconds();
+	for(idx = 0; idx < options->frames; ++idx)
+		dfplayer_Play(link.dfplayer);
+	static_elapsed = GetTimeSeconds() - start;
+
+	start = GetTimeSeconds();
+	for(idx = 0; idx < options->frames; ++idx)
+		dfplayer_EncodeFrame(frame, sizeof(frame), DFPLAYER_CMD_SET_TRACK, idx % DFPLAYER_TRACK_MAX, true);
+	encode_elapsed = GetTimeSeconds() - start;
+
+	printf("  \"encoder\": {\n");
+	printf("    \"send_message\": { \"messages\": %u, \"seconds\": %.6f, \"messages_per_second\": %.0f },\n",
+		options->frames, send_elapsed, options->frames / send_elapsed);
+	printf("    \"send_static\": { \"messages\": %u, \"seconds\": %.6f, \"messages_per_second\": %.0f },\n",
+		options->frames, static_elapsed, options->frames / static_elapsed);
+	printf("    \"encode_frame\": { \"messages\": %u, \"seconds\": %.6f, \"messages_per_second\": %.0f }\n",
+		options->frames, encode_elapsed, options->frames / encode_elapsed);
+	printf("  },\n");
+
+	dfplayer_Deinitialize(link.dfplayer);
+}
+
+/* Issues one command at a time to an emulated device and measures the virtual time until the
+ * library reports it complete */
+static void Benchmark_RoundTrip(benchmark_options_t *options)
+{
+	static const uint8_t commands[BENCHMARK_ROUND_TRIP_COMMANDS] =
+	{
+		DFPLAYER_CMD_VOLUME_SET, DFPLAYER_CMD_PLAY, DFPLAYER_CMD_PAUSE, DFPLAYER_CMD_SET_TRACK,
+		DFPLAYER_CMD_QUERY_STATUS, DFPLAYER_CMD_QUERY_VOLUME, DFPLAYER_CMD_QUERY_TFCARD_FILES
+	};
+	benchmark_samples_t samples[BENCHMARK_ROUND_TRIP_COMMANDS];
+	benchmark_link_t link;
+	dfplayer_stats_t stats;
+	double start, elapsed;
+	uint32_t idx;
+
+	memset(&link, 0, sizeof(link));
+	memset(samples, 0, sizeof(samples));
+	for(idx = 0; idx < BENCHMARK_ROUND_TRIP_COMMANDS; ++idx)
+	{
+		samples[idx].command = commands[idx];
+		samples[idx].latency = (uint32_t *) malloc(
+			(options->round_trips / BENCHMARK_ROUND_TRIP_COMMANDS + 1) * sizeof(uint32_t));
+	}
+
+	options->emulator.pfnTransmit = Benchmark_EmulatorTransmit;
+	options->emulator.token = &link;
+	link.wire_time = (options->emulator.baud > 0) ? DFPLAYER_FRAME_LENGTH * 10 * 1000000 / options->emulator.baud : 0;
+	link.emulator = dfplayer_EmulatorCreate(&options->emulator, 0);
+	link.dfplayer = Benchmark_CreateContext(&link, 1);
+
+	start = GetTimeSeconds();
+	for(idx = 0; idx < options->round_trips; ++idx)
+	{
+		benchmark_samples_t *sample = &samples[idx % BENCHMARK_ROUND_TRIP_COMMANDS];
+		uint64_t issued = link.now;
+
+		link.complete = false;
+		if(Benchmark_IssueCommand(link.dfplayer, sample->command, idx) != 0)
+		{
+			++(sample->failures);
+			continue;
+		}
+		dfplayer_Flush(link.dfplayer);
+
+		while(!link.complete)
+			Benchmark_Step(&link);
+
+		if(link.result == DFPLAYER_COMMAND_OK)
+			sample->latency[sample->count++] = (uint32_t) (link.now - issued);
+		else
+			++(sample->failures);
+	}
+	elapsed = GetTimeSeconds() - start;
+
+	printf("  \"round_trip\": {\n");
+	printf("    \"baud\": %u, \"latency_us\": %u, \"jitter_us\": %u, \"drop_rate\": %u, \"busy_rate\": %u, "
+		"\"corrupt_rate\": %u,\n", options->emulator.baud, options->emulator.latency, options->emulator.jitter,
+		options->emulator.drop_rate, options->emulator.busy_rate, options->emulator.corrupt_rate);
+	dfplayer_GetStats(link.dfplayer, &stats);
+	printf("    \"round_trips\": %u, \"seconds\": %.6f, \"virtual_seconds\": %.3f,\n", options->round_trips,
+		elapsed, link.now / 1000000.0);
+	printf("    \"frames_sent\": %u, \"frames_received\": %u, \"retransmissions\": %u, \"timeouts\": %u, "
+		"\"errors\": %u, \"bytes_discarded\": %u,\n", stats.frames_sent, stats.frames_received, stats.retransmissions,
+		stats.commands_completed[DFPLAYER_COMMAND_TIMEOUT], stats.commands_completed[DFPLAYER_COMMAND_ERROR],
+		stats.bytes_discarded);
+	printf("    \"commands\": [\n");
+	for(idx = 0; idx < BENCHMARK_ROUND_TRIP_COMMANDS; ++idx)
+	{
+		Benchmark_PrintSamples(&samples[idx], idx + 1 == BENCHMARK_ROUND_TRIP_COMMANDS);
+		free(samples[idx].latency);
+	}
+	printf("    ]\n");
+	printf("  },\n");
+
+	dfplayer_EmulatorDestroy(link.emulator);
+	dfplayer_Deinitialize(link.dfplayer);
+}
+
+/* Urgent commands issued while the transmit queue is kept full of status polling. The same
+ * commands are then issued at background priority, which sends them in queue order. */
+static void Benchmark_Priority(benchmark_options_t *options)
+{
+	static const uint8_t commands[2] = { DFPLAYER_CMD_PAUSE, DFPLAYER_CMD_VOLUME_SET };
+	static const uint8_t queries[2] = { DFPLAYER_CMD_QUERY_STATUS, DFPLAYER_CMD_QUERY_TFCARD_FILES };
+	uint32_t rounds = options->round_trips / 10;
+	benchmark_samples_t samples[2];
+	benchmark_link_t link;
+	dfplayer_stats_t stats;
+	uint32_t query = 0;
+	uint32_t run, idx;
+
+	printf("  \"priority\": {\n");
+	for(run = 0; run < 2; ++run)
+	{
+		dfplayerPriority_e priority = (run == 0) ? DFPLAYER_PRIORITY_URGENT : DFPLAYER_PRIORITY_BACKGROUND;
+
+		memset(&link, 0, sizeof(link));
+		memset(samples, 0, sizeof(samples));
+		for(idx = 0; idx < 2; ++idx)
+		{
+			samples[idx].command = commands[idx];
+			samples[idx].latency = (uint32_t *) malloc((rounds / 2 + 1) * sizeof(uint32_t));
+		}
+
+		options->emulator.pfnTransmit = Benchmark_EmulatorTransmit;
+		options->emulator.token = &link;
+		link.wire_time = (options->emulator.baud > 0) ? DFPLAYER_FRAME_LENGTH * 10 * 1000000 / options->emulator.baud : 0;
+		link.emulator = dfplayer_EmulatorCreate(&options->emulator, 0);
+		link.dfplayer = Benchmark_CreateContext(&link, 1);
+
+		for(idx = 0; idx < rounds; ++idx)
+		{
+			benchmark_samples_t *sample = &samples[idx % 2];
+			uint16_t parameter = (sample->command == DFPLAYER_CMD_VOLUME_SET) ? idx % DFPLAYER_VOL_MAX : 0;
+			uint64_t issued;
+
+			/* Refill the queue with polling, leaving room for the command being measured */
+			dfplayer_GetStats(link.dfplayer, &stats);
+			for(; stats.commands_outstanding + 1 < DFPLAYER_TX_QUEUE_LENGTH; ++(stats.commands_outstanding))
+				(void) dfplayer_IssueCommand(link.dfplayer, queries[query++ % 2], 0, DFPLAYER_PRIORITY_BACKGROUND);
+
+			issued = link.now;
+			link.complete = false;
+			link.awaited = sample->command;
+			if(dfplayer_IssueCommand(link.dfplayer, sample->command, parameter, priority) != 0)
+			{
+				++(sample->failures);
+				continue;
+			}
+			dfplayer_Flush(link.dfplayer);
+
+			while(!link.complete)
+				Benchmark_Step(&link);
+
+			if(link.result == DFPLAYER_COMMAND_OK)
+				sample->latency[sample->count++] = (uint32_t) (link.now - issued);
+			else
+				++(sample->failures);
+		}
+
+		dfplayer_GetStats(link.dfplayer, &stats);
+		printf("    \"%s\": { \"preempted\": %u, \"commands\": [\n", (run == 0) ? "urgent" : "background",
+			stats.commands_preempted);
+		for(idx = 0; idx < 2; ++idx)
+		{
+			Benchmark_PrintSamples(&samples[idx], idx == 1);
+			free(samples[idx].latency);
+		}
+		printf("    ] }%s\n", (run == 0) ? "," : "");
+
+		dfplayer_EmulatorDestroy(link.emulator);
+		dfplayer_Deinitialize(link.dfplayer);
+	}
+	printf("  },\n");
+}
+
+/* Servicing many contexts that each poll once a second, for ten seconds of 1 ms steps: ticking
+ * every context at each step, against ticking only the contexts the timer wheel finds due */
+static void Benchmark_Wheel(benchmark_options_t *options)
+{
+	const uint32_t period = 1000, duration = 10000;
+	dfplayer_init_info_t init_info;
+	benchmark_link_t link;
+	void *wheel;
+	void **contexts;
+	uint32_t idx, now;
+	uint64_t ticks[2] = { 0, 0 };
+	double elapsed[2];
+	uint8_t run;
+
+	if(options->contexts == 0)
+		return;
+	wheel = malloc(dfplayer_WheelSize());
+	contexts = (void **) calloc(options->contexts, sizeof(*contexts));
+	if(NULL == wheel || NULL == contexts)
+	{
+		free(wheel);
+		free(contexts);
+		return;
+	}
+
+	memset(&link, 0, sizeof(link));
+	for(run = 0; run < 2; ++run)
+	{
+		double start;
+
+		(void) dfplayer_WheelInitialize(wheel, dfplayer_WheelSize(), 0);
+		memset(&init_info, 0, sizeof(init_info));
+		init_info.pfnSendSerial = Benchmark_SendSerial;
+		init_info.wheel = (run == 1) ? wheel : NULL;
+		for(idx = 0; idx < options->contexts; ++idx)
+		{
+			contexts[idx] = dfplayer_Initialize(&link, &init_info);
+			if(NULL == contexts[idx])
+				break;
+			(void) dfplayer_ScheduleCommand(contexts[idx], DFPLAYER_CMD_QUERY_VOLUME, 0, 1 + idx % period, period);
+		}
+
+		start = GetTimeSeconds();
+		for(now = 1; now <= duration; ++now)
+		{
+			if(run == 1)
+				ticks[run] += dfplayer_WheelTick(wheel, now);
+			else
+			{
+				for(idx = 0; idx < options->contexts && contexts[idx] != NULL; ++idx)
+					dfplayer_Tick(contexts[idx], now);
+				ticks[run] += idx;
+			}
+		}
+		elapsed[run] = GetTimeSeconds() - start;
+
+		for(idx = 0; idx < options->contexts; ++idx)
+			dfplayer_Deinitialize(contexts[idx]);
+		memset(contexts, 0, options->contexts * sizeof(*contexts));
+	}
+
+	printf("  \"wheel\": { \"contexts\": %u, \"milliseconds\": %u, \"period\": %u, \"wheel_bytes\": %u, "
+		"\"ticks_all\": %llu, \"seconds_all\": %.6f, \"ticks_wheel\": %llu, \"seconds_wheel\": %.6f },\n",
+		options->contexts, duration, period, (unsigned int) dfplayer_WheelSize(), (unsigned long long) ticks[0],
+		elapsed[0], (unsigned long long) ticks[1], elapsed[1]);
+
+	free(contexts);
+	free(wheel);
+}
+
+/* A shuffled playlist played through on the emulator while the status is polled every 100 ms,
+ * with every other track-finished message repeated. Gaps are from the track-finished message
+ * being decoded to the next track being sent, in microseconds. */
+static void Benchmark_Playlist(benchmark_options_t *options)
+{
+	const uint32_t tracks = 100;
+	dfplayer_emulator_config_t config = options->emulator;
+	benchmark_link_t link;
+	dfplayer_stats_t stats;
+	uint32_t idx;
+
+	memset(&link, 0, sizeof(link));
+	config.pfnTransmit = Benchmark_EmulatorTransmit;
+	config.token = &link;
+	config.track_length = 3000000;
+	config.duplicate_rate = 500000;
+	link.wire_time = (config.baud > 0) ? DFPLAYER_FRAME_LENGTH * 10 * 1000000 / config.baud : 0;
+	link.emulator = dfplayer_EmulatorCreate(&config, 0);
+	link.dfplayer = Benchmark_CreateContext(&link, 1);
+	if(NULL == link.emulator || NULL == link.dfplayer)
+	{
+		dfplayer_EmulatorDestroy(link.emulator);
+		dfplayer_Deinitialize(link.dfplayer);
+		return;
+	}
+
+	for(idx = 0; idx < 10; ++idx)
+		(void) dfplayer_PlaylistAdd(link.dfplayer, DFPLAYER_DEVICE_TFCARD, idx % 2, 1 + idx * 7 % config.file_count);
+	dfplayer_PlaylistSetMode(link.dfplayer, true, DFPLAYER_PLAYLIST_REPEAT_ALL);
+	(void) dfplayer_PlaylistStart(link.dfplayer);
+	(void) dfplayer_ScheduleCommand(link.dfplayer, DFPLAYER_CMD_QUERY_STATUS, 0, 100, 100);
+
+	do
+	{
+		Benchmark_Step(&link);
+		dfplayer_GetStats(link.dfplayer, &stats);
+	} while(stats.playlist_advances < tracks && link.now < (uint64_t) (tracks + 1) * config.track_length * 2);
+
+	printf("  \"playlist\": { \"tracks\": %u, \"duplicates_ignored\": %u, \"gaps\": %u, \"gap_mean_us\": %.0f, "
+		"\"gap_max_us\": %u, \"position\": %d },\n", stats.playlist_advances, stats.playlist_duplicates,
+		stats.playlist_gap_count, (stats.playlist_gap_count > 0) ? (double) stats.playlist_gap_total
+		/ stats.playlist_gap_count : 0.0, stats.playlist_gap_max, dfplayer_PlaylistPosition(link.dfplayer));
+
+	dfplayer_EmulatorDestroy(link.emulator);
+	dfplayer_Deinitialize(link.dfplayer);
+}
+
+/* Steps the virtual clock to the next event: output finishing crossing the wire, an emulator
+ * event or the next millisecond, which is what the library keeps time in */
+static void Benchmark_Step(benchmark_link_t *link)
+{
+	uint64_t next = (link->now / 1000 + 1) * 1000;
+	uint64_t event = dfplayer_EmulatorNextEvent(link->emulator);
+
+	if(event < next)
+		next = event;
+	if(link->pending_length > 0 && link->pending_due < next)
+		next = link->pending_due;
+	link->now = next;
+
+	if(link->pending_length > 0 && link->pending_due <= link->now)
+	{
+		dfplayer_EmulatorReceive(link->emulator, link->pending, link->pending_length);
+		link->pending_length = 0;
+	}
+	dfplayer_EmulatorAdvance(link->emulator, link->now);
+	dfplayer_Tick(link->dfplayer, (uint32_t) (link->now / 1000));
+}
+
+static void Benchmark_Memory(void)
+{
+	printf("  \"memory\": { \"context_bytes\": %u, \"handlers_bytes\": %u, \"command_bytes\": %u, "
+		"\"tx_queue_length\": %u, \"tx_batch_length\": %u }\n", (unsigned int) sizeof(dfplayer_context_t),
+		(unsigned int) sizeof(dfplayer_handlers_t), (unsigned int) sizeof(dfplayer_command_t),
+		DFPLAYER_TX_QUEUE_LENGTH, DFPLAYER_TX_BATCH_LENGTH);
+}
+
+/* A message as the device sends it; dfplayer_EncodeFrame() only accepts host commands */
+static void Benchmark_DeviceFrame(uint8_t *data, uint8_t command, uint16_t value)
+{
+	uint16_t checksum = DFPLAYER_CHECKSUM(command, 0, value >> 8, value & 0xFF);
+
+	data[0] = DFPLAYER_MSG_START;
+	data[1] = DFPLAYER_MSG_VERSION;
+	data[2] = DFPLAYER_MSG_DATA_LENGTH;
+	data[3] = command;
+	data[4] = 0;
+	data[5] = value >> 8;
+	data[6] = value & 0xFF;
+	data[7] = checksum >> 8;
+	data[8] = checksum & 0xFF;
+	data[9] = DFPLAYER_MSG_END;
+}
+
+static int Benchmark_IssueCommand(void *dfplayer, uint8_t command, uint32_t iteration)
+{
+	switch(command)
+	{
+		case DFPLAYER_CMD_VOLUME_SET: return dfplayer_VolumeSet(dfplayer, iteration % DFPLAYER_VOL_MAX);
+		case DFPLAYER_CMD_PLAY: return dfplayer_Play(dfplayer);
+		case DFPLAYER_CMD_PAUSE: return dfplayer_Pause(dfplayer);
+		case DFPLAYER_CMD_SET_TRACK: return dfplayer_SetTrack(dfplayer, 1 + iteration % 100);
+		case DFPLAYER_CMD_QUERY_STATUS: return dfplayer_QueryStatus(dfplayer);
+		case DFPLAYER_CMD_QUERY_VOLUME: return dfplayer_QueryVolume(dfplayer);
+		case DFPLAYER_CMD_QUERY_TFCARD_FILES: return dfplayer_QueryFileCount(dfplayer, DFPLAYER_DEVICE_TFCARD);
+		default: return -1;
+	}
+}
+
+static void Benchmark_PrintSamples(benchmark_samples_t *samples, bool last)
+{
+	uint32_t *latency = samples->latency;
+	uint32_t count = samples->count;
+	uint64_t total = 0;
+	uint32_t idx;
+
+	qsort(latency, count, sizeof(*latency), CompareLatency);
+	for(idx = 0; idx < count; ++idx)
+		total += latency[idx];
+
+	printf("      { \"command\": \"%s\", \"samples\": %u, \"failures\": %u", benchmark_command_names[samples->command],
+		count, samples->failures);
+	if(count > 0)
+	{
+		printf(", \"mean_us\": %.0f, \"min_us\": %u, \"p50_us\": %u, \"p90_us\": %u, \"p99_us\": %u, \"max_us\": %u",
+			(double) total / count, latency[0], latency[count / 2], latency[count * 9 / 10],
+			latency[count * 99 / 100], latency[count - 1]);
+	}
+	printf(" }%s\n", (last) ? "" : ",");
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Callbacks
+ */
+
+static const dfplayer_handlers_t benchmark_handlers =
+{
+	.pfnHandleTrackFinished = Benchmark_HandleTrackFinished,
+	.pfnHandleVolumeResponse = Benchmark_HandleVolumeResponse,
+	.pfnHandleCommandComplete = Benchmark_HandleCommandComplete
+};
+
+static void *Benchmark_CreateContext(benchmark_link_t *link, uint8_t tx_window)
+{
+	dfplayer_init_info_t init_info;
+
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.handlers = &benchmark_handlers;
+	init_info.tx_window = tx_window;
+	init_info.tx_retries = 2;
+	init_info.tx_timeout = 200; /* milliseconds */
+	init_info.pfnTraceTimestamp = Benchmark_Timestamp;
+	if(tx_window > 0)
+		init_info.pfnSendSerialBatch = Benchmark_SendSerialBatch;
+	else
+		init_info.pfnSendSerial = Benchmark_SendSerial;
+
+	return dfplayer_Initialize(link, &init_info);
+}
+
+static void *Benchmark_CreateContextInPlace(benchmark_link_t *link, void *storage)
+{
+	dfplayer_init_info_t init_info;
+
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.handlers = &benchmark_handlers;
+	init_info.pfnSendSerial = Benchmark_SendSerial;
+
+	return dfplayer_InitializeInPlace(storage, dfplayer_ContextSize(), link, &init_info);
+}
+
+/* Virtual clock in microseconds, for measurements finer than the library's milliseconds */
+static uint32_t Benchmark_Timestamp(void *context, void *token)
+{
+	return (uint32_t) ((benchmark_link_t *) token)->now;
+}
+
+static int Benchmark_SendSerial(void *context, void *token, uint8_t *data, uint32_t bytes)
+{
+	return 0;
+}
+
+/* Frames reach the emulator once they've crossed the wire */
+static int Benchmark_SendSerialBatch(void *context, void *token, uint8_t *frames, uint32_t count)
+{
+	benchmark_link_t *link = (benchmark_link_t *) token;
+	uint32_t bytes = count * DFPLAYER_FRAME_LENGTH;
+
+	if(link->pending_length + bytes > sizeof(link->pending))
+		return -1;
+	memcpy(&link->pending[link->pending_length], frames, bytes);
+	link->pending_length += bytes;
+	link->pending_due = link->now + (uint64_t) link->wire_time * link->pending_length / DFPLAYER_FRAME_LENGTH;
+	return 0;
+}
+
+static int Benchmark_EmulatorTransmit(void *token, const uint8_t *data, uint32_t bytes)
+{
+	benchmark_link_t *link = (benchmark_link_t *) token;
+
+	dfplayer_HandleSerialBuffer(link->dfplayer, data, bytes);
+	return 0;
+}
+
+static void Benchmark_HandleTrackFinished(void *context, void *token, uint16_t track_number, uint16_t device)
+{
+	++(((benchmark_link_t *) token)->decoded);
+}
+
+static void Benchmark_HandleVolumeResponse(void *context, void *token, uint8_t volume)
+{
+	++(((benchmark_link_t *) token)->decoded);
+}
+
+static void Benchmark_HandleCommandComplete(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result)
+{
+	benchmark_link_t *link = (benchmark_link_t *) token;
+
+	if(link->awaited != 0 && command != link->awaited)
+		return;
+	link->complete = true;
+	link->result = result;
+}
+
+static int CompareLatency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* xorshift32 */
+static uint32_t Random(uint32_t *state)
+{
+	uint32_t x = (*state != 0) ? *state : 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static double GetTimeSeconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,144 @@
+/* \file dfplayer_capture.c
+ * \brief Capture file reading and writing
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfplayer.h"
+#include "dfplayer_capture.h"
+
+FILE *dfplayer_CaptureCreate(const char *path, const dfplayer_init_info_t *init_info, uint32_t resolution)
+{
+	dfplayer_capture_file_t header;
+	FILE *file;
+
+	file = fopen(path, "wb");
+	if(NULL == file)
+		return NULL;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = DFPLAYER_CAPTURE_MAGIC;
+	header.version = DFPLAYER_CAPTURE_VERSION;
+	header.tx_window = init_info->tx_window;
+	header.tx_retries = init_info->tx_retries;
+	header.tx_timeout = init_info->tx_timeout;
+	header.coalesce = (init_info->coalesce) ? 1 : 0;
+	header.tx_backoff = (init_info->tx_backoff) ? 1 : 0;
+	header.resolution = resolution;
+	if(fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+int dfplayer_CaptureWrite(FILE *file, uint32_t timestamp, uint8_t type, const void *data, uint16_t length)
+{
+	dfplayer_capture_record_t record;
+
+	record.timestamp = timestamp;
+	record.type = type;
+	record.reserved = 0;
+	record.length = length;
+	if(fwrite(&record, sizeof(record), 1, file) != 1)
+		return -1;
+	if(length > 0 && fwrite(data, length, 1, file) != 1)
+		return -1;
+	return 0;
+}
+
+int dfplayer_CaptureIssue(void *dfplayer, uint8_t command, uint16_t parameter)
+{
+	switch(command)
+	{
+		case DFPLAYER_CMD_NEXT_TRACK: return dfplayer_NextTrack(dfplayer);
+		case DFPLAYER_CMD_PREVIOUS_TRACK: return dfplayer_PreviousTrack(dfplayer);
+		case DFPLAYER_CMD_SET_TRACK: return dfplayer_SetTrack(dfplayer, parameter);
+		case DFPLAYER_CMD_VOLUME_UP: return dfplayer_VolumeUp(dfplayer);
+		case DFPLAYER_CMD_VOLUME_DOWN: return dfplayer_VolumeDown(dfplayer);
+		case DFPLAYER_CMD_VOLUME_SET: return dfplayer_VolumeSet(dfplayer, (uint8_t) parameter);
+		case DFPLAYER_CMD_RESET: return dfplayer_Reset(dfplayer);
+		case DFPLAYER_CMD_PLAY: return dfplayer_Play(dfplayer);
+		case DFPLAYER_CMD_PAUSE: return dfplayer_Pause(dfplayer);
+		case DFPLAYER_CMD_SET_FOLDER: return dfplayer_SetFolder(dfplayer, (uint8_t) parameter);
+#if !defined DFPLAYER_NO_SETTINGS
+		case DFPLAYER_CMD_SET_EQUALIZER: return dfplayer_SetEqualizer(dfplayer, (dfplayerEqualizer_e) parameter);
+		case DFPLAYER_CMD_SET_PLAYBACK_MODE:
+			return dfplayer_SetPlaybackMode(dfplayer, (dfplayerPlaybackMode_e) parameter);
+		case DFPLAYER_CMD_SET_PLAYBACK_SOURCE: return dfplayer_SetPlaybackSource(dfplayer, parameter);
+		case DFPLAYER_CMD_POWER_MODE_STANDBY: return dfplayer_SetStandbyMode(dfplayer, true);
+		case DFPLAYER_CMD_POWER_MODE_NORMAL: return dfplayer_SetStandbyMode(dfplayer, false);
+		case DFPLAYER_CMD_REPEAT: return dfplayer_EnableRepeatPlayback(dfplayer, parameter != 0);
+#endif
+#if !defined DFPLAYER_NO_QUERIES
+		case DFPLAYER_CMD_QUERY_STATUS: return dfplayer_QueryStatus(dfplayer);
+		case DFPLAYER_CMD_QUERY_VOLUME: return dfplayer_QueryVolume(dfplayer);
+		case DFPLAYER_CMD_QUERY_EQUALIZER: return dfplayer_QueryEqualizer(dfplayer);
+		case DFPLAYER_CMD_QUERY_PLAYBACK_MODE: return dfplayer_QueryPlaybackMode(dfplayer);
+		case DFPLAYER_CMD_QUERY_TFCARD_FILES: return dfplayer_QueryFileCount(dfplayer, DFPLAYER_DEVICE_TFCARD);
+		case DFPLAYER_CMD_QUERY_UDISK_FILES: return dfplayer_QueryFileCount(dfplayer, DFPLAYER_DEVICE_UDISK);
+		case DFPLAYER_CMD_QUERY_FLASH_FILES: return dfplayer_QueryFileCount(dfplayer, DFPLAYER_DEVICE_FLASH);
+		case DFPLAYER_CMD_QUERY_TFCARD_TRACK: return dfplayer_QueryCurrentTrack(dfplayer, DFPLAYER_DEVICE_TFCARD);
+		case DFPLAYER_CMD_QUERY_UDISK_TRACK: return dfplayer_QueryCurrentTrack(dfplayer, DFPLAYER_DEVICE_UDISK);
+		case DFPLAYER_CMD_QUERY_FLASH_TRACK: return dfplayer_QueryCurrentTrack(dfplayer, DFPLAYER_DEVICE_FLASH);
+#endif
+		default: return -1;
+	}
+}
+
+int dfplayer_CaptureLoad(dfplayer_capture_t *capture, const char *path)
+{
+	FILE *file;
+	long size;
+
+	memset(capture, 0, sizeof(*capture));
+	file = fopen(path, "rb");
+	if(NULL == file)
+		return -1;
+
+	if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < (long) sizeof(capture->header)
+	|| fseek(file, 0, SEEK_SET) != 0 || fread(&capture->header, sizeof(capture->header), 1, file) != 1
+	|| capture->header.magic != DFPLAYER_CAPTURE_MAGIC || capture->header.version != DFPLAYER_CAPTURE_VERSION)
+	{
+		fclose(file);
+		return -1;
+	}
+
+	capture->length = size - sizeof(capture->header);
+	capture->data = (uint8_t *) malloc(capture->length + 1);
+	if(NULL == capture->data
+	|| (capture->length > 0 && fread(capture->data, capture->length, 1, file) != 1))
+	{
+		fclose(file);
+		dfplayer_CaptureFree(capture);
+		return -1;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+void dfplayer_CaptureFree(dfplayer_capture_t *capture)
+{
+	free(capture->data);
+	capture->data = NULL;
+	capture->length = 0;
+}
+
+int dfplayer_CaptureNext(const dfplayer_capture_t *capture, size_t *offset, dfplayer_capture_record_t *record,
+	const uint8_t **data)
+{
+	/* Records aren't aligned, so the header is copied out */
+	if(*offset + sizeof(*record) > capture->length)
+		return -1;
+	memcpy(record, &capture->data[*offset], sizeof(*record));
+	if(*offset + sizeof(*record) + record->length > capture->length)
+		return -1;
+
+	*data = &capture->data[*offset + sizeof(*record)];
+	*offset += sizeof(*record) + record->length;
+	return 0;
+}
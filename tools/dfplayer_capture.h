@@ -0,0 +1,119 @@
+/* \file dfplayer_capture.h
+ * \brief Capture files: both directions of a serial session plus what the application saw
+ *
+ * A capture is a dfplayer_capture_file_t header followed by records, each a
+ * dfplayer_capture_record_t followed by length bytes of data, all in the byte order of the
+ * machine that wrote it. Serial data is kept as the raw chunks read from or written to the port,
+ * so noise and message fragmentation are preserved. Besides the serial data, a capture holds the
+ * application's calls into the library and the handler callbacks it received, so a replay can
+ * check that the library still behaves the same.
+ */
+#ifndef _DFPLAYER_CAPTURE_H
+#define _DFPLAYER_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "dfplayer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DFPLAYER_CAPTURE_MAGIC      0x50434644 /* "DFCP" */
+#define DFPLAYER_CAPTURE_VERSION    1
+
+typedef enum
+{
+	DFPLAYER_CAPTURE_RX    = 0, /* bytes received from the device */
+	DFPLAYER_CAPTURE_TX    = 1, /* bytes sent to the device */
+	DFPLAYER_CAPTURE_TICK  = 2, /* dfplayer_Tick; data is the uint32_t time it was given */
+	DFPLAYER_CAPTURE_CALL  = 3, /* a command function call; data is a dfplayer_capture_call_t */
+	DFPLAYER_CAPTURE_EVENT = 4  /* a handler callback; data is a dfplayer_capture_event_t */
+} dfplayerCaptureRecord_e;
+
+typedef enum
+{
+	DFPLAYER_CAPTURE_EVENT_INITIALIZE = 0,
+	DFPLAYER_CAPTURE_EVENT_TRACK_FINISHED,
+	DFPLAYER_CAPTURE_EVENT_DEVICE_STATE,
+	DFPLAYER_CAPTURE_EVENT_ERROR,
+	DFPLAYER_CAPTURE_EVENT_REPLY,
+	DFPLAYER_CAPTURE_EVENT_STATUS,
+	DFPLAYER_CAPTURE_EVENT_VOLUME,
+	DFPLAYER_CAPTURE_EVENT_EQUALIZER,
+	DFPLAYER_CAPTURE_EVENT_PLAYBACK_MODE,
+	DFPLAYER_CAPTURE_EVENT_FILE_COUNT,
+	DFPLAYER_CAPTURE_EVENT_CURRENT_TRACK,
+	DFPLAYER_CAPTURE_EVENT_COMMAND_COMPLETE
+} dfplayerCaptureEvent_e;
+
+/* The library settings the session was recorded with are kept so a replay can match them */
+typedef struct dfplayer_capture_file_s
+{
+	uint32_t magic;
+	uint16_t version;
+	uint8_t tx_window;
+	uint8_t tx_retries;
+	uint32_t tx_timeout;
+	uint8_t coalesce;
+	uint8_t tx_backoff;
+	uint8_t reserved[2];
+	uint32_t resolution; /* microseconds per timestamp unit */
+} dfplayer_capture_file_t;
+
+typedef struct dfplayer_capture_record_s
+{
+	uint32_t timestamp;
+	uint8_t type;        /* dfplayerCaptureRecord_e */
+	uint8_t reserved;
+	uint16_t length;     /* bytes of data following */
+} dfplayer_capture_record_t;
+
+typedef struct dfplayer_capture_call_s
+{
+	uint8_t command;     /* dfplayerCommand_e of the function called */
+	uint8_t rejected;    /* the function returned an error */
+	uint16_t parameter;
+} dfplayer_capture_call_t;
+
+/* Handler arguments in order, e.g. TRACK_FINISHED has value1 = track and value2 = device;
+ * COMMAND_COMPLETE has command set and value1 = result */
+typedef struct dfplayer_capture_event_s
+{
+	uint8_t event;       /* dfplayerCaptureEvent_e */
+	uint8_t command;
+	uint16_t value1;
+	uint16_t value2;
+} dfplayer_capture_event_t;
+
+/* Writing; records must be written before the library acts on them (e.g. an RX record before
+ * the bytes are handed to the parser), so that TX and EVENT records follow what caused them */
+FILE *dfplayer_CaptureCreate(const char *path, const dfplayer_init_info_t *init_info, uint32_t resolution);
+int dfplayer_CaptureWrite(FILE *file, uint32_t timestamp, uint8_t type, const void *data, uint16_t length);
+
+/* Calls the command function a CALL record describes and returns its result */
+int dfplayer_CaptureIssue(void *dfplayer, uint8_t command, uint16_t parameter);
+
+/* Reading; a capture is loaded whole and its records are walked in place */
+typedef struct dfplayer_capture_s
+{
+	dfplayer_capture_file_t header;
+	uint8_t *data;
+	size_t length;
+} dfplayer_capture_t;
+
+int dfplayer_CaptureLoad(dfplayer_capture_t *capture, const char *path);
+void dfplayer_CaptureFree(dfplayer_capture_t *capture);
+
+/* Copies the record at *offset, points *data at its (unaligned) data and moves *offset past it.
+ * Returns -1 at the end of the capture or at a truncated record. */
+int dfplayer_CaptureNext(const dfplayer_capture_t *capture, size_t *offset, dfplayer_capture_record_t *record,
+	const uint8_t **data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DFPLAYER_CAPTURE_H */
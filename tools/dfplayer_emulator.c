@@ -0,0 +1,499 @@
+/* \file dfplayer_emulator.c
+ * \brief Software model of a dfplayer mini module, for testing and benchmarking without hardware
+ *
+ * Answers follow the library's decoders: status, equalizer and playback mode are reported in the
+ * first parameter byte, everything else as a 16-bit value. Commands requesting feedback are
+ * acknowledged with a reply message before any answer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "dfplayer_private.h"
+#include "dfplayer_emulator.h"
+
+#define EMULATOR_TX_QUEUE_LENGTH  16 /* messages */
+#define EMULATOR_TX_FRAME_LENGTH  (DFPLAYER_MSG_LENGTH + 1) /* room for a noise byte */
+#define EMULATOR_DEVICES          3
+#define EMULATOR_VERSION          8
+#define EMULATOR_VOLUME_DEFAULT   25
+
+typedef struct emulator_frame_s
+{
+	uint64_t due;
+	uint8_t length;
+	uint8_t data[EMULATOR_TX_FRAME_LENGTH];
+} emulator_frame_t;
+
+struct dfplayer_emulator_s
+{
+	dfplayer_emulator_config_t config;
+	uint32_t random;
+	uint64_t now;
+	dfplayer_emulator_stats_t stats;
+
+	/* Receive message state */
+	uint8_t rx[DFPLAYER_MSG_LENGTH];
+	uint8_t rx_length;
+
+	/* Transmit queue, in order of increasing due time */
+	emulator_frame_t tx[EMULATOR_TX_QUEUE_LENGTH];
+	uint8_t tx_head;
+	uint8_t tx_count;
+	uint64_t line_free; /* when the last queued message has left the wire */
+
+	/* Device state */
+	uint16_t devices_online;
+	uint16_t source;
+	uint8_t volume;
+	uint8_t equalizer;
+	uint8_t playback_mode;
+	uint8_t folder;
+	bool repeat;
+	bool standby;
+	bool playing;
+	uint16_t track[EMULATOR_DEVICES];
+	uint64_t track_end;       /* DFPLAYER_EMULATOR_NEVER unless playing */
+	uint64_t track_remaining; /* playing time left in a paused track */
+};
+
+static void emulator_PowerOn(dfplayer_emulator_t *emulator);
+static void emulator_HandleMessage(dfplayer_emulator_t *emulator);
+static void emulator_HandleCommand(dfplayer_emulator_t *emulator, uint8_t command, uint16_t value);
+static void emulator_StartTrack(dfplayer_emulator_t *emulator, uint16_t track);
+static void emulator_StopTrack(dfplayer_emulator_t *emulator);
+static void emulator_TrackFinished(dfplayer_emulator_t *emulator);
+static void emulator_Send(dfplayer_emulator_t *emulator, uint8_t command, uint8_t parameter1, uint8_t parameter2);
+static int emulator_DeviceIndex(uint16_t device);
+static uint16_t emulator_FinishCommand(uint16_t device);
+static bool emulator_Chance(dfplayer_emulator_t *emulator, uint32_t rate);
+static uint32_t emulator_Random(dfplayer_emulator_t *emulator);
+
+/* -------------------------------------------------------------------------------------------
+ * Exported Functions
+ */
+
+dfplayer_emulator_t *dfplayer_EmulatorCreate(const dfplayer_emulator_config_t *config, uint64_t now)
+{
+	dfplayer_emulator_t *emulator;
+
+	emulator = (dfplayer_emulator_t *) calloc(1, sizeof(*emulator));
+	if(NULL == emulator)
+		return NULL;
+
+	emulator->config = *config;
+	emulator->random = (config->seed != 0) ? config->seed : 1;
+	emulator->now = now;
+	emulator->line_free = now;
+	emulator->devices_online = config->devices_online;
+	emulator_PowerOn(emulator);
+
+	return emulator;
+}
+
+void dfplayer_EmulatorDestroy(dfplayer_emulator_t *emulator)
+{
+	free(emulator);
+}
+
+void dfplayer_EmulatorReceive(dfplayer_emulator_t *emulator, const uint8_t *data, size_t length)
+{
+	size_t idx;
+
+	for(idx = 0; idx < length; ++idx)
+	{
+		uint8_t c = data[idx];
+
+		if(0 == emulator->rx_length && c != DFPLAYER_MSG_START)
+			continue;
+		emulator->rx[emulator->rx_length++] = c;
+
+		/* Resynchronize on anything that isn't a message header */
+		if((2 == emulator->rx_length && c != DFPLAYER_MSG_VERSION)
+		|| (3 == emulator->rx_length && c != DFPLAYER_MSG_DATA_LENGTH))
+		{
+			emulator->rx_length = (DFPLAYER_MSG_START == c) ? 1 : 0;
+			emulator->rx[0] = c;
+			continue;
+		}
+
+		if(DFPLAYER_MSG_LENGTH == emulator->rx_length)
+		{
+			emulator->rx_length = 0;
+			if(c == DFPLAYER_MSG_END)
+				emulator_HandleMessage(emulator);
+		}
+	}
+}
+
+void dfplayer_EmulatorAdvance(dfplayer_emulator_t *emulator, uint64_t now)
+{
+	/* Events are handled in time order, so answers to anything sent after a track ended see the
+	 * state that follows it */
+	for(;;)
+	{
+		emulator_frame_t *frame = &emulator->tx[emulator->tx_head];
+		uint64_t frame_due = (emulator->tx_count > 0) ? frame->due : DFPLAYER_EMULATOR_NEVER;
+
+		if(emulator->track_end <= now && emulator->track_end <= frame_due)
+		{
+			emulator->now = emulator->track_end;
+			emulator_TrackFinished(emulator);
+		}
+		else if(frame_due <= now)
+		{
+			emulator->now = frame_due;
+			emulator->tx_head = (emulator->tx_head + 1) % EMULATOR_TX_QUEUE_LENGTH;
+			--(emulator->tx_count);
+			++(emulator->stats.transmitted);
+			if(emulator->config.pfnTransmit != NULL)
+				emulator->config.pfnTransmit(emulator->config.token, frame->data, frame->length);
+		}
+		else
+			break;
+	}
+
+	emulator->now = now;
+}
+
+uint64_t dfplayer_EmulatorNextEvent(dfplayer_emulator_t *emulator)
+{
+	uint64_t next = emulator->track_end;
+
+	if(emulator->tx_count > 0 && emulator->tx[emulator->tx_head].due < next)
+		next = emulator->tx[emulator->tx_head].due;
+	return next;
+}
+
+void dfplayer_EmulatorSetDevice(dfplayer_emulator_t *emulator, uint16_t device, bool inserted)
+{
+	if(inserted)
+		emulator->devices_online |= device;
+	else
+	{
+		emulator->devices_online &= ~device;
+		if(emulator->source == device)
+			emulator_StopTrack(emulator);
+	}
+	emulator_Send(emulator, (inserted) ? DFPLAYER_CMD_DEVICE_PUSH_IN : DFPLAYER_CMD_DEVICE_PULL_OUT,
+		device >> 8, device & 0xFF);
+}
+
+void dfplayer_EmulatorFinishTrack(dfplayer_emulator_t *emulator)
+{
+	if(emulator->playing)
+		emulator_TrackFinished(emulator);
+}
+
+void dfplayer_EmulatorReportError(dfplayer_emulator_t *emulator, dfplayerError_e error)
+{
+	emulator_Send(emulator, DFPLAYER_CMD_ERROR_REPORT, 0, (uint8_t) error);
+}
+
+void dfplayer_EmulatorGetStats(dfplayer_emulator_t *emulator, dfplayer_emulator_stats_t *stats)
+{
+	*stats = emulator->stats;
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Device Model
+ */
+
+static void emulator_PowerOn(dfplayer_emulator_t *emulator)
+{
+	uint64_t due = emulator->now + emulator->config.reset_time;
+	uint16_t online;
+	int idx;
+
+	emulator->volume = EMULATOR_VOLUME_DEFAULT;
+	emulator->equalizer = DFPLAYER_EQ_NORMAL;
+	emulator->playback_mode = DFPLAYER_PLAY_MODE_REPEAT;
+	emulator->folder = 0;
+	emulator->repeat = false;
+	emulator->standby = false;
+	emulator->playing = false;
+	emulator->track_end = DFPLAYER_EMULATOR_NEVER;
+	emulator->track_remaining = 0;
+	for(idx = 0; idx < EMULATOR_DEVICES; ++idx)
+		emulator->track[idx] = 1;
+
+	/* Playback starts from the first online device, in the module's own order of preference */
+	emulator->source = DFPLAYER_DEVICE_TFCARD;
+	if(!(emulator->devices_online & DFPLAYER_DEVICE_TFCARD))
+		emulator->source = (emulator->devices_online & DFPLAYER_DEVICE_UDISK) ? DFPLAYER_DEVICE_UDISK
+			: DFPLAYER_DEVICE_FLASH;
+
+	/* Nothing else leaves the device until it's done starting up */
+	if(emulator->line_free < due)
+		emulator->line_free = due;
+	online = emulator->devices_online;
+	emulator_Send(emulator, DFPLAYER_CMD_INITIALIZE, online >> 8, online & 0xFF);
+}
+
+static void emulator_HandleMessage(dfplayer_emulator_t *emulator)
+{
+	const uint8_t *rx = emulator->rx;
+	uint16_t checksum = ((uint16_t) rx[7] << 8) | rx[8];
+
+	++(emulator->stats.received);
+
+	if(checksum != DFPLAYER_CHECKSUM(rx[3], rx[4], rx[5], rx[6]))
+	{
+		++(emulator->stats.checksum_errors);
+		emulator_Send(emulator, DFPLAYER_CMD_ERROR_REPORT, 0, DFPLAYER_ERROR_VERIFICATION_ERROR);
+		return;
+	}
+
+	if(emulator_Chance(emulator, emulator->config.drop_rate))
+	{
+		++(emulator->stats.dropped);
+		return;
+	}
+
+	if(emulator_Chance(emulator, emulator->config.busy_rate))
+	{
+		emulator_Send(emulator, DFPLAYER_CMD_ERROR_REPORT, 0, DFPLAYER_ERROR_BUSY);
+		return;
+	}
+
+	if(rx[4])
+		emulator_Send(emulator, DFPLAYER_CMD_REPLY, 0, 0);
+	emulator_HandleCommand(emulator, rx[3], ((uint16_t) rx[5] << 8) | rx[6]);
+}
+
+static void emulator_HandleCommand(dfplayer_emulator_t *emulator, uint8_t command, uint16_t value)
+{
+	int source = emulator_DeviceIndex(emulator->source);
+	uint16_t files = emulator->config.file_count;
+	uint16_t answer;
+
+	switch(command)
+	{
+		case DFPLAYER_CMD_NEXT_TRACK:
+			emulator_StartTrack(emulator, (emulator->track[source] >= files) ? 1 : emulator->track[source] + 1);
+			break;
+		case DFPLAYER_CMD_PREVIOUS_TRACK:
+			emulator_StartTrack(emulator, (emulator->track[source] <= 1) ? files : emulator->track[source] - 1);
+			break;
+		case DFPLAYER_CMD_SET_TRACK:
+			emulator_StartTrack(emulator, value);
+			break;
+		case DFPLAYER_CMD_VOLUME_UP:
+			if(emulator->volume < DFPLAYER_VOL_MAX)
+				++(emulator->volume);
+			break;
+		case DFPLAYER_CMD_VOLUME_DOWN:
+			if(emulator->volume > DFPLAYER_VOL_MIN)
+				--(emulator->volume);
+			break;
+		case DFPLAYER_CMD_VOLUME_SET:
+			emulator->volume = (value > DFPLAYER_VOL_MAX) ? DFPLAYER_VOL_MAX : value;
+			break;
+		case DFPLAYER_CMD_SET_EQUALIZER:
+			emulator->equalizer = value & 0xFF;
+			break;
+		case DFPLAYER_CMD_SET_PLAYBACK_MODE:
+			emulator->playback_mode = value & 0xFF;
+			break;
+		case DFPLAYER_CMD_SET_PLAYBACK_SOURCE:
+			if(emulator_DeviceIndex(value) >= 0)
+			{
+				emulator_StopTrack(emulator);
+				emulator->source = value;
+			}
+			break;
+		case DFPLAYER_CMD_POWER_MODE_STANDBY:
+			emulator_StopTrack(emulator);
+			emulator->standby = true;
+			break;
+		case DFPLAYER_CMD_POWER_MODE_NORMAL:
+			emulator->standby = false;
+			break;
+		case DFPLAYER_CMD_RESET:
+			emulator_PowerOn(emulator);
+			break;
+		case DFPLAYER_CMD_PLAY:
+			if(!emulator->playing && emulator->track_remaining > 0 && emulator->config.track_length > 0)
+			{
+				emulator->playing = true;
+				emulator->track_end = emulator->now + emulator->track_remaining;
+			}
+			else if(!emulator->playing)
+				emulator_StartTrack(emulator, emulator->track[source]);
+			break;
+		case DFPLAYER_CMD_PAUSE:
+			if(emulator->playing && emulator->track_end != DFPLAYER_EMULATOR_NEVER)
+				emulator->track_remaining = emulator->track_end - emulator->now;
+			emulator->playing = false;
+			emulator->track_end = DFPLAYER_EMULATOR_NEVER;
+			break;
+		case DFPLAYER_CMD_SET_FOLDER:
+			emulator->folder = value & 0xFF;
+			break;
+		case DFPLAYER_CMD_VOLUME_ADJUST:
+			emulator->volume = ((value & 0xFF) > DFPLAYER_VOL_MAX) ? DFPLAYER_VOL_MAX : (value & 0xFF);
+			break;
+		case DFPLAYER_CMD_REPEAT:
+			emulator->repeat = (value & 0xFF) ? true : false;
+			break;
+
+		case DFPLAYER_CMD_QUERY_STATUS:
+			emulator_Send(emulator, command, (emulator->playing) ? 1 : 0, emulator->source & 0xFF);
+			break;
+		case DFPLAYER_CMD_QUERY_VOLUME:
+			emulator_Send(emulator, command, 0, emulator->volume);
+			break;
+		case DFPLAYER_CMD_QUERY_EQUALIZER:
+			emulator_Send(emulator, command, emulator->equalizer, 0);
+			break;
+		case DFPLAYER_CMD_QUERY_PLAYBACK_MODE:
+			emulator_Send(emulator, command, emulator->playback_mode, 0);
+			break;
+		case DFPLAYER_CMD_QUERY_VERSION:
+			emulator_Send(emulator, command, 0, EMULATOR_VERSION);
+			break;
+		case DFPLAYER_CMD_QUERY_TFCARD_FILES:
+		case DFPLAYER_CMD_QUERY_UDISK_FILES:
+		case DFPLAYER_CMD_QUERY_FLASH_FILES:
+			answer = (emulator->devices_online & (DFPLAYER_CMD_QUERY_TFCARD_FILES == command ? DFPLAYER_DEVICE_TFCARD
+				: DFPLAYER_CMD_QUERY_UDISK_FILES == command ? DFPLAYER_DEVICE_UDISK : DFPLAYER_DEVICE_FLASH)) ? files : 0;
+			emulator_Send(emulator, command, answer >> 8, answer & 0xFF);
+			break;
+		case DFPLAYER_CMD_QUERY_TFCARD_TRACK:
+		case DFPLAYER_CMD_QUERY_UDISK_TRACK:
+		case DFPLAYER_CMD_QUERY_FLASH_TRACK:
+			answer = emulator->track[emulator_DeviceIndex(DFPLAYER_CMD_QUERY_TFCARD_TRACK == command ? DFPLAYER_DEVICE_TFCARD
+				: DFPLAYER_CMD_QUERY_UDISK_TRACK == command ? DFPLAYER_DEVICE_UDISK : DFPLAYER_DEVICE_FLASH)];
+			emulator_Send(emulator, command, answer >> 8, answer & 0xFF);
+			break;
+
+		default:
+			emulator_Send(emulator, DFPLAYER_CMD_ERROR_REPORT, 0, DFPLAYER_ERROR_FRAME_DATA_NOT_RECEIVED);
+			break;
+	}
+}
+
+static void emulator_StartTrack(dfplayer_emulator_t *emulator, uint16_t track)
+{
+	if(emulator->standby || !(emulator->devices_online & emulator->source) || 0 == track
+	|| track > emulator->config.file_count)
+	{
+		emulator_Send(emulator, DFPLAYER_CMD_ERROR_REPORT, 0, DFPLAYER_ERROR_BUSY);
+		return;
+	}
+
+	emulator->track[emulator_DeviceIndex(emulator->source)] = track;
+	emulator->playing = true;
+	emulator->track_remaining = 0;
+	emulator->track_end = (emulator->config.track_length > 0) ? emulator->now + emulator->config.track_length
+		: DFPLAYER_EMULATOR_NEVER;
+}
+
+static void emulator_StopTrack(dfplayer_emulator_t *emulator)
+{
+	emulator->playing = false;
+	emulator->track_end = DFPLAYER_EMULATOR_NEVER;
+	emulator->track_remaining = 0;
+}
+
+static void emulator_TrackFinished(dfplayer_emulator_t *emulator)
+{
+	uint16_t command = emulator_FinishCommand(emulator->source);
+	uint16_t track = emulator->track[emulator_DeviceIndex(emulator->source)];
+
+	emulator_StopTrack(emulator);
+	emulator_Send(emulator, command, track >> 8, track & 0xFF);
+	if(emulator_Chance(emulator, emulator->config.duplicate_rate))
+		emulator_Send(emulator, command, track >> 8, track & 0xFF);
+
+	if(DFPLAYER_PLAY_MODE_SINGLE_REPEAT == emulator->playback_mode)
+		emulator_StartTrack(emulator, track);
+	else if(emulator->repeat)
+		emulator_StartTrack(emulator, (track >= emulator->config.file_count) ? 1 : track + 1);
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Transmission
+ */
+
+/* Queues a message behind everything already on its way; it's due once its last byte has left
+ * the wire */
+static void emulator_Send(dfplayer_emulator_t *emulator, uint8_t command, uint8_t parameter1, uint8_t parameter2)
+{
+	dfplayer_emulator_config_t *config = &emulator->config;
+	uint16_t checksum = DFPLAYER_CHECKSUM(command, 0, parameter1, parameter2);
+	emulator_frame_t *frame;
+	uint64_t start;
+	uint8_t *data;
+
+	if(EMULATOR_TX_QUEUE_LENGTH == emulator->tx_count)
+	{
+		++(emulator->stats.overflows);
+		return;
+	}
+	frame = &emulator->tx[(emulator->tx_head + emulator->tx_count) % EMULATOR_TX_QUEUE_LENGTH];
+	++(emulator->tx_count);
+
+	frame->length = 0;
+	if(emulator_Chance(emulator, config->noise_rate))
+		frame->data[frame->length++] = emulator_Random(emulator) & 0xFF;
+	data = &frame->data[frame->length];
+	data[0] = DFPLAYER_MSG_START;
+	data[1] = DFPLAYER_MSG_VERSION;
+	data[2] = DFPLAYER_MSG_DATA_LENGTH;
+	data[3] = command;
+	data[4] = 0;
+	data[5] = parameter1;
+	data[6] = parameter2;
+	data[7] = checksum >> 8;
+	data[8] = checksum & 0xFF;
+	data[9] = DFPLAYER_MSG_END;
+	frame->length += DFPLAYER_MSG_LENGTH;
+	if(emulator_Chance(emulator, config->corrupt_rate))
+		data[1 + emulator_Random(emulator) % (DFPLAYER_MSG_LENGTH - 1)] ^= 1 << (emulator_Random(emulator) % 8);
+
+	start = emulator->now + config->latency;
+	if(config->jitter > 0)
+		start += emulator_Random(emulator) % config->jitter;
+	if(start < emulator->line_free)
+		start = emulator->line_free;
+	/* Ten bits per byte: start, eight data bits and stop */
+	frame->due = start + ((config->baud > 0) ? (uint64_t) frame->length * 10 * 1000000 / config->baud : 0);
+	emulator->line_free = frame->due;
+}
+
+static int emulator_DeviceIndex(uint16_t device)
+{
+	switch(device)
+	{
+		case DFPLAYER_DEVICE_UDISK: return 0;
+		case DFPLAYER_DEVICE_TFCARD: return 1;
+		case DFPLAYER_DEVICE_FLASH: return 2;
+		default: return -1;
+	}
+}
+
+static uint16_t emulator_FinishCommand(uint16_t device)
+{
+	switch(device)
+	{
+		case DFPLAYER_DEVICE_UDISK: return DFPLAYER_CMD_UDISK_FINISH;
+		case DFPLAYER_DEVICE_FLASH: return DFPLAYER_CMD_FLASH_FINISH;
+		default: return DFPLAYER_CMD_TFCARD_FINISH;
+	}
+}
+
+static bool emulator_Chance(dfplayer_emulator_t *emulator, uint32_t rate)
+{
+	return (rate > 0 && emulator_Random(emulator) % 1000000 < rate);
+}
+
+/* xorshift32; every emulator has its own repeatable sequence */
+static uint32_t emulator_Random(dfplayer_emulator_t *emulator)
+{
+	uint32_t x = emulator->random;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	emulator->random = x;
+	return x;
+}
@@ -0,0 +1,85 @@
+/* \file dfplayer_emulator.h
+ * \brief Software model of a dfplayer mini module, for testing and benchmarking without hardware
+ *
+ * The emulator has no clock of its own. Time only moves when dfplayer_EmulatorAdvance() is called,
+ * so a driver can run it against the wall clock (e.g. behind a pseudo-terminal) or step a virtual
+ * clock straight to dfplayer_EmulatorNextEvent() and run thousands of devices in one process.
+ */
+#ifndef _DFPLAYER_EMULATOR_H
+#define _DFPLAYER_EMULATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dfplayer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DFPLAYER_EMULATOR_NEVER    UINT64_MAX
+
+/* Called with the bytes the device sends, at the time the last of them leaves the wire */
+typedef int (*pfn_dfplayer_EmulatorTransmit)(void *token, const uint8_t *data, uint32_t bytes);
+
+typedef struct dfplayer_emulator_config_s
+{
+	pfn_dfplayer_EmulatorTransmit pfnTransmit;
+	void *token;
+
+	/* Timing; all times are in microseconds */
+	uint32_t baud;           /* line speed for pacing transmitted messages, 0 for no wire time */
+	uint32_t latency;        /* from receiving a command to starting the answer */
+	uint32_t jitter;         /* random extra latency, up to this much */
+	uint32_t reset_time;     /* from power-on or reset to the initialization message */
+	uint32_t track_length;   /* playing time of every track, 0 for tracks that never finish */
+
+	/* Media */
+	uint16_t devices_online; /* DFPLAYER_DEVICE_ flags */
+	uint16_t file_count;     /* files on each online device */
+
+	/* Fault injection; rates are per million messages */
+	uint32_t seed;
+	uint32_t drop_rate;      /* received commands ignored */
+	uint32_t busy_rate;      /* commands answered with DFPLAYER_ERROR_BUSY */
+	uint32_t corrupt_rate;   /* transmitted messages with one bit flipped */
+	uint32_t noise_rate;     /* transmitted messages preceded by a random byte */
+	uint32_t duplicate_rate; /* track finished messages sent twice, as some modules do */
+} dfplayer_emulator_config_t;
+
+typedef struct dfplayer_emulator_stats_s
+{
+	uint32_t received;         /* complete messages received */
+	uint32_t checksum_errors;  /* received messages with a bad checksum */
+	uint32_t dropped;          /* received messages ignored by fault injection */
+	uint32_t transmitted;      /* messages sent */
+	uint32_t overflows;        /* messages lost because the transmit queue was full */
+} dfplayer_emulator_stats_t;
+
+typedef struct dfplayer_emulator_s dfplayer_emulator_t;
+
+/* Creates a powered-on device; its initialization message follows after config->reset_time */
+dfplayer_emulator_t *dfplayer_EmulatorCreate(const dfplayer_emulator_config_t *config, uint64_t now);
+void dfplayer_EmulatorDestroy(dfplayer_emulator_t *emulator);
+
+/* Bytes received from the host at the current emulator time */
+void dfplayer_EmulatorReceive(dfplayer_emulator_t *emulator, const uint8_t *data, size_t length);
+
+/* Moves the emulator's clock forward to now, transmitting everything that became due */
+void dfplayer_EmulatorAdvance(dfplayer_emulator_t *emulator, uint64_t now);
+
+/* Time of the next transmission or track end, DFPLAYER_EMULATOR_NEVER if nothing is scheduled */
+uint64_t dfplayer_EmulatorNextEvent(dfplayer_emulator_t *emulator);
+
+/* Events a real module reports on its own */
+void dfplayer_EmulatorSetDevice(dfplayer_emulator_t *emulator, uint16_t device, bool inserted);
+void dfplayer_EmulatorFinishTrack(dfplayer_emulator_t *emulator);
+void dfplayer_EmulatorReportError(dfplayer_emulator_t *emulator, dfplayerError_e error);
+
+void dfplayer_EmulatorGetStats(dfplayer_emulator_t *emulator, dfplayer_emulator_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DFPLAYER_EMULATOR_H */
@@ -0,0 +1,229 @@
+/* \file emulator.c
+ * \brief Emulates dfplayer mini modules behind Linux pseudo-terminals
+ *
+ * Each emulated module gets its own pseudo-terminal; point an application (e.g. the Linux example)
+ * at the printed device names. Events can be injected from standard input:
+ *   insert <udisk|tfcard|flash>, remove <udisk|tfcard|flash>, finish, error <code>
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include "dfplayer_emulator.h"
+
+#define EMULATOR_MAX_DEVICES   64
+#define EMULATOR_READ_LENGTH   256
+
+typedef struct emulator_port_s
+{
+	int master_fd;
+	int slave_fd; /* kept open so the port survives the application closing it */
+	dfplayer_emulator_t *emulator;
+} emulator_port_t;
+
+static int OpenPort(emulator_port_t *port, dfplayer_emulator_config_t *config, uint64_t now);
+static int HandleTransmit(void *token, const uint8_t *data, uint32_t bytes);
+static void HandleConsole(emulator_port_t *ports, int count);
+static uint16_t ParseDevice(const char *name);
+static uint64_t GetTimeUs(void);
+
+int main(int argc, char *argv[])
+{
+	emulator_port_t ports[EMULATOR_MAX_DEVICES];
+	struct pollfd fds[EMULATOR_MAX_DEVICES + 1];
+	dfplayer_emulator_config_t config;
+	uint8_t data[EMULATOR_READ_LENGTH];
+	int count = 1;
+	int option;
+	int idx;
+
+	memset(&config, 0, sizeof(config));
+	config.pfnTransmit = HandleTransmit;
+	config.baud = 9600;
+	config.latency = 20000;
+	config.reset_time = 500000;
+	config.track_length = 10000000;
+	config.devices_online = DFPLAYER_DEVICE_TFCARD;
+	config.file_count = 10;
+
+	while((option = getopt(argc, argv, "n:b:l:j:t:f:s:d:e:c:x:u:")) != -1)
+	{
+		switch(option)
+		{
+			case 'n': count = atoi(optarg); break;
+			case 'b': config.baud = strtoul(optarg, NULL, 0); break;
+			case 'l': config.latency = strtoul(optarg, NULL, 0) * 1000; break;
+			case 'j': config.jitter = strtoul(optarg, NULL, 0) * 1000; break;
+			case 't': config.track_length = strtoul(optarg, NULL, 0) * 1000; break;
+			case 'f': config.file_count = strtoul(optarg, NULL, 0); break;
+			case 's': config.seed = strtoul(optarg, NULL, 0); break;
+			case 'd': config.drop_rate = strtoul(optarg, NULL, 0); break;
+			case 'e': config.busy_rate = strtoul(optarg, NULL, 0); break;
+			case 'c': config.corrupt_rate = strtoul(optarg, NULL, 0); break;
+			case 'x': config.noise_rate = strtoul(optarg, NULL, 0); break;
+			case 'u': config.duplicate_rate = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "%s [-n devices] [-b baud] [-l latency ms] [-j jitter ms] [-t track ms]\n"
+					"  [-f files] [-s seed] [-d drop] [-e busy] [-c corrupt] [-x noise] [-u duplicate]\n"
+					"Fault rates are per million messages\n", argv[0]);
+				return -1;
+		}
+	}
+
+	if(count < 1 || count > EMULATOR_MAX_DEVICES)
+	{
+		fprintf(stderr, "Between 1 and %d devices can be emulated\n", EMULATOR_MAX_DEVICES);
+		return -1;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for(idx = 0; idx < count; ++idx)
+	{
+		config.token = &ports[idx];
+		config.seed += idx;
+		if(OpenPort(&ports[idx], &config, GetTimeUs()) != 0)
+			return -1;
+		fds[idx].fd = ports[idx].master_fd;
+		fds[idx].events = POLLIN;
+	}
+	fds[count].fd = STDIN_FILENO;
+	fds[count].events = POLLIN;
+
+	for(;;)
+	{
+		uint64_t now = GetTimeUs();
+		uint64_t next = DFPLAYER_EMULATOR_NEVER;
+		int timeout;
+
+		for(idx = 0; idx < count; ++idx)
+		{
+			uint64_t event = dfplayer_EmulatorNextEvent(ports[idx].emulator);
+			if(event < next)
+				next = event;
+		}
+		timeout = (DFPLAYER_EMULATOR_NEVER == next) ? -1 : (next <= now) ? 0 : (int) ((next - now + 999) / 1000);
+
+		if(poll(fds, count + 1, timeout) < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "poll failed: %d (%s)\n", errno, strerror(errno));
+			break;
+		}
+
+		now = GetTimeUs();
+		for(idx = 0; idx < count; ++idx)
+		{
+			dfplayer_EmulatorAdvance(ports[idx].emulator, now);
+			if(fds[idx].revents & POLLIN)
+			{
+				ssize_t result = read(ports[idx].master_fd, data, sizeof(data));
+				if(result > 0)
+					dfplayer_EmulatorReceive(ports[idx].emulator, data, result);
+			}
+		}
+
+		if(fds[count].revents & (POLLIN | POLLHUP))
+		{
+			fds[count].fd = -1; /* until console input is known to be usable */
+			HandleConsole(ports, count);
+			if(!feof(stdin))
+				fds[count].fd = STDIN_FILENO;
+		}
+	}
+
+	for(idx = 0; idx < count; ++idx)
+		dfplayer_EmulatorDestroy(ports[idx].emulator);
+
+	return 0;
+}
+
+static int OpenPort(emulator_port_t *port, dfplayer_emulator_config_t *config, uint64_t now)
+{
+	struct termios tty;
+	const char *name;
+
+	port->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(port->master_fd < 0 || grantpt(port->master_fd) != 0 || unlockpt(port->master_fd) != 0)
+	{
+		fprintf(stderr, "Failed to create pseudo-terminal: %d (%s)\n", errno, strerror(errno));
+		return -1;
+	}
+
+	name = ptsname(port->master_fd);
+	port->slave_fd = open(name, O_RDWR | O_NOCTTY);
+	if(port->slave_fd < 0 || tcgetattr(port->slave_fd, &tty) != 0)
+	{
+		fprintf(stderr, "Failed to open '%s': %d (%s)\n", name, errno, strerror(errno));
+		return -1;
+	}
+	cfmakeraw(&tty);
+	tcsetattr(port->slave_fd, TCSANOW, &tty);
+
+	port->emulator = dfplayer_EmulatorCreate(config, now);
+	if(NULL == port->emulator)
+		return -1;
+
+	printf("%s\n", name);
+	return 0;
+}
+
+static int HandleTransmit(void *token, const uint8_t *data, uint32_t bytes)
+{
+	emulator_port_t *port = (emulator_port_t *) token;
+
+	return (write(port->master_fd, data, bytes) == (ssize_t) bytes) ? 0 : -1;
+}
+
+static void HandleConsole(emulator_port_t *ports, int count)
+{
+	char line[64];
+	char name[16];
+	unsigned int code;
+	uint16_t device;
+	int idx;
+
+	if(NULL == fgets(line, sizeof(line), stdin))
+		return;
+
+	for(idx = 0; idx < count; ++idx)
+	{
+		dfplayer_emulator_t *emulator = ports[idx].emulator;
+
+		if(sscanf(line, "insert %15s", name) == 1 && (device = ParseDevice(name)) != 0)
+			dfplayer_EmulatorSetDevice(emulator, device, true);
+		else if(sscanf(line, "remove %15s", name) == 1 && (device = ParseDevice(name)) != 0)
+			dfplayer_EmulatorSetDevice(emulator, device, false);
+		else if(strncmp(line, "finish", 6) == 0)
+			dfplayer_EmulatorFinishTrack(emulator);
+		else if(sscanf(line, "error %u", &code) == 1)
+			dfplayer_EmulatorReportError(emulator, (dfplayerError_e) code);
+		else
+		{
+			fprintf(stderr, "Unknown command: %s", line);
+			break;
+		}
+	}
+}
+
+static uint16_t ParseDevice(const char *name)
+{
+	if(strcmp(name, "udisk") == 0) return DFPLAYER_DEVICE_UDISK;
+	if(strcmp(name, "tfcard") == 0) return DFPLAYER_DEVICE_TFCARD;
+	if(strcmp(name, "flash") == 0) return DFPLAYER_DEVICE_FLASH;
+	return 0;
+}
+
+static uint64_t GetTimeUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
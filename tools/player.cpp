@@ -0,0 +1,112 @@
+/* \file player.cpp
+ * \brief Plays tracks on the emulator through the C++ wrapper, dfplayer::Player
+ *
+ * The emulator runs on a virtual clock, stepped straight to its next event, so a session that
+ * takes minutes on a real module finishes at once. Builds as C++11, the oldest standard the
+ * wrapper supports.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "dfplayer.hpp"
+#include "dfplayer_emulator.h"
+
+class Speaker : public dfplayer::Player<Speaker>
+{
+public:
+	Speaker() : emulator(nullptr), finished(0), errors(0) {}
+
+	int Send(const uint8_t *data, uint32_t bytes)
+	{
+		dfplayer_EmulatorReceive(emulator, data, bytes);
+		return 0;
+	}
+
+	void OnInitialize(uint16_t devices_online)
+	{
+		printf("initialized, devices 0x%04x\n", devices_online);
+	}
+
+	void OnTrackFinished(uint16_t track, dfplayer::Device device)
+	{
+		printf("track %u finished on device 0x%04x\n", track, static_cast<unsigned>(device));
+		++finished;
+	}
+
+	void OnError(dfplayer::Error error)
+	{
+		printf("error %u\n", static_cast<unsigned>(error));
+		++errors;
+	}
+
+	dfplayer_emulator_t *emulator;
+	uint32_t finished;
+	uint32_t errors;
+};
+
+static int Player_Transmit(void *token, const uint8_t *data, uint32_t bytes)
+{
+	static_cast<Speaker *>(token)->Receive(data, bytes);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	dfplayer_emulator_config_t config = dfplayer_emulator_config_t();
+	dfplayer::Settings settings = dfplayer::Settings();
+	Speaker speaker;
+	uint32_t tracks = 3;
+	uint64_t now = 0;
+	int option;
+
+	while((option = getopt(argc, argv, "n:")) != -1)
+	{
+		switch(option)
+		{
+			case 'n': tracks = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "%s [-n tracks]\n", argv[0]);
+				return -1;
+		}
+	}
+
+	config.pfnTransmit = Player_Transmit;
+	config.token = &speaker;
+	config.baud = 9600;
+	config.latency = 20000;
+	config.reset_time = 500000;
+	config.track_length = 3000000;
+	config.devices_online = DFPLAYER_DEVICE_TFCARD;
+	config.file_count = 10;
+	speaker.emulator = dfplayer_EmulatorCreate(&config, now);
+
+	settings.tx_window = 1;
+	settings.tx_retries = 2;
+	settings.tx_timeout = 200; /* milliseconds */
+	if(NULL == speaker.emulator || !speaker.Initialize(settings))
+	{
+		fprintf(stderr, "Failed to start\n");
+		return -1;
+	}
+
+	speaker.SetPlaybackSource(dfplayer::Device::TfCard);
+	speaker.SetVolume(20);
+	speaker.SetTrack(1);
+	while(speaker.finished < tracks && now < 3600000000ull)
+	{
+		uint64_t next = dfplayer_EmulatorNextEvent(speaker.emulator);
+		uint64_t tick = (now / 10000 + 1) * 10000; /* Tick every 10 ms */
+		uint32_t finished = speaker.finished;
+
+		now = (next < tick) ? next : tick;
+		dfplayer_EmulatorAdvance(speaker.emulator, now);
+		speaker.Tick(static_cast<uint32_t>(now / 1000));
+		if(speaker.finished != finished && speaker.finished < tracks)
+			speaker.NextTrack();
+	}
+
+	printf("%u tracks in %.1f s, %u errors, %u commands timed out\n", speaker.finished, now / 1e6, speaker.errors,
+		speaker.Stats().commands_completed[DFPLAYER_COMMAND_TIMEOUT]);
+	dfplayer_EmulatorDestroy(speaker.emulator);
+	return (speaker.finished == tracks) ? 0 : -1;
+}
@@ -0,0 +1,711 @@
+/* \file replay.c
+ * \brief Replays captured serial sessions through the library and checks its behavior
+ *
+ * The received bytes, dfplayer_Tick calls and command function calls of a capture are fed to a
+ * fresh context in their original order, either as fast as possible or with the original timing.
+ * The bytes the library sends and the handler callbacks it makes are compared with the ones
+ * recorded, so a capture of a hard-to-reproduce session becomes a regression test, and replaying
+ * it at memory speed measures parser throughput on realistic traffic.
+ *
+ * Captures can also be generated against the emulator on a virtual clock (-g).
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dfplayer.h"
+#include "dfplayer_capture.h"
+#include "dfplayer_emulator.h"
+
+#define REPLAY_TICK_INTERVAL     10000 /* microseconds between dfplayer_Tick calls when generating */
+#define REPLAY_COMMAND_INTERVAL  200000 /* mean microseconds between generated commands */
+#define REPLAY_DRAIN_TIME        2000000 /* microseconds recorded after the last command */
+
+typedef struct replay_options_s
+{
+	bool per_char;         /* feed received bytes through dfplayer_HandleSerialChar */
+	bool real_time;        /* keep the capture's timing */
+	bool print;            /* list the records instead of replaying */
+	uint32_t repeat;
+	uint32_t commands;     /* generated commands */
+	uint32_t seed;
+	uint32_t fault_rate;   /* per million messages, for each of the emulator's faults */
+} replay_options_t;
+
+typedef struct replay_buffer_s
+{
+	uint8_t *data;
+	size_t length;
+	size_t size;
+} replay_buffer_t;
+
+/* State shared with the library's and emulator's callbacks */
+typedef struct replay_session_s
+{
+	void *dfplayer;
+	FILE *capture;         /* when generating */
+	replay_buffer_t tx;    /* sent by the library */
+	replay_buffer_t events; /* dfplayer_capture_event_t records of the handlers called */
+
+	/* Generating */
+	dfplayer_emulator_t *emulator;
+	uint64_t now;          /* virtual clock, microseconds */
+	uint32_t wire_time;    /* microseconds per transmitted message */
+	uint8_t pending[DFPLAYER_FRAME_LENGTH * 8]; /* host output on the wire */
+	uint32_t pending_length;
+	uint64_t pending_due;
+} replay_session_t;
+
+#define REPLAY_COMMAND_NAME(name, code, group, priority, parameter_max, decoder, argument) [code] = #name,
+static const char * const replay_command_names[DFPLAYER_CMD_COUNT] =
+{
+	DFPLAYER_COMMANDS(REPLAY_COMMAND_NAME)
+};
+#undef REPLAY_COMMAND_NAME
+
+static const char * const replay_event_names[] =
+{
+	"INITIALIZE", "TRACK_FINISHED", "DEVICE_STATE", "ERROR", "REPLY", "STATUS", "VOLUME", "EQUALIZER",
+	"PLAYBACK_MODE", "FILE_COUNT", "CURRENT_TRACK", "COMMAND_COMPLETE"
+};
+
+static int Replay(const char *path, replay_options_t *options);
+static int Replay_Print(const char *path);
+static int Replay_Generate(const char *path, replay_options_t *options);
+static bool Replay_Compare(const char *what, replay_buffer_t *expected, replay_buffer_t *actual, size_t unit);
+static void Replay_Wait(struct timespec *start, uint64_t offset);
+static const char *Replay_CommandName(uint8_t command);
+static int Replay_Append(replay_buffer_t *buffer, const void *data, size_t length);
+static void Replay_Call(replay_session_t *session, uint8_t command, uint16_t parameter);
+static void *Replay_CreateContext(replay_session_t *session, const dfplayer_capture_file_t *header);
+static void Replay_Event(void *token, uint8_t event, uint8_t command, uint16_t value1, uint16_t value2);
+static int Replay_SendSerial(void *context, void *token, uint8_t *data, uint32_t bytes);
+static int Replay_EmulatorTransmit(void *token, const uint8_t *data, uint32_t bytes);
+static void Replay_HandleInitialize(void *context, void *token, uint16_t devices_online);
+static void Replay_HandleTrackFinished(void *context, void *token, uint16_t track_number, uint16_t device);
+static void Replay_HandleDeviceState(void *context, void *token, uint16_t device, bool inserted);
+static void Replay_HandleError(void *context, void *token, dfplayerError_e error);
+static void Replay_HandleReply(void *context, void *token);
+static void Replay_HandleStatusResponse(void *context, void *token, bool playing);
+static void Replay_HandleVolumeResponse(void *context, void *token, uint8_t volume);
+static void Replay_HandleEqualizerResponse(void *context, void *token, dfplayerEqualizer_e mode);
+static void Replay_HandlePlaybackModeResponse(void *context, void *token, dfplayerPlaybackMode_e mode);
+static void Replay_HandleFileCountResponse(void *context, void *token, uint16_t device, uint16_t file_count);
+static void Replay_HandleCurrentTrackResponse(void *context, void *token, uint16_t device, uint16_t track);
+static void Replay_HandleCommandComplete(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result);
+static uint32_t Random(uint32_t *state);
+static double GetTimeSeconds(void);
+
+int main(int argc, char *argv[])
+{
+	replay_options_t options;
+	const char *generate = NULL;
+	int result = 0;
+	int option;
+	int idx;
+
+	memset(&options, 0, sizeof(options));
+	options.repeat = 1;
+	options.commands = 1000;
+	options.seed = 1;
+
+	while((option = getopt(argc, argv, "crpn:g:m:s:f:")) != -1)
+	{
+		switch(option)
+		{
+			case 'c': options.per_char = true; break;
+			case 'r': options.real_time = true; break;
+			case 'p': options.print = true; break;
+			case 'n': options.repeat = strtoul(optarg, NULL, 0); break;
+			case 'g': generate = optarg; break;
+			case 'm': options.commands = strtoul(optarg, NULL, 0); break;
+			case 's': options.seed = strtoul(optarg, NULL, 0); break;
+			case 'f': options.fault_rate = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "%s [-c] [-r] [-n repeat] capture [capture...]\n"
+					"  -c feeds bytes one at a time, -r keeps the original timing\n"
+					"%s -p capture [capture...]\n"
+					"  lists the records\n"
+					"%s -g capture [-m commands] [-s seed] [-f fault rate]\n"
+					"  records a session with the emulator; the fault rate is per million messages\n",
+					argv[0], argv[0], argv[0]);
+				return -1;
+		}
+	}
+
+	if(generate != NULL)
+		return Replay_Generate(generate, &options);
+
+	if(optind >= argc)
+	{
+		fprintf(stderr, "No captures given\n");
+		return -1;
+	}
+
+	for(idx = optind; idx < argc; ++idx)
+	{
+		if(((options.print) ? Replay_Print(argv[idx]) : Replay(argv[idx], &options)) != 0)
+			result = -1;
+	}
+
+	return result;
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Replaying
+ */
+
+static int Replay(const char *path, replay_options_t *options)
+{
+	dfplayer_capture_t capture;
+	replay_buffer_t expected_tx, expected_events;
+	replay_session_t session;
+	dfplayer_stats_t stats;
+	uint64_t rx_bytes = 0, frames = 0;
+	uint32_t rejected = 0;
+	double elapsed = 0;
+	bool passed = true;
+	uint32_t iteration;
+
+	if(dfplayer_CaptureLoad(&capture, path) != 0)
+	{
+		fprintf(stderr, "'%s' isn't a dfplayer capture file\n", path);
+		return -1;
+	}
+
+	memset(&expected_tx, 0, sizeof(expected_tx));
+	memset(&expected_events, 0, sizeof(expected_events));
+	memset(&session, 0, sizeof(session));
+
+	for(iteration = 0; iteration < options->repeat; ++iteration)
+	{
+		dfplayer_capture_record_t record;
+		const uint8_t *data;
+		struct timespec start;
+		uint32_t first = 0;
+		size_t offset = 0;
+		size_t records = 0;
+		size_t idx;
+		double begin;
+
+		session.tx.length = 0;
+		session.events.length = 0;
+		session.dfplayer = Replay_CreateContext(&session, &capture.header);
+		if(NULL == session.dfplayer)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		begin = GetTimeSeconds();
+		while(dfplayer_CaptureNext(&capture, &offset, &record, &data) == 0)
+		{
+			if(0 == records++)
+				first = record.timestamp;
+			if(options->real_time)
+				Replay_Wait(&start, (uint64_t) (uint32_t) (record.timestamp - first) * capture.header.resolution);
+
+			switch(record.type)
+			{
+				case DFPLAYER_CAPTURE_RX:
+					if(options->per_char)
+					{
+						for(idx = 0; idx < record.length; ++idx)
+							dfplayer_HandleSerialChar(session.dfplayer, data[idx]);
+					}
+					else
+						dfplayer_HandleSerialBuffer(session.dfplayer, data, record.length);
+					(void) dfplayer_DispatchEvents(session.dfplayer);
+					rx_bytes += record.length;
+					break;
+				case DFPLAYER_CAPTURE_TICK:
+				{
+					uint32_t now;
+					memcpy(&now, data, sizeof(now));
+					dfplayer_Tick(session.dfplayer, now);
+					break;
+				}
+				case DFPLAYER_CAPTURE_CALL:
+				{
+					dfplayer_capture_call_t call;
+					memcpy(&call, data, sizeof(call));
+					if((dfplayer_CaptureIssue(session.dfplayer, call.command, call.parameter) != 0) != (call.rejected != 0))
+						++rejected;
+					break;
+				}
+				case DFPLAYER_CAPTURE_TX:
+					if(0 == iteration)
+						Replay_Append(&expected_tx, data, record.length);
+					break;
+				case DFPLAYER_CAPTURE_EVENT:
+					if(0 == iteration)
+						Replay_Append(&expected_events, data, record.length);
+					break;
+				default:
+					break;
+			}
+		}
+		elapsed += GetTimeSeconds() - begin;
+
+		dfplayer_GetStats(session.dfplayer, &stats);
+		frames += stats.frames_received;
+		dfplayer_Deinitialize(session.dfplayer);
+
+		if(0 == iteration)
+		{
+			passed = Replay_Compare("sent bytes", &expected_tx, &session.tx, 1);
+			passed = Replay_Compare("handler calls", &expected_events, &session.events,
+				sizeof(dfplayer_capture_event_t)) && passed;
+			if(rejected > 0)
+			{
+				printf("%s: %u command calls returned a different result than recorded\n", path, rejected);
+				passed = false;
+			}
+		}
+	}
+
+	printf("%s: %s, %llu bytes and %llu messages received in %.6f s", path, (passed) ? "PASS" : "FAIL",
+		(unsigned long long) rx_bytes, (unsigned long long) frames, elapsed);
+	if(elapsed > 0 && !options->real_time)
+		printf(" (%.1f MB/s, %.0f messages/s)", rx_bytes / elapsed / 1e6, frames / elapsed);
+	printf("\n");
+
+	free(expected_tx.data);
+	free(expected_events.data);
+	free(session.tx.data);
+	free(session.events.data);
+	dfplayer_CaptureFree(&capture);
+	return (passed) ? 0 : -1;
+}
+
+static int Replay_Print(const char *path)
+{
+	static const char * const types[] = { "RX", "TX", "TICK", "CALL", "EVENT" };
+	dfplayer_capture_t capture;
+	dfplayer_capture_record_t record;
+	const uint8_t *data;
+	uint32_t first = 0;
+	size_t offset = 0;
+	size_t records = 0;
+	size_t idx;
+
+	if(dfplayer_CaptureLoad(&capture, path) != 0)
+	{
+		fprintf(stderr, "'%s' isn't a dfplayer capture file\n", path);
+		return -1;
+	}
+
+	printf("%s: tx_window %u, tx_retries %u, tx_timeout %u, coalesce %u, tx_backoff %u, %u us per timestamp unit\n",
+		path, capture.header.tx_window, capture.header.tx_retries, capture.header.tx_timeout, capture.header.coalesce,
+		capture.header.tx_backoff, capture.header.resolution);
+
+	while(dfplayer_CaptureNext(&capture, &offset, &record, &data) == 0)
+	{
+		if(0 == records++)
+			first = record.timestamp;
+		printf("%12.3f %-5s ", (uint32_t) (record.timestamp - first) * (double) capture.header.resolution / 1000.0,
+			(record.type <= DFPLAYER_CAPTURE_EVENT) ? types[record.type] : "?");
+
+		if(DFPLAYER_CAPTURE_TICK == record.type && record.length == sizeof(uint32_t))
+		{
+			uint32_t now;
+			memcpy(&now, data, sizeof(now));
+			printf("%u", now);
+		}
+		else if(DFPLAYER_CAPTURE_CALL == record.type && record.length == sizeof(dfplayer_capture_call_t))
+		{
+			dfplayer_capture_call_t call;
+			memcpy(&call, data, sizeof(call));
+			printf("%s %u%s", Replay_CommandName(call.command), call.parameter, (call.rejected) ? " rejected" : "");
+		}
+		else if(DFPLAYER_CAPTURE_EVENT == record.type && record.length == sizeof(dfplayer_capture_event_t))
+		{
+			dfplayer_capture_event_t event;
+			memcpy(&event, data, sizeof(event));
+			printf("%s", (event.event < sizeof(replay_event_names) / sizeof(replay_event_names[0]))
+				? replay_event_names[event.event] : "?");
+			if(DFPLAYER_CAPTURE_EVENT_COMMAND_COMPLETE == event.event)
+				printf(" %s", Replay_CommandName(event.command));
+			printf(" %u %u", event.value1, event.value2);
+		}
+		else
+		{
+			for(idx = 0; idx < record.length; ++idx)
+				printf("%02x ", data[idx]);
+		}
+		printf("\n");
+	}
+
+	dfplayer_CaptureFree(&capture);
+	return 0;
+}
+
+/* Reports the first difference between what was recorded and what the replay produced */
+static bool Replay_Compare(const char *what, replay_buffer_t *expected, replay_buffer_t *actual, size_t unit)
+{
+	size_t length = (expected->length < actual->length) ? expected->length : actual->length;
+	size_t idx;
+
+	for(idx = 0; idx < length; ++idx)
+	{
+		if(expected->data[idx] != actual->data[idx])
+			break;
+	}
+	if(idx == length && expected->length == actual->length)
+		return true;
+
+	printf("%s differ at #%lu: %lu recorded, %lu replayed\n", what, (unsigned long) (idx / unit),
+		(unsigned long) (expected->length / unit), (unsigned long) (actual->length / unit));
+	return false;
+}
+
+static void Replay_Wait(struct timespec *start, uint64_t offset)
+{
+	struct timespec due;
+	uint64_t nsec = start->tv_nsec + offset * 1000;
+
+	due.tv_sec = start->tv_sec + nsec / 1000000000;
+	due.tv_nsec = nsec % 1000000000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) != 0)
+		;
+}
+
+static const char *Replay_CommandName(uint8_t command)
+{
+	const char *name = (command < DFPLAYER_CMD_COUNT) ? replay_command_names[command] : NULL;
+	return (name != NULL) ? name : "UNKNOWN";
+}
+
+static int Replay_Append(replay_buffer_t *buffer, const void *data, size_t length)
+{
+	if(buffer->length + length > buffer->size)
+	{
+		size_t size = (buffer->size > 0) ? buffer->size * 2 : 4096;
+		uint8_t *grown;
+
+		while(size < buffer->length + length)
+			size *= 2;
+		grown = (uint8_t *) realloc(buffer->data, size);
+		if(NULL == grown)
+			return -1;
+		buffer->data = grown;
+		buffer->size = size;
+	}
+
+	memcpy(&buffer->data[buffer->length], data, length);
+	buffer->length += length;
+	return 0;
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Generating
+ */
+
+/* Drives a context against the emulator on a virtual clock with random commands, recording
+ * everything. Tracks are short so that track finished messages are part of the session. */
+static int Replay_Generate(const char *path, replay_options_t *options)
+{
+	static const uint8_t commands[] =
+	{
+		DFPLAYER_CMD_PLAY, DFPLAYER_CMD_PAUSE, DFPLAYER_CMD_NEXT_TRACK, DFPLAYER_CMD_SET_TRACK,
+		DFPLAYER_CMD_VOLUME_SET, DFPLAYER_CMD_VOLUME_UP, DFPLAYER_CMD_SET_EQUALIZER, DFPLAYER_CMD_QUERY_STATUS,
+		DFPLAYER_CMD_QUERY_VOLUME, DFPLAYER_CMD_QUERY_TFCARD_FILES, DFPLAYER_CMD_QUERY_TFCARD_TRACK
+	};
+	dfplayer_emulator_config_t config;
+	dfplayer_capture_file_t header;
+	replay_session_t session;
+	uint32_t random = options->seed;
+	uint32_t issued = 0;
+	uint64_t next_command, next_tick = 0;
+	uint64_t end = (options->commands > 0) ? DFPLAYER_EMULATOR_NEVER : 0;
+
+	memset(&config, 0, sizeof(config));
+	config.pfnTransmit = Replay_EmulatorTransmit;
+	config.token = &session;
+	config.baud = 9600;
+	config.latency = 20000;
+	config.jitter = 10000;
+	config.reset_time = 500000;
+	config.track_length = 3000000;
+	config.devices_online = DFPLAYER_DEVICE_TFCARD;
+	config.file_count = 100;
+	config.seed = options->seed;
+	config.drop_rate = config.busy_rate = config.corrupt_rate = options->fault_rate;
+	config.noise_rate = config.duplicate_rate = options->fault_rate;
+
+	memset(&header, 0, sizeof(header));
+	header.tx_window = 2;
+	header.tx_retries = 2;
+	header.tx_timeout = 200; /* milliseconds */
+	header.coalesce = 1;
+
+	memset(&session, 0, sizeof(session));
+	session.wire_time = DFPLAYER_FRAME_LENGTH * 10 * 1000000 / config.baud;
+	session.dfplayer = Replay_CreateContext(&session, &header);
+	session.emulator = dfplayer_EmulatorCreate(&config, 0);
+	if(NULL == session.dfplayer || NULL == session.emulator)
+		return -1;
+
+	{
+		dfplayer_init_info_t init_info;
+
+		memset(&init_info, 0, sizeof(init_info));
+		init_info.tx_window = header.tx_window;
+		init_info.tx_retries = header.tx_retries;
+		init_info.tx_timeout = header.tx_timeout;
+		init_info.coalesce = header.coalesce;
+		init_info.tx_backoff = header.tx_backoff;
+		session.capture = dfplayer_CaptureCreate(path, &init_info, 1);
+	}
+	if(NULL == session.capture)
+	{
+		fprintf(stderr, "Failed to create '%s'\n", path);
+		return -1;
+	}
+
+	/* After the last command, run on until its answers are in */
+	next_command = config.reset_time + REPLAY_COMMAND_INTERVAL;
+	while(session.now < end)
+	{
+		uint64_t next = next_tick;
+		uint64_t event = dfplayer_EmulatorNextEvent(session.emulator);
+
+		if(event < next)
+			next = event;
+		if(session.pending_length > 0 && session.pending_due < next)
+			next = session.pending_due;
+		if(issued < options->commands && next_command < next)
+			next = next_command;
+		session.now = next;
+
+		if(session.pending_length > 0 && session.pending_due <= session.now)
+		{
+			dfplayer_EmulatorReceive(session.emulator, session.pending, session.pending_length);
+			session.pending_length = 0;
+		}
+		dfplayer_EmulatorAdvance(session.emulator, session.now);
+
+		if(issued < options->commands && next_command <= session.now)
+		{
+			uint8_t command = commands[Random(&random) % (sizeof(commands) / sizeof(commands[0]))];
+			uint16_t parameter;
+
+			switch(command)
+			{
+				case DFPLAYER_CMD_SET_TRACK: parameter = 1 + Random(&random) % config.file_count; break;
+				case DFPLAYER_CMD_VOLUME_SET: parameter = Random(&random) % (DFPLAYER_VOL_MAX + 1); break;
+				case DFPLAYER_CMD_SET_EQUALIZER: parameter = Random(&random) % (DFPLAYER_EQ_BASS + 1); break;
+				default: parameter = 0; break;
+			}
+			Replay_Call(&session, command, parameter);
+
+			next_command = session.now + Random(&random) % (2 * REPLAY_COMMAND_INTERVAL);
+			if(++issued == options->commands)
+				end = session.now + REPLAY_DRAIN_TIME;
+		}
+
+		if(next_tick <= session.now)
+		{
+			uint32_t now = (uint32_t) (session.now / 1000);
+
+			dfplayer_CaptureWrite(session.capture, (uint32_t) session.now, DFPLAYER_CAPTURE_TICK, &now, sizeof(now));
+			dfplayer_Tick(session.dfplayer, now);
+			next_tick = session.now + REPLAY_TICK_INTERVAL;
+		}
+	}
+
+	printf("%s: %u commands over %.3f virtual seconds, %lu bytes sent, %lu handler calls\n", path, issued,
+		session.now / 1e6, (unsigned long) session.tx.length,
+		(unsigned long) (session.events.length / sizeof(dfplayer_capture_event_t)));
+
+	fclose(session.capture);
+	dfplayer_EmulatorDestroy(session.emulator);
+	dfplayer_Deinitialize(session.dfplayer);
+	free(session.tx.data);
+	free(session.events.data);
+	return 0;
+}
+
+/* The CALL record goes ahead of anything the call sends, so it's written before the call and
+ * rewritten if the call fails */
+static void Replay_Call(replay_session_t *session, uint8_t command, uint16_t parameter)
+{
+	dfplayer_capture_call_t call;
+	long position = ftell(session->capture);
+	long end;
+
+	call.command = command;
+	call.rejected = 0;
+	call.parameter = parameter;
+	dfplayer_CaptureWrite(session->capture, (uint32_t) session->now, DFPLAYER_CAPTURE_CALL, &call, sizeof(call));
+	if(dfplayer_CaptureIssue(session->dfplayer, command, parameter) == 0)
+		return;
+
+	end = ftell(session->capture);
+	call.rejected = 1;
+	fseek(session->capture, position, SEEK_SET);
+	dfplayer_CaptureWrite(session->capture, (uint32_t) session->now, DFPLAYER_CAPTURE_CALL, &call, sizeof(call));
+	fseek(session->capture, end, SEEK_SET);
+}
+
+/* -------------------------------------------------------------------------------------------
+ * Callbacks
+ */
+
+/* Every handler is set, so that the capture shows every message the library decoded */
+static const dfplayer_handlers_t replay_handlers =
+{
+	.pfnHandleInitialize = Replay_HandleInitialize,
+	.pfnHandleTrackFinished = Replay_HandleTrackFinished,
+	.pfnHandleDeviceState = Replay_HandleDeviceState,
+	.pfnHandleError = Replay_HandleError,
+	.pfnHandleReply = Replay_HandleReply,
+	.pfnHandleStatusResponse = Replay_HandleStatusResponse,
+	.pfnHandleVolumeResponse = Replay_HandleVolumeResponse,
+	.pfnHandleEqualizerResponse = Replay_HandleEqualizerResponse,
+	.pfnHandlePlaybackModeResponse = Replay_HandlePlaybackModeResponse,
+	.pfnHandleFileCountResponse = Replay_HandleFileCountResponse,
+	.pfnHandleCurrentTrackResponse = Replay_HandleCurrentTrackResponse,
+	.pfnHandleCommandComplete = Replay_HandleCommandComplete
+};
+
+static void *Replay_CreateContext(replay_session_t *session, const dfplayer_capture_file_t *header)
+{
+	dfplayer_init_info_t init_info;
+
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.handlers = &replay_handlers;
+	init_info.pfnSendSerial = Replay_SendSerial;
+	init_info.tx_window = header->tx_window;
+	init_info.tx_retries = header->tx_retries;
+	init_info.tx_timeout = header->tx_timeout;
+	init_info.coalesce = (header->coalesce != 0);
+	init_info.tx_backoff = (header->tx_backoff != 0);
+
+	return dfplayer_Initialize(session, &init_info);
+}
+
+static void Replay_Event(void *token, uint8_t event, uint8_t command, uint16_t value1, uint16_t value2)
+{
+	replay_session_t *session = (replay_session_t *) token;
+	dfplayer_capture_event_t record;
+
+	record.event = event;
+	record.command = command;
+	record.value1 = value1;
+	record.value2 = value2;
+	Replay_Append(&session->events, &record, sizeof(record));
+	if(session->capture != NULL)
+		dfplayer_CaptureWrite(session->capture, (uint32_t) session->now, DFPLAYER_CAPTURE_EVENT, &record, sizeof(record));
+}
+
+/* Sent bytes reach the emulator once they've crossed the wire */
+static int Replay_SendSerial(void *context, void *token, uint8_t *data, uint32_t bytes)
+{
+	replay_session_t *session = (replay_session_t *) token;
+
+	Replay_Append(&session->tx, data, bytes);
+	if(NULL == session->capture)
+		return 0;
+
+	dfplayer_CaptureWrite(session->capture, (uint32_t) session->now, DFPLAYER_CAPTURE_TX, data, bytes);
+	if(session->pending_length + bytes > sizeof(session->pending))
+		return -1;
+	memcpy(&session->pending[session->pending_length], data, bytes);
+	session->pending_length += bytes;
+	session->pending_due = session->now + (uint64_t) session->wire_time * session->pending_length / DFPLAYER_FRAME_LENGTH;
+	return 0;
+}
+
+static int Replay_EmulatorTransmit(void *token, const uint8_t *data, uint32_t bytes)
+{
+	replay_session_t *session = (replay_session_t *) token;
+
+	dfplayer_CaptureWrite(session->capture, (uint32_t) session->now, DFPLAYER_CAPTURE_RX, data, bytes);
+	dfplayer_HandleSerialBuffer(session->dfplayer, data, bytes);
+	(void) dfplayer_DispatchEvents(session->dfplayer);
+	return 0;
+}
+
+static void Replay_HandleInitialize(void *context, void *token, uint16_t devices_online)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_INITIALIZE, 0, devices_online, 0);
+}
+
+static void Replay_HandleTrackFinished(void *context, void *token, uint16_t track_number, uint16_t device)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_TRACK_FINISHED, 0, track_number, device);
+}
+
+static void Replay_HandleDeviceState(void *context, void *token, uint16_t device, bool inserted)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_DEVICE_STATE, 0, device, inserted);
+}
+
+static void Replay_HandleError(void *context, void *token, dfplayerError_e error)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_ERROR, 0, error, 0);
+}
+
+static void Replay_HandleReply(void *context, void *token)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_REPLY, 0, 0, 0);
+}
+
+static void Replay_HandleStatusResponse(void *context, void *token, bool playing)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_STATUS, 0, playing, 0);
+}
+
+static void Replay_HandleVolumeResponse(void *context, void *token, uint8_t volume)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_VOLUME, 0, volume, 0);
+}
+
+static void Replay_HandleEqualizerResponse(void *context, void *token, dfplayerEqualizer_e mode)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_EQUALIZER, 0, mode, 0);
+}
+
+static void Replay_HandlePlaybackModeResponse(void *context, void *token, dfplayerPlaybackMode_e mode)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_PLAYBACK_MODE, 0, mode, 0);
+}
+
+static void Replay_HandleFileCountResponse(void *context, void *token, uint16_t device, uint16_t file_count)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_FILE_COUNT, 0, device, file_count);
+}
+
+static void Replay_HandleCurrentTrackResponse(void *context, void *token, uint16_t device, uint16_t track)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_CURRENT_TRACK, 0, device, track);
+}
+
+static void Replay_HandleCommandComplete(void *context, void *token, uint8_t command,
+	dfplayerCommandResult_e result)
+{
+	Replay_Event(token, DFPLAYER_CAPTURE_EVENT_COMMAND_COMPLETE, command, result, 0);
+}
+
+/* xorshift32 */
+static uint32_t Random(uint32_t *state)
+{
+	uint32_t x = (*state != 0) ? *state : 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static double GetTimeSeconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
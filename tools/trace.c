@@ -0,0 +1,142 @@
+/* \file trace.c
+ * \brief Prints saved dfplayer frame traces as decoded frames with inter-frame gaps
+ *
+ * Traces are recorded by the library when built with DFPLAYER_TRACE and saved with
+ * dfplayer_GetTrace() as a dfplayer_trace_file_t header followed by its entries (the Linux
+ * example's -T option does this).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfplayer_private.h"
+#include "dfplayer.h"
+
+#define TRACE_COMMAND_NAME(name, code, group, priority, parameter_max, decoder, argument) [code] = #name,
+static const char * const trace_command_names[DFPLAYER_CMD_COUNT] =
+{
+	DFPLAYER_COMMANDS(TRACE_COMMAND_NAME)
+};
+#undef TRACE_COMMAND_NAME
+
+static int DumpTrace(const char *path);
+static void PrintEntry(const dfplayer_trace_entry_t *entry, double time, double gap, double reply);
+
+int main(int argc, char *argv[])
+{
+	int result = 0;
+	int idx;
+
+	if(argc < 2)
+	{
+		fprintf(stderr, "%s trace-file [trace-file...]\n", argv[0]);
+		return -1;
+	}
+
+	for(idx = 1; idx < argc; ++idx)
+	{
+		if(DumpTrace(argv[idx]) != 0)
+			result = -1;
+	}
+
+	return result;
+}
+
+static int DumpTrace(const char *path)
+{
+	dfplayer_trace_file_t header;
+	dfplayer_trace_entry_t entry;
+	uint32_t first = 0;
+	uint32_t previous = 0;
+	uint32_t last_tx = 0;
+	bool pending_tx = false;
+	uint32_t counts[2] = { 0, 0 };
+	double reply_total = 0, reply_max = 0;
+	uint32_t replies = 0;
+	uint32_t idx;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if(NULL == file)
+	{
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		return -1;
+	}
+
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != DFPLAYER_TRACE_FILE_MAGIC
+	|| header.version != DFPLAYER_TRACE_FILE_VERSION || header.entry_size != sizeof(entry))
+	{
+		fprintf(stderr, "'%s' isn't a dfplayer trace file\n", path);
+		fclose(file);
+		return -1;
+	}
+
+	printf("%s: %u frames, %u us per timestamp unit\n", path, header.count, header.resolution);
+	printf("%12s %10s %10s  dir  frame                           command\n", "time (ms)", "gap (ms)", "reply (ms)");
+
+	for(idx = 0; idx < header.count; ++idx)
+	{
+		double time, gap, reply = -1;
+
+		if(fread(&entry, sizeof(entry), 1, file) != 1)
+		{
+			fprintf(stderr, "'%s' is truncated after %u frames\n", path, idx);
+			break;
+		}
+
+		if(0 == idx)
+			first = entry.timestamp;
+		time = (uint32_t) (entry.timestamp - first) * (double) header.resolution / 1000.0;
+		/* Negative when a message queued by the receive interrupt is dispatched after a later frame */
+		gap = (idx > 0) ? (int32_t) (entry.timestamp - previous) * (double) header.resolution / 1000.0 : 0;
+		previous = entry.timestamp;
+
+		/* Time from the last command sent to the first message received after it */
+		if(DFPLAYER_TRACE_TX == entry.direction)
+		{
+			last_tx = entry.timestamp;
+			pending_tx = true;
+		}
+		else if(pending_tx && (int32_t) (entry.timestamp - last_tx) >= 0)
+		{
+			reply = (uint32_t) (entry.timestamp - last_tx) * (double) header.resolution / 1000.0;
+			reply_total += reply;
+			if(reply > reply_max)
+				reply_max = reply;
+			++replies;
+			pending_tx = false;
+		}
+
+		++counts[(DFPLAYER_TRACE_TX == entry.direction) ? 1 : 0];
+		PrintEntry(&entry, time, gap, reply);
+	}
+
+	printf("%u sent, %u received", counts[1], counts[0]);
+	if(replies > 0)
+		printf(", reply time %.3f ms mean, %.3f ms max over %u replies", reply_total / replies, reply_max, replies);
+	printf("\n");
+
+	fclose(file);
+	return 0;
+}
+
+static void PrintEntry(const dfplayer_trace_entry_t *entry, double time, double gap, double reply)
+{
+	const uint8_t *frame = entry->frame;
+	const char *name = (frame[3] < DFPLAYER_CMD_COUNT) ? trace_command_names[frame[3]] : NULL;
+	uint16_t checksum = ((uint16_t) frame[7] << 8) | frame[8];
+	uint16_t value = ((uint16_t) frame[5] << 8) | frame[6];
+	int idx;
+
+	printf("%12.3f %10.3f ", time, gap);
+	if(reply >= 0)
+		printf("%10.3f ", reply);
+	else
+		printf("%10s ", "");
+	printf(" %s  ", (DFPLAYER_TRACE_TX == entry->direction) ? "TX" : "RX");
+	for(idx = 0; idx < DFPLAYER_FRAME_LENGTH; ++idx)
+		printf("%02x ", frame[idx]);
+	printf(" %s%s value=%u%s%s\n", (name != NULL) ? name : "UNKNOWN", (frame[4]) ? " feedback" : "", value,
+		(checksum != DFPLAYER_CHECKSUM(frame[3], frame[4], frame[5], frame[6])) ? " BAD-CHECKSUM" : "",
+		(frame[0] != DFPLAYER_MSG_START || frame[9] != DFPLAYER_MSG_END) ? " BAD-FRAMING" : "");
+}